@@ -47,6 +47,16 @@
     #define RPI_PIN_EN      A,10
     #define RPI_PIN_ACK     A,11
     #define RPI_PIN_INT     A,12
+
+    // /EN is also TIM1_CH3, so burst data phases can be done by DMA.
+    #define RPI_BUS_DMA
+
+    // SPI transport. These share pins with the top half of the
+    // parallel data bus and connect to the Pi's SPI0.
+    #define RPI_PIN_NSS     A,4
+    #define RPI_PIN_SCK     A,5
+    #define RPI_PIN_MISO    A,6
+    #define RPI_PIN_MOSI    A,7
 #endif
 
 #define CAN_TX_PIN      B,8
@@ -56,6 +56,15 @@ led_t leds[] = {
 
 static volatile uint32_t sys_counter;
 
+/*
+ * State of the data phase of a burst register access, if one's in
+ * progress. See tbgrpi_protocol.h.
+ */
+static uint8_t *burst_buf;
+static uint8_t burst_len;
+static uint8_t burst_pos;
+static uint8_t burst_wr;
+
 void TIM2_IRQHandler(void)
 {
     /* Reset the interrupt flag */
@@ -63,7 +72,87 @@ void TIM2_IRQHandler(void)
     sys_counter++;
 
     led_run();
+    tbg_rpi_tick();
+}
+
+#ifdef RPI_BUS_DMA
+/*
+ * Burst data phases are done by DMA, paced by /EN. /EN is TIM1_CH3 and
+ * both IC3 and IC4 capture its falling edge. CC3 triggers DMA1 channel
+ * 6, which latches the data bus into the buffer (or puts the next byte
+ * on it). CC4 triggers DMA1 channel 4, which then flips /ACK by writing
+ * the next word from bus_ack_words to BSRR. We only get an interrupt
+ * when the last byte has gone.
+ */
+static uint32_t bus_ack_words[TBGRPI_BURST_DATA_MAX];
+static uint32_t bus_rd_words[TBGRPI_BURST_DATA_MAX];
+
+static void bus_dma_setup(void)
+{
+    NVIC_InitTypeDef NVIC_InitStructure;
+
+    RCC->APB2ENR |= RCC_APB2ENR_TIM1EN;
+    RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+
+    // /ACK goes low for the first byte, high for the next and so on.
+    for (int i = 0; i < TBGRPI_BURST_DATA_MAX; i++) {
+        bus_ack_words[i] = (i & 1) ? MASK(RPI_PIN_ACK) : MASK(RPI_PIN_ACK) << 16;
+    }
+
+    TIM1->PSC = 0;
+    TIM1->ARR = 0xffff;
+    TIM1->CCMR2 = TIM_CCMR2_CC3S_0 | TIM_CCMR2_CC4S_1; // IC3 & IC4 both on TI3
+    TIM1->CCER = TIM_CCER_CC3E | TIM_CCER_CC3P | TIM_CCER_CC4E | TIM_CCER_CC4P; // Falling edges
+    TIM1->DIER = 0;
+    TIM1->CR1 = TIM_CR1_CEN;
+
+    NVIC_InitStructure.NVIC_IRQChannel = DMA1_Channel4_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 3;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+}
+
+/*
+ * Hand the data phase of a burst over to DMA. Called at the end of the
+ * count byte cycle, before /ACK is de-asserted.
+ */
+static void bus_dma_start(void)
+{
+    // Leave /EN to the timer until it's all over.
+    EXTI->IMR &= ~MASK(RPI_PIN_EN);
+
+    // TIM1_CH3 is DMA1 channel 6
+    DMA1_Channel6->CCR = 0;
+    DMA1_Channel6->CNDTR = burst_len;
+    if (burst_wr) {
+        DMA1_Channel6->CPAR = (uint32_t)&PORT(RPI_PIN_D0)->IDR;
+        DMA1_Channel6->CMAR = (uint32_t)burst_buf;
+        DMA1_Channel6->CCR = DMA_CCR6_PL | DMA_CCR6_PSIZE_0 | DMA_CCR6_MINC | DMA_CCR6_EN;
+    } else {
+        for (int i = 0; i < burst_len; i++) {
+            bus_rd_words[i] = (0xff << 16) | burst_buf[i];
+        }
+        PORT(RPI_PIN_D0)->CRL = 0x33333333;
+        DMA1_Channel6->CPAR = (uint32_t)&PORT(RPI_PIN_D0)->BSRR;
+        DMA1_Channel6->CMAR = (uint32_t)bus_rd_words;
+        DMA1_Channel6->CCR = DMA_CCR6_PL | DMA_CCR6_PSIZE_1 | DMA_CCR6_MSIZE_1 |
+            DMA_CCR6_MINC | DMA_CCR6_DIR | DMA_CCR6_EN;
+    }
+
+    // TIM1_CH4 is DMA1 channel 4
+    DMA1_Channel4->CCR = 0;
+    DMA1_Channel4->CNDTR = burst_len;
+    DMA1_Channel4->CPAR = (uint32_t)&PORT(RPI_PIN_ACK)->BSRR;
+    DMA1_Channel4->CMAR = (uint32_t)bus_ack_words;
+    DMA1_Channel4->CCR = DMA_CCR4_PL_1 | DMA_CCR4_PSIZE_1 | DMA_CCR4_MSIZE_1 |
+        DMA_CCR4_MINC | DMA_CCR4_DIR | DMA_CCR4_TCIE | DMA_CCR4_EN;
+
+    // Forget the count byte's falling edge and start.
+    TIM1->SR = 0;
+    TIM1->DIER = TIM_DIER_CC3DE | TIM_DIER_CC4DE;
 }
+#endif // RPI_BUS_DMA
 
 static void rpi_bus_setup(void)
 {
@@ -102,7 +191,79 @@ static void rpi_bus_setup(void)
     NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
     NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
     NVIC_Init(&NVIC_InitStructure);
+
+#ifdef RPI_BUS_DMA
+    bus_dma_setup();
+#endif
+}
+
+#ifdef TBGRPI_SPI
+/*
+ * SPI transport: SPI1 slave with both directions done by DMA. A whole
+ * frame is exchanged per transaction and we only get involved at the
+ * end of it, when /NSS goes high.
+ */
+static uint8_t spi_rx_frame[TBGRPI_SPI_FRAME_SIZE];
+static uint8_t spi_tx_frame[TBGRPI_SPI_FRAME_SIZE];
+
+static void spi_dma_start(void)
+{
+    // Reset SPI1 to throw away anything left over from a short frame.
+    RCC->APB2RSTR |= RCC_APB2RSTR_SPI1RST;
+    RCC->APB2RSTR &= ~RCC_APB2RSTR_SPI1RST;
+
+    // SPI1 RX is DMA1 channel 2
+    DMA1_Channel2->CCR = 0;
+    DMA1_Channel2->CPAR = (uint32_t)&SPI1->DR;
+    DMA1_Channel2->CMAR = (uint32_t)spi_rx_frame;
+    DMA1_Channel2->CNDTR = TBGRPI_SPI_FRAME_SIZE;
+    DMA1_Channel2->CCR = DMA_CCR2_PL_1 | DMA_CCR2_MINC | DMA_CCR2_EN;
+
+    // SPI1 TX is DMA1 channel 3
+    DMA1_Channel3->CCR = 0;
+    DMA1_Channel3->CPAR = (uint32_t)&SPI1->DR;
+    DMA1_Channel3->CMAR = (uint32_t)spi_tx_frame;
+    DMA1_Channel3->CNDTR = TBGRPI_SPI_FRAME_SIZE;
+    DMA1_Channel3->CCR = DMA_CCR3_PL_1 | DMA_CCR3_MINC | DMA_CCR3_DIR | DMA_CCR3_EN;
+
+    // Slave, mode 0, 8-bit, MSB first, hardware /NSS.
+    SPI1->CR2 = SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN;
+    SPI1->CR1 = SPI_CR1_SPE;
+}
+
+static void rpi_spi_setup(void)
+{
+    NVIC_InitTypeDef NVIC_InitStructure;
+
+    RCC->APB2ENR |= RCC_APB2ENR_SPI1EN;
+    RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+
+    GPIO_SETUP(RPI_PIN_NSS, GPIO_TYPE_INPUT_PULLED);
+    SET(RPI_PIN_NSS); // Pull-up for /NSS.
+    GPIO_SETUP(RPI_PIN_SCK, GPIO_TYPE_INPUT_FLOATING);
+    GPIO_SETUP(RPI_PIN_MOSI, GPIO_TYPE_INPUT_FLOATING);
+    GPIO_SETUP(RPI_PIN_MISO, GPIO_TYPE_ALTERNATE_PUSHPULL);
+
+    // /INT output
+    GPIO_SETUP(RPI_PIN_INT, GPIO_TYPE_OUTPUT_PUSHPULL);
+    SET(RPI_PIN_INT);
+
+    // The Pi's first frame gets all zeros back: no records, no status.
+    spi_dma_start();
+
+    // External int on rising edge of /NSS marks end of frame.
+    EXTI->IMR = MASK(RPI_PIN_NSS);
+    EXTI->RTSR = MASK(RPI_PIN_NSS);
+    EXTI->FTSR = 0;
+    AFIO->EXTICR[1] = (0 << 0); // Use Port A for ext int 4
+
+    NVIC_InitStructure.NVIC_IRQChannel = EXTI4_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 3;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
 }
+#endif // TBGRPI_SPI
 
 #ifdef OLD_HAT
 static void usart_setup(void)
@@ -198,6 +359,7 @@ int main(void)
     AFIO->MAPR |= AFIO_MAPR_SWJ_CFG_NOJNTRST;
 
     timer2_setup();
+    tbg_time_setup();
 
     board_setup();
 
@@ -205,9 +367,13 @@ int main(void)
     usart_setup();    
 #endif // OLD_HAT
 
+#ifdef TBGRPI_SPI
+    rpi_spi_setup();
+#else
     rpi_bus_setup();
+#endif
 
-    tbg_can_setup(TBG_CAN_SETUP_RX_IE | TBG_CAN_SETUP_TX_IE);
+    tbg_can_setup(TBG_CAN_SETUP_RX_IE | TBG_CAN_SETUP_RX1_IE | TBG_CAN_SETUP_TX_IE);
 
     __enable_irq();
 
@@ -219,6 +385,7 @@ int main(void)
     CLR(LED_RED_PIN);
 
     while (1) {
+        tbg_rpi_poll();
         /* Un-comment for interrupt test.
         if (sys_counter & 0x40) {
             SET(RPI_PIN_INT);
@@ -252,6 +419,41 @@ void assert_failed(uint8_t* file, uint32_t line)
 #endif
 
 
+/*
+ * One byte of a burst data phase, done in software. Called on the
+ * falling edge of /EN.
+ */
+static void burst_cycle(void)
+{
+    if (burst_wr) {
+        burst_buf[burst_pos] = PORT(RPI_PIN_D0)->IDR & 0xff;
+    } else {
+        PORT(RPI_PIN_D0)->CRL = 0x33333333;
+        PORT(RPI_PIN_D0)->BSRR = (0xff << 16) | burst_buf[burst_pos];
+    }
+    // Two-phase handshake: /ACK changes state once per byte.
+    if (burst_pos & 1) {
+        SET(RPI_PIN_ACK);
+    } else {
+        CLR(RPI_PIN_ACK);
+    }
+    burst_pos++;
+}
+
+/*
+ * End of a burst data phase. Called once /EN is high after the last
+ * byte, which left /ACK low.
+ */
+static void burst_finish(void)
+{
+    led_pulse(LED_RED, LED_BLINK_DURATION);
+    tbg_rpi_burst_end();
+    burst_len = 0;
+    // Make data bus an input (default state.)
+    PORT(RPI_PIN_D0)->CRL = 0x44444444;
+    SET(RPI_PIN_ACK); // Ready for the next cycle.
+}
+
 void EXTI15_10_IRQHandler(void)
 {
 
@@ -262,6 +464,17 @@ void EXTI15_10_IRQHandler(void)
      */
     EXTI->PR = MASK(RPI_PIN_EN);
     uint8_t state = IS_SET(RPI_PIN_EN);
+    if (burst_len) {
+        if (burst_pos < burst_len) {
+            // Rising edges mean nothing in the data phase.
+            if (state == 0) {
+                burst_cycle();
+            }
+        } else if (state) {
+            burst_finish();
+        }
+        return;
+    }
     if (state == 0) {
         led_pulse(LED_RED, LED_BLINK_DURATION);
         uint8_t data;
@@ -292,30 +505,98 @@ void EXTI15_10_IRQHandler(void)
     } else {
         // Make data bus an input (default state.)
         PORT(RPI_PIN_D0)->CRL = 0x44444444;
+        // If that was a burst count byte, get ready for the data
+        // before letting the Pi carry on.
+        burst_len = tbg_rpi_burst_start(&burst_buf, &burst_wr);
+        if (burst_len) {
+            burst_pos = 0;
+#ifdef RPI_BUS_DMA
+            bus_dma_start();
+#endif
+        }
         SET(RPI_PIN_ACK); // De-assert ACK
    }
 }
 
+#ifdef RPI_BUS_DMA
+/*
+ * DMA has done the last byte of a burst. Stop it and have the /EN
+ * interrupt finish off once the Pi raises /EN, which it may have
+ * done already.
+ */
+void DMA1_Channel4_IRQHandler(void)
+{
+    DMA1->IFCR = DMA_IFCR_CGIF4;
+    TIM1->DIER = 0;
+    DMA1_Channel6->CCR = 0;
+    DMA1_Channel4->CCR = 0;
+    burst_pos = burst_len;
+
+    EXTI->PR = MASK(RPI_PIN_EN);
+    EXTI->IMR |= MASK(RPI_PIN_EN);
+    EXTI->SWIER = MASK(RPI_PIN_EN);
+}
+#endif // RPI_BUS_DMA
+
+#ifdef TBGRPI_SPI
+void EXTI4_IRQHandler(void)
+{
+    EXTI->PR = MASK(RPI_PIN_NSS);
+
+    DMA1_Channel2->CCR &= ~DMA_CCR2_EN;
+    DMA1_Channel3->CCR &= ~DMA_CCR3_EN;
+
+    // Only act on complete frames. If the frame was cut short, the Pi
+    // will have thrown away what we sent, so send the same again.
+    if (DMA1_Channel2->CNDTR == 0) {
+        led_pulse(LED_RED, LED_BLINK_DURATION);
+        tbg_rpi_spi_frame_rx(spi_rx_frame);
+        tbg_rpi_spi_frame_tx(spi_tx_frame);
+    }
+    spi_dma_start();
+}
+#endif // TBGRPI_SPI
+
 void USB_LP_CAN1_RX0_IRQHandler(void)
 {
-    tbg_msg_t msg;
+    uint32_t stamp = tbg_time_us();
+
+    // Put messages from the CAN hardware into Rx FIFO, update
+    // status reg and raise RX interrupt on Pi (if enabled)
+    tbg_rpi_rxda_int(0, stamp);
+
+    if (CAN1->RF0R & CAN_RF0R_FOVR0) {
+        CAN1->RF0R = CAN_RF0R_FOVR0;
+        tbg_rpi_rx_lost();
+    }
+
+    led_pulse(LED_GRN, LED_BLINK_DURATION);
+}
+
+void CAN1_RX1_IRQHandler(void)
+{
+    uint32_t stamp = tbg_time_us();
 
-    // Get the message from the CAN hardware
-    tbg_can_rx(&msg);
+    tbg_rpi_rxda_int(1, stamp);
 
-    // Put message into Rx FIFO, update status reg
-    // and raise RX interrupt on Pi (if enabled)
-    tbg_rpi_rxda_int(&msg);
+    if (CAN1->RF1R & CAN_RF1R_FOVR1) {
+        CAN1->RF1R = CAN_RF1R_FOVR1;
+        tbg_rpi_rx_lost();
+    }
 
     led_pulse(LED_GRN, LED_BLINK_DURATION);
 }
 
 void USB_HP_CAN1_TX_IRQHandler(void)
 {
-    uint32_t tsr = CAN1->TSR;
-    if (tsr & CAN_TSR_RQCP2) CAN1->TSR |= CAN_TSR_RQCP2;
-    if (tsr & CAN_TSR_RQCP1) CAN1->TSR |= CAN_TSR_RQCP1;
-    if (tsr & CAN_TSR_RQCP0) CAN1->TSR |= CAN_TSR_RQCP0;
+    uint32_t stamp = tbg_time_us();
+
+    // Time sync first: it needs to see which mailboxes are done
+    // before they're cleared.
+    tbg_rpi_time_sync_int(stamp);
+
+    // Refill the mailboxes from the TX queues.
+    tbg_can_tx_int();
 
     // Update status reg & raise interrupt (if enabled)
     tbg_rpi_txe_int();
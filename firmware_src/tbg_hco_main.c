@@ -67,14 +67,30 @@
 
 static tbg_node_t node;
 
+// The ADC converts every channel once per PWM cycle. DMA puts the scans
+// in alternate halves of adc_raw, interrupting as each one fills, and
+// the interrupt adds the scan to adc_acc. Every ADC_OVERSAMPLE scans the
+// sums are published in adc_data, with adc_seq bumped so readers can
+// tell if they've been overtaken (see adc_snapshot().) 16 12-bit samples
+// sum to a 16-bit value, 0-65520, with some extra resolution from the
+// noise averaging out.
+#define ADC_OVERSAMPLE          (16)
+
+static volatile uint16_t adc_raw[2][ADC_CHANNELS_NUMOF];
+static const volatile uint16_t *volatile adc_latest = adc_raw[0]; // Last full scan
+static uint32_t adc_acc[ADC_CHANNELS_NUMOF];
+static uint8_t adc_acc_n;
+
 volatile uint16_t adc_data[ADC_CHANNELS_NUMOF];
+static volatile uint32_t adc_seq;
 
 volatile uint16_t inhibit_faults; // Disable outputs if non-zero
 
 volatile uint16_t undervolt_inhibit = UNDERVOLT_INHIBIT_TIME; // Inhibit undervolt time counter
 
 static tbg_msg_t rx_msg_bufs[8];
-static tbg_msg_fifo_t rx_msg_fifo = { .in = 0, .out = 0, .used = 0, .size = sizeof(rx_msg_bufs)/sizeof(tbg_msg_t), .bufs = rx_msg_bufs };
+static uint32_t rx_msg_stamps[8];
+static tbg_msg_fifo_t rx_msg_fifo = { .in = 0, .out = 0, .size = sizeof(rx_msg_bufs)/sizeof(tbg_msg_t), .bufs = rx_msg_bufs, .stamps = rx_msg_stamps };
 
 #define PWM_RELOAD              (1440-1) // 25 KHz
 #define LED_BLINK_DURATION      (25) // Milliseconds
@@ -93,6 +109,169 @@ static void set_enables(uint8_t x, uint8_t msk);
 static uint8_t get_enables(void);
 static void setup_enables(void);
 
+#define PWM_CHANNELS            (8)
+#define PWM_HZ                  (25000)
+
+static volatile uint16_t *const pwm_ccrs[PWM_CHANNELS] = {
+    &TIM1->CCR1, &TIM1->CCR2, &TIM1->CCR3, &TIM1->CCR4,
+    &TIM3->CCR1, &TIM3->CCR2, &TIM3->CCR3, &TIM3->CCR4,
+};
+
+// PWM ramps. Each PWM cycle, TIM1_UP_IRQHandler moves the duty of the
+// channels in pwm_ramping a step (in 1/65536ths of a count) towards
+// their targets.
+typedef struct pwm_ramp_s {
+    uint32_t value;     // Duty << 16
+    uint32_t target;    // likewise
+    int32_t step;
+} pwm_ramp_t;
+
+static pwm_ramp_t pwm_ramps[PWM_CHANNELS];
+static volatile uint8_t pwm_ramping;
+
+static void pwm_ramp_run(void)
+{
+    uint8_t ramping = pwm_ramping;
+
+    while (ramping) {
+        int i = __builtin_ctz(ramping);
+        pwm_ramp_t *r = pwm_ramps + i;
+        // Check the distance left before stepping, as a step past zero
+        // (or the top) would wrap.
+        uint32_t left = (r->step > 0) ? r->target - r->value : r->value - r->target;
+        uint32_t step = (r->step > 0) ? (uint32_t)r->step : -(uint32_t)r->step;
+        if (left <= step) {
+            r->value = r->target;
+            pwm_ramping &= ~(1 << i);
+        } else {
+            r->value += r->step;
+        }
+        *pwm_ccrs[i] = r->value >> 16;
+        ramping &= ramping - 1;
+    }
+}
+
+/*
+ * Ramp the channels in mask from where they are to duty over ms
+ * milliseconds.
+ */
+static void pwm_ramp_start(uint8_t mask, uint16_t duty, uint16_t ms)
+{
+    uint32_t cycles = (uint32_t)ms * (PWM_HZ / 1000);
+
+    for (int i = 0; i < PWM_CHANNELS; i++) {
+        if (!(mask & (1 << i))) {
+            continue;
+        }
+        __disable_irq();
+        pwm_ramp_t *r = pwm_ramps + i;
+        r->value = (uint32_t)*pwm_ccrs[i] << 16;
+        r->target = (uint32_t)duty << 16;
+        r->step = cycles ? ((int32_t)(r->target - r->value)) / (int32_t)cycles : 0;
+        if (r->step == 0) {
+            r->step = (r->target >= r->value) ? 1 : -1;
+        }
+        if (!cycles || r->value == r->target) {
+            *pwm_ccrs[i] = duty;
+            pwm_ramping &= ~(1 << i);
+        } else {
+            pwm_ramping |= 1 << i;
+        }
+        __enable_irq();
+    }
+}
+
+// Setting the duty directly stops any ramp.
+static void pwm_ramp_stop(uint8_t mask)
+{
+    __disable_irq();
+    pwm_ramping &= ~mask;
+    __enable_irq();
+}
+
+// Motion buffer, see TBG_MOTION_CMD_POINT. The request handler is the
+// only one to move motion_in and TIM1_UP_IRQHandler motion_out, except
+// that a stop empties it with interrupts off.
+#define MOTION_BUF_SIZE         (128)   // Power of 2, up to 128 (uint8_t indices)
+
+typedef struct motion_point_s {
+    uint16_t duty;
+    uint16_t dwell;     // PWM cycles
+    uint8_t mask;
+} motion_point_t;
+
+static motion_point_t motion_buf[MOTION_BUF_SIZE];
+static volatile uint8_t motion_in;
+static volatile uint8_t motion_out;
+static volatile uint8_t motion_state;
+static volatile uint16_t motion_underruns;
+static uint32_t motion_start;       // tbg_time_us() to start when armed
+static uint16_t motion_dwell;       // Cycles left of the current point
+static uint8_t motion_starved;
+static uint8_t motion_channels;     // Channels in the points queued since the last stop
+
+static void motion_run(void)
+{
+    if (motion_state == TBG_MOTION_STATE_ARMED) {
+        if ((int32_t)(tbg_time_us() - motion_start) < 0) {
+            return;
+        }
+        motion_state = TBG_MOTION_STATE_RUNNING;
+        motion_dwell = 0;
+    }
+    if (motion_state != TBG_MOTION_STATE_RUNNING) {
+        return;
+    }
+    if (motion_dwell && --motion_dwell) {
+        return;
+    }
+
+    int ended = 0;
+    while (motion_out != motion_in) {
+        motion_point_t *p = motion_buf + (motion_out & (MOTION_BUF_SIZE - 1));
+        uint8_t mask = p->mask;
+        pwm_ramping &= ~mask;
+        while (mask) {
+            *pwm_ccrs[__builtin_ctz(mask)] = p->duty;
+            mask &= mask - 1;
+        }
+        motion_out++;
+        if (p->dwell) {
+            motion_dwell = p->dwell;
+            motion_starved = 0;
+            return;
+        }
+        ended = 1;
+    }
+
+    // Ran dry: the end if the last point had no dwell, otherwise we
+    // hold where we are until more arrive.
+    if (ended) {
+        motion_state = TBG_MOTION_STATE_IDLE;
+    } else if (!motion_starved) {
+        motion_underruns++;
+        motion_starved = 1;
+    }
+}
+
+static void motion_stop(void)
+{
+    __disable_irq();
+    motion_state = TBG_MOTION_STATE_IDLE;
+    motion_out = motion_in;
+    __enable_irq();
+    motion_channels = 0;
+}
+
+// Setting the duty of a channel in the profile, directly or with a
+// ramp, stops the playback, or it would be overwritten by the next point.
+static void motion_release(uint8_t mask)
+{
+    if (motion_state != TBG_MOTION_STATE_IDLE && (motion_channels & mask)) {
+        motion_stop();
+    }
+}
+
 static volatile uint32_t sys_counter;
 
 void TIM1_UP_IRQHandler(void)
@@ -103,9 +282,14 @@ void TIM1_UP_IRQHandler(void)
     // Trigger ADC conversion
     ADC1->CR2 |= ADC_CR2_SWSTART;
 
-    uint16_t v_in = adc_data[VIN_CH];
-    uint16_t v_bus = adc_data[VBUS_CH];
-    uint16_t T_brake = adc_data[BRAKE_TEMP_CH];
+    pwm_ramp_run();
+    motion_run();
+
+    // Protection works from the last single scan, for speed.
+    const volatile uint16_t *scan = adc_latest;
+    uint16_t v_in = scan[VIN_CH];
+    uint16_t v_bus = scan[VBUS_CH];
+    uint16_t T_brake = scan[BRAKE_TEMP_CH];
 
     if (v_bus > (v_in + DELTA_BRAKE_ON) && v_bus > THR_BRAKE_MIN_VBUS ) {
         SET(BRAKE_PIN);
@@ -161,6 +345,52 @@ void TIM1_UP_IRQHandler(void)
     }
 }
 
+static void adc_scan_done(const volatile uint16_t *scan)
+{
+    adc_latest = scan;
+    for (int i = 0; i < ADC_CHANNELS_NUMOF; i++) {
+        adc_acc[i] += scan[i];
+    }
+    if (++adc_acc_n == ADC_OVERSAMPLE) {
+        for (int i = 0; i < ADC_CHANNELS_NUMOF; i++) {
+            adc_data[i] = adc_acc[i];
+            adc_acc[i] = 0;
+        }
+        adc_acc_n = 0;
+        adc_seq++;
+    }
+}
+
+void DMA1_Channel1_IRQHandler(void)
+{
+    uint32_t isr = DMA1->ISR;
+
+    DMA1->IFCR = isr & (DMA_IFCR_CHTIF1 | DMA_IFCR_CTCIF1 | DMA_IFCR_CGIF1);
+    if (isr & DMA_ISR_HTIF1) {
+        adc_scan_done(adc_raw[0]);
+    }
+    if (isr & DMA_ISR_TCIF1) {
+        adc_scan_done(adc_raw[1]);
+    }
+}
+
+/*
+ * Copy n channels of adc_data from start, all from the same set of
+ * scans. The DMA interrupt can't be interrupted by us, so if the
+ * sequence number hasn't changed nothing was published mid-copy.
+ */
+static void adc_snapshot(uint16_t *dst, int start, int n)
+{
+    uint32_t seq;
+
+    do {
+        seq = adc_seq;
+        for (int i = 0; i < n; i++) {
+            dst[i] = adc_data[start + i];
+        }
+    } while (seq != adc_seq);
+}
+
 void TIM2_IRQHandler(void)
 {
     /* Reset the interrupt flag */
@@ -289,21 +519,30 @@ void adc_dma_init()
     // Configuration Register
     DMA1_Channel1->CCR &= ~DMA_CCR1_EN;
 
-    // Number of data units to transfer.
-    DMA1_Channel1->CNDTR = ADC_CHANNELS_NUMOF;
+    // Number of data units to transfer: two scans, one in each half.
+    DMA1_Channel1->CNDTR = 2 * ADC_CHANNELS_NUMOF;
 
     // Set peripheral data register address (source.)
     DMA1_Channel1->CPAR = ((uint32_t)0x4001244C);
 
     // Memory address (destination.)
-    DMA1_Channel1->CMAR = ((uint32_t)adc_data);
+    DMA1_Channel1->CMAR = ((uint32_t)adc_raw);
 
     // Channel control register.
     DMA1_Channel1->CCR = 
         DMA_CCR1_MSIZE_0 |  // 16-bits
         DMA_CCR1_PSIZE_0 |  // 16-bits
         DMA_CCR1_MINC |     // Increment memory
-        DMA_CCR1_CIRC;      // Circular mode (i.e. don't quite after one xfer)
+        DMA_CCR1_CIRC |     // Circular mode (i.e. don't quite after one xfer)
+        DMA_CCR1_HTIE |     // Interrupt as each scan completes
+        DMA_CCR1_TCIE;
+
+    NVIC_InitTypeDef NVIC_InitStructure;
+    NVIC_InitStructure.NVIC_IRQChannel = DMA1_Channel1_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 2;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
 
     DMA1_Channel1->CCR |= DMA_CCR1_EN;        // Enable channel
 
@@ -445,6 +684,8 @@ static int pwm_out_ch(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_por
 {
     uint8_t channel = req->data[0];
     uint16_t value = req->data[1] | req->data[2] << 8;
+    pwm_ramp_stop(1 << channel);
+    motion_release(1 << channel);
     switch (channel) {
         case 0:
             TIM1->CCR1 = value;
@@ -479,6 +720,8 @@ static int pwm_out_0_3(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_po
 {
     uint16_t *value = (uint16_t *)req->data;
 
+    pwm_ramp_stop(0x0f);
+    motion_release(0x0f);
     TIM1->CCR1 = value[0];
     TIM1->CCR2 = value[1];
     TIM1->CCR3 = value[2];
@@ -492,6 +735,8 @@ static int pwm_out_4_7(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_po
 {
     uint16_t *value = (uint16_t *)req->data;
 
+    pwm_ramp_stop(0xf0);
+    motion_release(0xf0);
     TIM3->CCR1 = value[0];
     TIM3->CCR2 = value[1];
     TIM3->CCR3 = value[2];
@@ -501,6 +746,93 @@ static int pwm_out_4_7(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_po
     return 1;
 }
 
+/*
+ * Ramp channels to a new duty, see TBG_PWM_RAMP_REQ_DATA_MASK.
+ */
+static int pwm_ramp(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port)
+{
+    uint16_t duty, ms;
+
+    if (req->len != TBG_PWM_RAMP_REQ_LEN) {
+        return tbg_err_resp(req, resp, TBG_ERR_LENGTH);
+    }
+    memcpy(&duty, req->data + TBG_PWM_RAMP_REQ_DATA_DUTY, sizeof(duty));
+    memcpy(&ms, req->data + TBG_PWM_RAMP_REQ_DATA_MS, sizeof(ms));
+    if (duty > PWM_RELOAD + 1) {
+        return tbg_err_resp(req, resp, TBG_ERR_RANGE);
+    }
+    motion_release(req->data[TBG_PWM_RAMP_REQ_DATA_MASK]);
+    pwm_ramp_start(req->data[TBG_PWM_RAMP_REQ_DATA_MASK], duty, ms);
+    resp->len = 0;
+    return 1;
+}
+
+static int motion_buf_port(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port)
+{
+    uint8_t used = motion_in - motion_out;
+    uint16_t free = MOTION_BUF_SIZE - used;
+    uint32_t now;
+
+    if (req->len < 1) {
+        return tbg_err_resp(req, resp, TBG_ERR_LENGTH);
+    }
+    switch (req->data[TBG_MOTION_REQ_DATA_CMD]) {
+    case TBG_MOTION_CMD_POINT:
+        if (req->len != TBG_MOTION_POINT_REQ_LEN) {
+            return tbg_err_resp(req, resp, TBG_ERR_LENGTH);
+        }
+        if (free == 0) {
+            return tbg_err_resp(req, resp, TBG_ERR_RANGE);
+        }
+        motion_point_t *p = motion_buf + (motion_in & (MOTION_BUF_SIZE - 1));
+        p->mask = req->data[TBG_MOTION_POINT_REQ_DATA_MASK];
+        memcpy(&p->duty, req->data + TBG_MOTION_POINT_REQ_DATA_DUTY, sizeof(p->duty));
+        memcpy(&p->dwell, req->data + TBG_MOTION_POINT_REQ_DATA_DWELL, sizeof(p->dwell));
+        if (p->duty > PWM_RELOAD + 1) {
+            return tbg_err_resp(req, resp, TBG_ERR_RANGE);
+        }
+        motion_channels |= p->mask;
+        // The point must be in place before the ISR can see it.
+        TBG_MSG_FIFO_BARRIER();
+        motion_in++;
+        free--;
+        memcpy(resp->data, &free, sizeof(free));
+        resp->len = sizeof(free);
+        break;
+    case TBG_MOTION_CMD_START:
+        if (req->len != 1 && req->len != TBG_MOTION_START_REQ_LEN) {
+            return tbg_err_resp(req, resp, TBG_ERR_LENGTH);
+        }
+        now = tbg_time_us();
+        if (req->len == TBG_MOTION_START_REQ_LEN) {
+            uint32_t at;
+            memcpy(&at, req->data + TBG_MOTION_START_REQ_DATA_TIME, sizeof(at));
+            now += at - tbg_node_time(node, now);
+        }
+        __disable_irq();
+        motion_start = now;
+        motion_state = TBG_MOTION_STATE_ARMED;
+        __enable_irq();
+        resp->len = 0;
+        break;
+    case TBG_MOTION_CMD_STOP:
+        motion_stop();
+        resp->len = 0;
+        break;
+    case TBG_MOTION_CMD_STATUS:
+        resp->data[TBG_MOTION_STATUS_RESP_DATA_STATE] = motion_state;
+        resp->data[TBG_MOTION_STATUS_RESP_DATA_STATE + 1] = 0;
+        memcpy(resp->data + TBG_MOTION_STATUS_RESP_DATA_FREE, &free, sizeof(free));
+        uint16_t underruns = motion_underruns;
+        memcpy(resp->data + TBG_MOTION_STATUS_RESP_DATA_UNDERRUNS, &underruns, sizeof(underruns));
+        resp->len = TBG_MOTION_STATUS_RESP_LEN;
+        break;
+    default:
+        return tbg_err_resp(req, resp, TBG_ERR_VALUE);
+    }
+    return 1;
+}
+
 static struct enable_s {
     GPIO_TypeDef *gpio;
     uint8_t pin;
@@ -582,13 +914,51 @@ static int analogue_in(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_po
         return tbg_err_resp(req, resp, TBG_ERR_RANGE);
     }
 
-    memcpy(resp->data, (void *)(adc_data + start_ch), num_chs * sizeof(uint16_t));
+    uint16_t values[4];
+    adc_snapshot(values, start_ch, num_chs);
+    memcpy(resp->data, values, num_chs * sizeof(uint16_t));
 
     resp->len = num_chs * sizeof(uint16_t);
 
     return 1;
 }
 
+/*
+ * All the analogue inputs, from the same scans, in one go. They take
+ * more than one frame, so all but the last go out from here with
+ * TBG_MSG_CONT set, and the last is the response proper. That only
+ * works as a response, so the port can't be triggered or subscribed to.
+ */
+static int analogue_snapshot(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port)
+{
+    uint16_t values[ADC_CHANNELS_NUMOF];
+    const uint8_t *p = (const uint8_t *)values;
+    int left = sizeof(values);
+
+    if (req->len != 0) {
+        return tbg_err_resp(req, resp, TBG_ERR_LENGTH);
+    }
+    // Only go ahead if there's room for the lot, so none of it gets
+    // dropped. The requester can try again.
+    if (tbg_can_tx_room() < (int)(sizeof(values) + 7) / 8) {
+        return tbg_err_resp(req, resp, TBG_ERR_BUSY);
+    }
+    adc_snapshot(values, 0, ADC_CHANNELS_NUMOF);
+
+    while (left > 8) {
+        TBG_MSG_SET_CONT(resp, TBG_MSG_CONT);
+        memcpy(resp->data, p, 8);
+        resp->len = 8;
+        tbg_msg_tx(resp);
+        p += 8;
+        left -= 8;
+    }
+    TBG_MSG_SET_CONT(resp, 0);
+    memcpy(resp->data, p, left);
+    resp->len = left;
+    return 1;
+}
+
 static int pwm_conf_max_pwm_rd(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
 {
     resp->data[0] = (PWM_RELOAD >> 0 ) & 0xff;
@@ -651,10 +1021,42 @@ static tbg_port_t hco1_ports[] = {
         .port_class = TBG_PORT_CLASS_ANALOGUE_IN,
         .fn = analogue_in,
         .fn_data = NULL,
-        .descr = "Analogue Input;req:{uint8_t channel_start,uint8_t num_channels};resp:{uint16_t[]}",
+        .descr = "Analogue Input;req:{uint8_t channel_start,uint8_t num_channels};resp:{uint16_t[] (16-bit full scale)}",
+        .conf_data = NULL,
+        .confs = NULL,
+        .num_confs = 0,
+    },
+    {
+        .port_number = 13,
+        .port_class = TBG_PORT_CLASS_ANALOGUE_IN,
+        .fn = analogue_snapshot,
+        .fn_data = NULL,
+        .descr = "Analogue Snapshot;req:{};resp:{uint16_t[11] (16-bit full scale), continued}",
+        .conf_data = NULL,
+        .confs = NULL,
+        .num_confs = 0,
+        .flags = TBG_PORT_FLAG_NO_TSTRIGGER | TBG_PORT_FLAG_NO_SUBSCRIBE,
+    },
+    {
+        .port_number = 14,
+        .port_class = TBG_PORT_CLASS_ANALOGUE_OUT_CH,
+        .fn = pwm_ramp,
+        .fn_data = NULL,
+        .descr = "PWM Ramp;{uint8_t channel_mask,uint16_t value,uint16_t ms}",
+        .conf_data = NULL,
+        .confs = pwm_confs,
+        .num_confs = sizeof(pwm_confs)/sizeof(tbg_conf_t),
+    },
+    {
+        .port_number = 15,
+        .port_class = TBG_PORT_CLASS_MOTION_BUF,
+        .fn = motion_buf_port,
+        .fn_data = NULL,
+        .descr = "PWM Motion Buffer;req:{uint8_t cmd,...}",
         .conf_data = NULL,
         .confs = NULL,
         .num_confs = 0,
+        .flags = TBG_PORT_FLAG_NO_TSTRIGGER,
     },
 };
 
@@ -694,10 +1096,13 @@ int main(void)
     AFIO->MAPR |= AFIO_MAPR_SWJ_CFG_NOJNTRST;
 
     timer2_setup();
+    tbg_time_setup();
 
     hco_setup();
 
-    tbg_can_setup(TBG_CAN_SETUP_RX_IE);
+    tbg_node_init(&node);
+    tbg_can_setup(TBG_CAN_SETUP_RX_IE | TBG_CAN_SETUP_TX_IE | TBG_CAN_SETUP_AUTOBAUD);
+    tbg_node_set_filters(&node);
 
     __enable_irq();
 
@@ -715,7 +1120,7 @@ int main(void)
     while (1) {
         tbg_msg_t msg;
 
-        if (tbg_msg_fifo_out(&rx_msg_fifo, &msg)) {
+        if (tbg_msg_fifo_out_stamped(&rx_msg_fifo, &msg, &node.rx_stamp)) {
 
             if (tbg_check_addr_or_broadcast(&node, &msg) && tbg_msg_check_not_resp(&msg)) {
                 led_pulse(LED_GRN, LED_BLINK_DURATION);
@@ -725,6 +1130,7 @@ int main(void)
                 }
             }
         }
+        tbg_node_poll(&node);
     }
 }
 
@@ -749,13 +1155,15 @@ void assert_failed(uint8_t* file, uint32_t line)
 
 #endif
 
-void USB_LP_CAN1_RX0_IRQHandler(void)
+void USB_HP_CAN1_TX_IRQHandler(void)
 {
-    tbg_msg_t msg;
-
-    // Get the message from the CAN hardware
-    tbg_can_rx(&msg);
+    // Refill the mailboxes from the TX queues.
+    tbg_can_tx_int();
+}
 
-    // Put message in our software FIFO.
-    tbg_msg_fifo_in(&rx_msg_fifo, &msg);
+void USB_LP_CAN1_RX0_IRQHandler(void)
+{
+    // Get the messages from the CAN hardware straight into our
+    // software FIFO, with when they arrived for time sync.
+    tbg_can_rx_drain(&rx_msg_fifo, 0, tbg_time_us());
 }
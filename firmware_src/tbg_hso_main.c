@@ -35,10 +35,12 @@
 
 
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 
 static tbg_msg_t rx_msg_bufs[8];
-static tbg_msg_fifo_t rx_msg_fifo = { .in = 0, .out = 0, .used = 0, .size = sizeof(rx_msg_bufs)/sizeof(tbg_msg_t), .bufs = rx_msg_bufs };
+static uint32_t rx_msg_stamps[8];
+static tbg_msg_fifo_t rx_msg_fifo = { .in = 0, .out = 0, .size = sizeof(rx_msg_bufs)/sizeof(tbg_msg_t), .bufs = rx_msg_bufs, .stamps = rx_msg_stamps };
 
 #define LED_BLINK_DURATION      (25) // Milliseconds
 
@@ -110,6 +112,299 @@ static void timer2_setup(void)
     TIM2->DIER = TIM_DIER_UIE;  // Enable update interrupts
 }
 
+// Stepper. TIM3 counts microseconds and makes each step pulse on
+// output 7 (TIM3_CH1) in PWM mode, a period per step. Every period, its
+// update DMA request has DMA1 channel 3 burst the next record of
+// step_recs into ARR, (RCR,) and CCR1, which take effect at the next
+// update; we fill each half of step_recs from the DMA interrupt while the
+// other half goes out. Once a move's done the records turn into idle
+// periods with no pulse, and the first half-buffer entirely of them ends
+// the move. Intervals follow a trapezoidal profile, worked out step by
+// step with D. Austin's approximation: c[n] = c[n-1] - 2c[n-1]/(4n+1).
+#define STEP_PIN                OUTPUT7_PIN
+#define DIR_PIN                 OUTPUT8_PIN
+#define STEP_PINS               (0xc0)  // On GPIOA
+#define STEP_PULSE_US           (5)
+#define STEP_RATE_MAX           (50000) // Steps/s
+// The first interval of a move, 0.676 * sqrt(2 / accel) s, has to fit
+// in TIM3's 16 bits of 1us.
+#define STEP_ACCEL_MIN          (213)   // Steps/s/s
+#define STEP_LEAD_US            (10)    // Direction setup before the first
+#define STEP_IDLE_US            (100)
+#define STEP_BUF_RECS           (32)    // Even
+#define STEP_HALF_RECS          (STEP_BUF_RECS / 2)
+#define STEP_REC_HWORDS         (3)
+
+typedef struct step_rec_s {
+    uint16_t arr;
+    uint16_t rcr;       // Not in TIM3, but in the way
+    uint16_t ccr1;
+} step_rec_t;
+
+static step_rec_t step_recs[STEP_BUF_RECS];
+static uint8_t step_half_idle[2];
+static uint8_t step_pins;           // Outputs taken over by the stepper
+static volatile uint8_t step_state;
+static volatile uint8_t step_ind;   // TBG_STEPPER_IND_* to send, or 0
+static volatile int32_t step_pos;   // Where the last move ended
+static int32_t step_dir;
+static uint32_t step_total;
+static uint32_t step_n;             // Steps queued so far
+static uint32_t step_accel_n;       // Steps to accelerate (and decelerate)
+static uint32_t step_c;             // Interval, 1/256 us
+static uint32_t step_cmin;
+static uint32_t step_cycles;        // Times the DMA's been round step_recs
+
+// The interval after the next step, as ARR.
+static uint16_t step_interval(void)
+{
+    uint32_t i = step_n++;
+
+    if (i == 0) {
+        // As set up for the move
+    } else if (i < step_accel_n) {
+        step_c -= 2 * step_c / (4 * i + 1);
+    } else if (i >= step_total - step_accel_n) {
+        uint32_t m = step_total - i;
+        step_c += 2 * step_c / (4 * m - 1);
+    } else {
+        step_c = step_cmin;
+    }
+    if (step_c < step_cmin) {
+        step_c = step_cmin;
+    }
+    uint32_t us = step_c >> 8;
+    if (us > 0x10000) {
+        us = 0x10000;
+    }
+    return us - 1;
+}
+
+static void step_fill(int half)
+{
+    step_rec_t *r = step_recs + half * STEP_HALF_RECS;
+    int idle = 1;
+
+    for (int k = 0; k < STEP_HALF_RECS; k++, r++) {
+        r->rcr = 0;
+        if (step_n < step_total) {
+            r->arr = step_interval();
+            r->ccr1 = STEP_PULSE_US;
+            idle = 0;
+        } else {
+            r->arr = STEP_IDLE_US - 1;
+            r->ccr1 = 0;
+        }
+    }
+    step_half_idle[half] = idle;
+}
+
+static void step_halt(void)
+{
+    TIM3->CR1 = 0;
+    DMA1_Channel3->CCR &= ~DMA_CCR3_EN;
+    // Make sure we don't leave a pulse half done.
+    TIM3->CCMR1 = TIM_CCMR1_OC1M_2;
+    step_state = TBG_STEPPER_STATE_IDLE;
+}
+
+void DMA1_Channel3_IRQHandler(void)
+{
+    uint32_t isr = DMA1->ISR;
+
+    DMA1->IFCR = isr & (DMA_IFCR_CHTIF3 | DMA_IFCR_CTCIF3 | DMA_IFCR_CGIF3);
+    for (int half = 0; half < 2; half++) {
+        if (!(isr & (half ? DMA_ISR_TCIF3 : DMA_ISR_HTIF3))) {
+            continue;
+        }
+        step_cycles += half;
+        if (step_state != TBG_STEPPER_STATE_RUNNING) {
+            break;
+        }
+        if (step_half_idle[half]) {
+            step_halt();
+            step_pos += step_dir * (int32_t)step_total;
+            step_ind = TBG_STEPPER_IND_DONE;
+            break;
+        }
+        step_fill(half);
+    }
+}
+
+static void stepper_setup(void)
+{
+    RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+    RCC->APB1ENR |= RCC_APB1ENR_TIM3EN;
+
+    NVIC_InitTypeDef NVIC_InitStructure;
+    NVIC_InitStructure.NVIC_IRQChannel = DMA1_Channel3_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 3;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+
+    TIM3->CR1 = 0;
+    TIM3->PSC = 72-1;   //  1 MHz after prescaler
+    TIM3->CCMR1 = TIM_CCMR1_OC1M_2; // Forced low until we move
+    TIM3->CCER = TIM_CCER_CC1E;
+    TIM3->DCR = TIM_DMABase_ARR | TIM_DMABurstLength_3Transfers;
+    TIM3->DIER = TIM_DIER_UDE;
+}
+
+static void stepper_start(int32_t steps, uint16_t rate, uint16_t accel)
+{
+    if (!step_pins) {
+        GPIO_SETUP(STEP_PIN, GPIO_TYPE_ALTERNATE_PUSHPULL);
+        step_pins = STEP_PINS;
+    }
+    if (steps < 0) {
+        CLR(DIR_PIN);
+        step_dir = -1;
+    } else {
+        SET(DIR_PIN);
+        step_dir = 1;
+    }
+
+    step_total = steps * step_dir;
+    step_n = 0;
+    step_cycles = 0;
+    step_cmin = (1000000 << 8) / rate;
+    if (accel) {
+        step_accel_n = (uint32_t)rate * rate / (2 * (uint32_t)accel);
+        if (step_accel_n > step_total / 2) {
+            step_accel_n = step_total / 2;
+        }
+        step_c = (uint32_t)(676000.0f * 256.0f * sqrtf(2.0f / accel));
+    } else {
+        step_accel_n = 0;
+        step_c = step_cmin;
+    }
+    step_fill(0);
+    step_fill(1);
+
+    DMA1_Channel3->CCR = 0;
+    DMA1_Channel3->CPAR = (uint32_t)&TIM3->DMAR;
+    DMA1_Channel3->CMAR = (uint32_t)step_recs;
+    DMA1_Channel3->CNDTR = STEP_BUF_RECS * STEP_REC_HWORDS;
+    DMA1_Channel3->CCR =
+        DMA_CCR3_PL_1 |         // High priority
+        DMA_CCR3_MSIZE_0 |      // 16 bits
+        DMA_CCR3_PSIZE_0 |
+        DMA_CCR3_MINC |
+        DMA_CCR3_CIRC |
+        DMA_CCR3_DIR |          // Memory to timer
+        DMA_CCR3_HTIE |
+        DMA_CCR3_TCIE;
+    DMA1_Channel3->CCR |= DMA_CCR3_EN;
+
+    // A short first period, without a pulse, for the direction to settle.
+    // The update loads it and DMAs the first step's record in behind it.
+    step_state = TBG_STEPPER_STATE_RUNNING;
+    TIM3->CNT = 0;
+    TIM3->ARR = STEP_LEAD_US - 1;
+    TIM3->CCR1 = 0;
+    TIM3->CCMR1 = TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_1 | TIM_CCMR1_OC1PE; // PWM mode 1
+    TIM3->EGR = TIM_EGR_UG;
+    TIM3->CR1 = TIM_CR1_ARPE | TIM_CR1_CEN;
+}
+
+// Stop dead, working out how far we got from how many records the DMA
+// has moved: each update takes one and starts the step before it.
+static void stepper_stop(void)
+{
+    __disable_irq();
+    if (step_state == TBG_STEPPER_STATE_RUNNING) {
+        step_halt();
+        uint32_t cycles = step_cycles;
+        if (DMA1->ISR & DMA_ISR_TCIF3) {
+            cycles++;
+        }
+        uint32_t hwords = cycles * STEP_BUF_RECS * STEP_REC_HWORDS +
+            STEP_BUF_RECS * STEP_REC_HWORDS - DMA1_Channel3->CNDTR;
+        uint32_t done = hwords / STEP_REC_HWORDS;
+        done = done ? done - 1 : 0;
+        if (done > step_total) {
+            done = step_total;
+        }
+        step_pos += step_dir * (int32_t)done;
+        step_ind = TBG_STEPPER_IND_STOPPED;
+    }
+    __enable_irq();
+}
+
+static int stepper(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port)
+{
+    if (req->len < 1) {
+        return tbg_err_resp(req, resp, TBG_ERR_LENGTH);
+    }
+    switch (req->data[TBG_STEPPER_REQ_DATA_CMD]) {
+    case TBG_STEPPER_CMD_MOVE:
+        if (req->len != TBG_STEPPER_MOVE_REQ_LEN) {
+            return tbg_err_resp(req, resp, TBG_ERR_LENGTH);
+        }
+        if (step_state != TBG_STEPPER_STATE_IDLE) {
+            return tbg_err_resp(req, resp, TBG_ERR_VALUE);
+        }
+        const uint8_t *d = req->data + TBG_STEPPER_MOVE_REQ_DATA_STEPS;
+        int32_t steps = (int32_t)((uint32_t)(d[0] | d[1] << 8 | d[2] << 16) << 8) >> 8;
+        uint16_t rate, accel;
+        memcpy(&rate, req->data + TBG_STEPPER_MOVE_REQ_DATA_RATE, sizeof(rate));
+        memcpy(&accel, req->data + TBG_STEPPER_MOVE_REQ_DATA_ACCEL, sizeof(accel));
+        if (rate == 0 || rate > STEP_RATE_MAX || (accel && accel < STEP_ACCEL_MIN)) {
+            return tbg_err_resp(req, resp, TBG_ERR_RANGE);
+        }
+        if (steps) {
+            stepper_start(steps, rate, accel);
+        } else {
+            step_ind = TBG_STEPPER_IND_DONE;
+        }
+        resp->len = 0;
+        break;
+    case TBG_STEPPER_CMD_STOP:
+        stepper_stop();
+        resp->len = 0;
+        break;
+    case TBG_STEPPER_CMD_STATUS:
+        memset(resp->data, 0, TBG_STEPPER_STATUS_RESP_LEN);
+        resp->data[TBG_STEPPER_STATUS_RESP_DATA_STATE] = step_state;
+        int32_t pos = step_pos;
+        memcpy(resp->data + TBG_STEPPER_STATUS_RESP_DATA_POS, &pos, sizeof(pos));
+        resp->len = TBG_STEPPER_STATUS_RESP_LEN;
+        break;
+    default:
+        return tbg_err_resp(req, resp, TBG_ERR_VALUE);
+    }
+    return 1;
+}
+
+// Tell everyone a move's over, once there's room to.
+static void stepper_report(tbg_node_t *node)
+{
+    if (!step_ind || !tbg_can_tx_room()) {
+        return;
+    }
+    // Take the reason and position together, so one that comes in
+    // meanwhile isn't lost or reported with the wrong position.
+    __disable_irq();
+    uint8_t reason = step_ind;
+    int32_t pos = step_pos;
+    step_ind = 0;
+    __enable_irq();
+
+    tbg_msg_t ind;
+    tbg_msg_init(&ind);
+    TBG_MSG_SET_TYPE(&ind, TBG_MSG_TYPE_IND);
+    TBG_MSG_SET_SRC_ADDR(&ind, node->my_addr);
+    TBG_MSG_SET_SRC_PORT(&ind, 9);
+    TBG_MSG_SET_DST_ADDR(&ind, TBG_ADDR_BROADCAST);
+    TBG_MSG_SET_DST_PORT(&ind, 0);
+    memset(ind.data, 0, TBG_STEPPER_IND_LEN);
+    ind.data[TBG_STEPPER_IND_DATA_REASON] = reason;
+    memcpy(ind.data + TBG_STEPPER_IND_DATA_POS, &pos, sizeof(pos));
+    ind.len = TBG_STEPPER_IND_LEN;
+    tbg_msg_tx(&ind);
+}
+
 // Because of PCB layout, we need to re-map the output byte so bit0 corresponds
 // to output 1, etc. To do this, we just swap the top & bottom half-bytes.
 uint8_t io_remap(uint8_t x)
@@ -132,6 +427,7 @@ static int hso_out(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t
     } else {
         mask = 0xff;
     }
+    mask &= ~step_pins;
     GPIOA->BRR = (~value) & mask;
     GPIOA->BSRR = value & mask;
     resp->len = 1;
@@ -150,6 +446,16 @@ static tbg_port_t hso1_ports[] = {
         .confs = NULL,
         .num_confs = 0,
     },
+    {
+        .port_number = 9,
+        .port_class = TBG_PORT_CLASS_STEPPER,
+        .fn = stepper,
+        .fn_data = NULL,
+        .descr = "Stepper;req:{uint8_t cmd,...};step:output 7,dir:output 8",
+        .conf_data = NULL,
+        .confs = NULL,
+        .num_confs = 0,
+    },
 };
 
 static tbg_node_t node = {
@@ -185,6 +491,8 @@ int main(void)
     AFIO->MAPR |= AFIO_MAPR_SWJ_CFG_NOJNTRST;
 
     timer2_setup();
+    tbg_time_setup();
+    stepper_setup();
 
     board_setup();
 
@@ -197,12 +505,14 @@ int main(void)
     CLR(LED_GRN_PIN);
     CLR(LED_RED_PIN);
 
-    tbg_can_setup(TBG_CAN_SETUP_RX_IE);
+    tbg_node_init(&node);
+    tbg_can_setup(TBG_CAN_SETUP_RX_IE | TBG_CAN_SETUP_TX_IE | TBG_CAN_SETUP_AUTOBAUD);
+    tbg_node_set_filters(&node);
 
     while (1) {
         tbg_msg_t msg;
 
-        if (tbg_msg_fifo_out(&rx_msg_fifo, &msg) && tbg_msg_check_not_resp(&msg)) {
+        if (tbg_msg_fifo_out_stamped(&rx_msg_fifo, &msg, &node.rx_stamp) && tbg_msg_check_not_resp(&msg)) {
 
             if (tbg_check_addr_or_broadcast(&node, &msg)) {
                 led_pulse(LED_GRN, LED_BLINK_DURATION);
@@ -212,6 +522,8 @@ int main(void)
                 }
             }
         }
+        tbg_node_poll(&node);
+        stepper_report(&node);
     }
 }
 
@@ -237,13 +549,15 @@ void assert_failed(uint8_t* file, uint32_t line)
 #endif
 
 
-void USB_LP_CAN1_RX0_IRQHandler(void)
+void USB_HP_CAN1_TX_IRQHandler(void)
 {
-    tbg_msg_t msg;
-
-    // Get the message from the CAN hardware
-    tbg_can_rx(&msg);
+    // Refill the mailboxes from the TX queues.
+    tbg_can_tx_int();
+}
 
-    // Put message in our software FIFO.
-    tbg_msg_fifo_in(&rx_msg_fifo, &msg);
+void USB_LP_CAN1_RX0_IRQHandler(void)
+{
+    // Get the messages from the CAN hardware straight into our
+    // software FIFO, with when they arrived for time sync.
+    tbg_can_rx_drain(&rx_msg_fifo, 0, tbg_time_us());
 }
@@ -38,7 +38,8 @@
 #include <string.h>
 
 static tbg_msg_t rx_msg_bufs[8];
-static tbg_msg_fifo_t rx_msg_fifo = { .in = 0, .out = 0, .used = 0, .size = sizeof(rx_msg_bufs)/sizeof(tbg_msg_t), .bufs = rx_msg_bufs };
+static uint32_t rx_msg_stamps[8];
+static tbg_msg_fifo_t rx_msg_fifo = { .in = 0, .out = 0, .size = sizeof(rx_msg_bufs)/sizeof(tbg_msg_t), .bufs = rx_msg_bufs, .stamps = rx_msg_stamps };
 
 
 #define NUM_INPUTS              (8)
@@ -57,71 +58,395 @@ led_t leds[] = {
 
 static volatile uint32_t sys_counter;
 
-static volatile uint32_t debounce_events;
-static volatile uint32_t debounce_inputs;
+// Debounced input events, queued by whichever ISR scans the inputs (the
+// only writer of in) and sent on by the main loop (the only writer of
+// out.) Stamps are our own clock; they go onto the HAT's when the event
+// is sent.
+typedef struct din_event_s {
+    uint32_t stamp;
+    uint32_t events;
+    uint32_t inputs;
+} din_event_t;
+
+#define DIN_EV_QUEUE_SIZE       (64) // Power of two
+
+static din_event_t din_ev_queue[DIN_EV_QUEUE_SIZE];
+static volatile uint16_t din_ev_in;
+static volatile uint16_t din_ev_out;
+static volatile uint32_t din_ev_overflows;
+// Inputs of the event at the head of the queue already sent, when
+// they go one to an IND.
+static uint32_t din_ev_sent;
 
 static struct config_s {
     uint32_t rising_edge_mask;
     uint32_t falling_edge_mask;
     uint32_t debounce_enable_mask;
-    uint8_t debounce_time;
+    uint32_t edge_stamp_mask;
+    uint8_t ev_format;
 } din_conf = 
 {
     0x00000000,
     0x00000000,
     0xffffffff,
-    DEFAULT_DEBOUNCE_TIME
+    0x00000000,
+    TBG_DIN_EV_FORMAT_TIMED,
 };
 
-// Dynamic state of debounce subsystem
+// Edge stamping. Inputs in din_conf.edge_stamp_mask interrupt on their
+// EXTI lines at an edge, and the first edge since the input last
+// matched its debounced state has its time latched here. Events on
+// those inputs then get the time of the edge rather than of the scan
+// which found it, good to a microsecond or two (more if the EXTI
+// interrupt has to wait for another handler.) A latched line is masked,
+// so a bouncing contact can't keep interrupting, until it's re-armed.
+static volatile uint32_t edge_latched;
+static uint32_t edge_stamps[NUM_INPUTS];
+
+// Dynamic state of debounce subsystem. Up to 32 channels, one per bit.
+// Once a channel changes it's locked out from changing again for its
+// debounce time. The lockout timers are vertical counters: word k holds
+// bit k of every channel's count, so they're all run at once with a few
+// word operations, however many channels there are.
+#define DEBOUNCE_BITS           (8) // Enough for a uint8_t time in ms
+
 typedef struct {
-    uint32_t state;
-    uint8_t *timers;
-    uint8_t num_contacts;
+    uint32_t state;                 // Debounced inputs
+    uint32_t count[DEBOUNCE_BITS];  // Lockout timers, ms
+    uint32_t reload[DEBOUNCE_BITS]; // Debounce times, ms
 } debounce_t;
 
-static uint32_t debounce(debounce_t *db, uint32_t input);
+static debounce_t debouncer;
 
-uint8_t debounce_timers[NUM_INPUTS];
+// Set the debounce time of the channels in mask.
+static void debounce_set_time(debounce_t *db, uint32_t mask, uint8_t time)
+{
+    __disable_irq();
+    for (int k = 0; k < DEBOUNCE_BITS; k++) {
+        db->reload[k] = (db->reload[k] & ~mask) | (((time >> k) & 1) ? mask : 0);
+    }
+    __enable_irq();
+}
 
-static debounce_t debouncer = {
-    .state = 0,
-    .timers = debounce_timers,
-    .num_contacts = NUM_INPUTS,
-};
+static uint8_t debounce_get_time(debounce_t *db, int channel)
+{
+    uint8_t time = 0;
+    for (int k = 0; k < DEBOUNCE_BITS; k++) {
+        time |= ((db->reload[k] >> channel) & 1) << k;
+    }
+    return time;
+}
 
-// Decrement debounce timers.
+// Returns a mask of the channels still locked out.
+static inline uint32_t debounce_busy(debounce_t *db)
+{
+    uint32_t busy = 0;
+    for (int k = 0; k < DEBOUNCE_BITS; k++) {
+        busy |= db->count[k];
+    }
+    return busy;
+}
+
+// Decrement the running lockout timers, at 1 kHz.
 static void debounce_timers_run(debounce_t *db)
 {
-    for (int i = 0; i < db->num_contacts; i++) {
-        if (db->timers[i] > 0) {
-            db->timers[i]--;
-        }
+    uint32_t borrow = debounce_busy(db);
+    for (int k = 0; k < DEBOUNCE_BITS && borrow; k++) {
+        uint32_t c = db->count[k];
+        db->count[k] = c ^ borrow;
+        borrow &= ~c;
     }
 }
 
-// Run debounce on inputs. Returns event bit mask. Any bit set in return
+// Run debounce on inputs. Returns change bit mask. Any bit set in return
 // value indicates a valid (i.e. properly de-bounced) state-change of the
-// corresponding bit in the input.
+// corresponding bit in the input. A change during a channel's lockout
+// is picked up when it ends, if the input's still changed by then.
 static uint32_t debounce(debounce_t *db, uint32_t input)
 {
-    uint32_t events = (input ^ db->state) & ((input & din_conf.rising_edge_mask) | (~input & din_conf.falling_edge_mask));
-    db->state = input;
-
-    uint32_t enable = 0;
-    for (int i = 0; i < db->num_contacts; i++) {
-        uint32_t bit = 1 << i;
-        if (db->timers[i] == 0) {
-            enable |= bit; // Allow event to be propagated
-            // Start debounce timer if enabled and event occurred.
-            if ((din_conf.debounce_enable_mask & bit) && (events & bit)) {
-                db->timers[i] = din_conf.debounce_time;
+    uint32_t change = (input ^ db->state) & ~debounce_busy(db);
+    if (!change) {
+        return 0;
+    }
+    db->state ^= change;
+
+    // Start the lockout timers of the channels that changed.
+    uint32_t load = change & din_conf.debounce_enable_mask;
+    for (int k = 0; k < DEBOUNCE_BITS; k++) {
+        db->count[k] = (db->count[k] & ~load) | (db->reload[k] & load);
+    }
+    return change;
+}
+
+static void din_ev_put(uint32_t events, uint32_t stamp)
+{
+    uint16_t in = din_ev_in;
+    if ((uint16_t)(in - din_ev_out) < DIN_EV_QUEUE_SIZE) {
+        din_event_t *ev = din_ev_queue + (in & (DIN_EV_QUEUE_SIZE - 1));
+        ev->stamp = stamp;
+        ev->events = events;
+        ev->inputs = debouncer.state;
+        TBG_MSG_FIFO_BARRIER();
+        din_ev_in = in + 1;
+    } else {
+        din_ev_overflows++;
+    }
+}
+
+// Counter/timer channels, one per input, counting rising edges: those
+// in ctr_conf.debounce_mask of the debounced input, the rest straight
+// from the samples, so fast pulses aren't held back by the debounce
+// time. The scanning ISR only ever adds to total and notes the edge
+// times; resets just move base, so the running total carries on for the
+// reports.
+typedef struct ctr_chan_s {
+    uint32_t total;     // Rising edges
+    uint32_t last_edge; // Time of the last one
+    uint32_t period;    // Between the last two, 0 if not known
+    uint32_t base;      // total at the last reset
+    uint32_t start;     // and the time of it
+} ctr_chan_t;
+
+static ctr_chan_t ctr_chans[NUM_INPUTS];
+
+static struct ctr_conf_s {
+    uint16_t report_interval;   // ms, 0 for no reports
+    uint32_t report_mask;
+    uint32_t debounce_mask;
+} ctr_conf;
+
+static uint32_t ctr_raw_prev;   // Last sample of the inputs
+
+// Count the rising edges in mask, timed from the edge if it's in
+// latched, otherwise at stamp.
+static void ctr_edges(uint32_t rising, uint32_t stamp, uint32_t latched)
+{
+    while (rising) {
+        int i = __builtin_ctz(rising);
+        ctr_chan_t *c = ctr_chans + i;
+        uint32_t t = (latched & (1 << i)) ? edge_stamps[i] : stamp;
+        c->period = c->total ? t - c->last_edge : 0;
+        c->last_edge = t;
+        c->total++;
+        rising &= rising - 1;
+    }
+}
+
+// Re-arm the latched inputs which, sampled as inputs, are back at their
+// debounced state, so have nothing pending.
+static void edge_rearm(uint32_t inputs)
+{
+    uint32_t rearm = edge_latched & ~(inputs ^ debouncer.state);
+
+    if (rearm) {
+        edge_latched &= ~rearm;
+        EXTI->PR = rearm;
+        EXTI->IMR |= rearm;
+    }
+}
+
+// Count the rising edges in a sample of the inputs taken at time stamp
+// on the channels counting raw edges.
+static void ctr_raw(uint32_t inputs, uint32_t stamp)
+{
+    uint32_t raw_rising = inputs & ~ctr_raw_prev & ~ctr_conf.debounce_mask;
+    ctr_raw_prev = inputs;
+    if (raw_rising & ((1 << NUM_INPUTS) - 1)) {
+        ctr_edges(raw_rising & ((1 << NUM_INPUTS) - 1), stamp, 0);
+    }
+}
+
+// Run the debouncer on a sample of the inputs taken at time stamp, and
+// queue any events. Each one on an input with a latched edge gets an
+// event of its own, with the edge's time.
+static void din_scan(uint32_t inputs, uint32_t stamp)
+{
+    ctr_raw(inputs, stamp);
+
+    uint32_t change = debounce(&debouncer, inputs);
+    if (change) {
+        uint32_t state = debouncer.state;
+        uint32_t events = change & ((state & din_conf.rising_edge_mask) | (~state & din_conf.falling_edge_mask));
+        ctr_edges(change & state & ctr_conf.debounce_mask & ((1 << NUM_INPUTS) - 1), stamp, edge_latched);
+        uint32_t stamped = events & edge_latched;
+        while (stamped) {
+            int i = __builtin_ctz(stamped);
+            din_ev_put(1 << i, edge_stamps[i]);
+            stamped &= stamped - 1;
+        }
+        if (events & ~edge_latched) {
+            din_ev_put(events & ~edge_latched, stamp);
+        }
+    }
+    edge_rearm(inputs);
+}
+
+static void edge_irq(uint32_t lines)
+{
+    uint32_t now = tbg_time_us();
+    uint32_t pending = EXTI->PR & lines;
+
+    EXTI->PR = pending;
+    pending &= ~edge_latched;
+    edge_latched |= pending;
+    EXTI->IMR &= ~pending;
+    while (pending) {
+        int i = __builtin_ctz(pending);
+        edge_stamps[i] = now;
+        pending &= pending - 1;
+    }
+}
+
+void EXTI0_IRQHandler(void)
+{
+    edge_irq(0x01);
+}
+
+void EXTI1_IRQHandler(void)
+{
+    edge_irq(0x02);
+}
+
+void EXTI2_IRQHandler(void)
+{
+    edge_irq(0x04);
+}
+
+void EXTI3_IRQHandler(void)
+{
+    edge_irq(0x08);
+}
+
+void EXTI4_IRQHandler(void)
+{
+    edge_irq(0x10);
+}
+
+void EXTI9_5_IRQHandler(void)
+{
+    edge_irq(0xe0);
+}
+
+// Turn on edge stamping for the inputs in mask (PA0-7, EXTI lines 0-7),
+// and off for the rest.
+static void edge_stamp_setup(uint32_t mask)
+{
+    static const uint8_t irqs[] = {
+        EXTI0_IRQn, EXTI1_IRQn, EXTI2_IRQn, EXTI3_IRQn, EXTI4_IRQn, EXTI9_5_IRQn,
+    };
+
+    mask &= (1 << NUM_INPUTS) - 1;
+    __disable_irq();
+    AFIO->EXTICR[0] = 0;    // Port A for ext ints 0-3
+    AFIO->EXTICR[1] = 0;    // and 4-7
+    EXTI->IMR = mask;
+    EXTI->RTSR = mask;
+    EXTI->FTSR = mask;
+    EXTI->PR = 0xff;
+    edge_latched = 0;
+    __enable_irq();
+
+    for (int i = 0; i < sizeof(irqs); i++) {
+        NVIC_InitTypeDef NVIC_InitStructure;
+        NVIC_InitStructure.NVIC_IRQChannel = irqs[i];
+        NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+        NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
+        NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+        NVIC_Init(&NVIC_InitStructure);
+    }
+}
+
+#ifdef TBG_INPUT_DMA
+// TIM3 has DMA1 channel 3 copy the inputs into din_samples every sample
+// period, round and round, and we go through each half of it once the
+// other half's being filled. Only samples that differ from the debounced
+// state need the debouncer, though the raw counters still need to see
+// the ones that come back to it. Runs of four that match it and the
+// last sample have nothing for either, so are skipped in one go.
+// (The DMA reads IDR as a half-word and keeps the low byte.)
+#ifndef DIN_SAMPLE_HZ
+#define DIN_SAMPLE_HZ           (100000)
+#endif
+#define DIN_SAMPLE_US           (1000000 / DIN_SAMPLE_HZ)
+#define DIN_DMA_BUF_SIZE        (256) // Samples, multiple of 8
+#define DIN_DMA_HALF            (DIN_DMA_BUF_SIZE / 2)
+
+static uint8_t din_samples[DIN_DMA_BUF_SIZE] __attribute__((aligned(4)));
+
+// Process the half-buffer of samples which ended at about time now.
+static void din_dma_block(const uint8_t *samples, uint32_t now)
+{
+    uint32_t stamp0 = now - (DIN_DMA_HALF - 1) * DIN_SAMPLE_US;
+    const uint32_t *words = (const uint32_t *)samples;
+
+    for (int w = 0; w < DIN_DMA_HALF / 4; w++) {
+        uint8_t state = debouncer.state;
+        if (words[w] == state * 0x01010101u && (uint8_t)ctr_raw_prev == state) {
+            continue;
+        }
+        for (int i = w * 4; i < w * 4 + 4; i++) {
+            if (samples[i] != (uint8_t)debouncer.state) {
+                din_scan(samples[i], stamp0 + i * DIN_SAMPLE_US);
+            } else {
+                ctr_raw(samples[i], stamp0 + i * DIN_SAMPLE_US);
             }
         }
     }
-    return events & enable;
+    // The samples skipped didn't get to re-arm anything.
+    edge_rearm(samples[DIN_DMA_HALF - 1]);
+}
+
+void DMA1_Channel3_IRQHandler(void)
+{
+    uint32_t now = tbg_time_us();
+    uint32_t isr = DMA1->ISR;
+
+    DMA1->IFCR = isr & (DMA_IFCR_CHTIF3 | DMA_IFCR_CTCIF3 | DMA_IFCR_CGIF3);
+    if (isr & DMA_ISR_HTIF3) {
+        din_dma_block(din_samples, now);
+    }
+    if (isr & DMA_ISR_TCIF3) {
+        din_dma_block(din_samples + DIN_DMA_HALF, now);
+    }
+}
+
+static void din_dma_setup(void)
+{
+    RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+    RCC->APB1ENR |= RCC_APB1ENR_TIM3EN;
+
+    NVIC_InitTypeDef NVIC_InitStructure;
+    NVIC_InitStructure.NVIC_IRQChannel = DMA1_Channel3_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 3;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+
+    // TIM3_UP is DMA1 channel 3
+    DMA1_Channel3->CCR = 0;
+    DMA1_Channel3->CPAR = (uint32_t)&GPIOA->IDR;
+    DMA1_Channel3->CMAR = (uint32_t)din_samples;
+    DMA1_Channel3->CNDTR = DIN_DMA_BUF_SIZE;
+    DMA1_Channel3->CCR =
+        DMA_CCR3_PL_1 |         // High priority
+        DMA_CCR3_PSIZE_0 |      // Read 16 bits, write 8
+        DMA_CCR3_MINC |
+        DMA_CCR3_CIRC |
+        DMA_CCR3_HTIE |
+        DMA_CCR3_TCIE;
+    DMA1_Channel3->CCR |= DMA_CCR3_EN;
+
+    TIM3->PSC = 0;      // 72 MHz
+    TIM3->ARR = 72000000 / DIN_SAMPLE_HZ - 1;
+    TIM3->DIER = TIM_DIER_UDE;
+    TIM3->CR1 = TIM_CR1_CEN;
 }
 
+#define SCAN_PRESCALE           (1) // TIM2 just runs the 1 kHz tasks
+#else
+#define SCAN_PRESCALE           (10) // TIM2 scans the inputs at 10 kHz
+#endif
+
 volatile uint8_t prescale;
 
 void TIM2_IRQHandler(void)
@@ -129,20 +454,17 @@ void TIM2_IRQHandler(void)
     /* Reset the interrupt flag */
     TIM2->SR &= ~TIM_SR_UIF;
 
+#ifndef TBG_INPUT_DMA
     // Scan inputs & run debouncer at 10KHz.
-    uint32_t inputs = GPIOA->IDR & 0xff;
-    uint32_t events = debounce(&debouncer, inputs);
-    if (events) {
-        debounce_events = events;
-        debounce_inputs = inputs;
-    }
+    din_scan(GPIOA->IDR & 0xff, tbg_time_us());
+#endif
 
     if (prescale == 0) {
         //1 KHz Tasks
         debounce_timers_run(&debouncer);
         sys_counter++;
         led_run();
-        prescale = 10;
+        prescale = SCAN_PRESCALE;
     }
     prescale--;
 }
@@ -255,18 +577,69 @@ static int din_conf_debounce_enable_mask_rd(tbg_node_t *node, tbg_msg_t *req, tb
     return 1;
 }
 
-static int din_conf_debounce_time_wr(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
+static int din_conf_edge_stamp_mask_wr(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
+{
+    if (req->len < TBG_PORTCONF_REQ_LEN_MIN + sizeof(uint32_t)) {
+        return tbg_err_resp(req, resp, TBG_ERR_LENGTH);
+    }
+    memcpy(&din_conf.edge_stamp_mask, req->data + TBG_PORTCONF_REQ_LEN_MIN, sizeof(uint32_t));
+    edge_stamp_setup(din_conf.edge_stamp_mask);
+    return 1;
+}
+
+static int din_conf_edge_stamp_mask_rd(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
+{
+    memcpy(resp->data, &din_conf.edge_stamp_mask, sizeof(uint32_t));
+    resp->len = sizeof(uint32_t);
+    return 1;
+}
+
+static int din_conf_ev_format_wr(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
 {
     if (req->len < TBG_PORTCONF_REQ_LEN_MIN + sizeof(uint8_t)) {
         return tbg_err_resp(req, resp, TBG_ERR_LENGTH);
     }
-    din_conf.debounce_time = req->data[2];
+    uint8_t format = req->data[TBG_PORTCONF_REQ_LEN_MIN];
+    if (format > TBG_DIN_EV_FORMAT_PACKED) {
+        return tbg_err_resp(req, resp, TBG_ERR_VALUE);
+    }
+    din_conf.ev_format = format;
+    din_ev_sent = 0;
+    return 1;
+}
+
+static int din_conf_ev_format_rd(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
+{
+    resp->data[0] = din_conf.ev_format;
+    resp->len = sizeof(uint8_t);
+    return 1;
+}
+
+static int din_conf_debounce_time_wr(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
+{
+    uint32_t mask = 0xffffffff;
+
+    if (req->len < TBG_DIN_DEBOUNCE_TIME_REQ_LEN) {
+        return tbg_err_resp(req, resp, TBG_ERR_LENGTH);
+    }
+    if (req->len >= TBG_DIN_DEBOUNCE_TIME_REQ_LEN_MASK) {
+        memcpy(&mask, req->data + TBG_DIN_DEBOUNCE_TIME_DATA_MASK, sizeof(mask));
+    }
+    debounce_set_time(&debouncer, mask, req->data[TBG_DIN_DEBOUNCE_TIME_DATA_TIME]);
     return 1;
 }
 
 static int din_conf_debounce_time_rd(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
 {
-    resp->data[0] = din_conf.debounce_time;
+    int channel = 0;
+
+    if (req->len >= TBG_DIN_DEBOUNCE_TIME_REQ_LEN) {
+        channel = req->data[TBG_DIN_DEBOUNCE_TIME_DATA_CHANNEL];
+        if (channel >= NUM_INPUTS) {
+            return tbg_err_resp(req, resp, TBG_ERR_RANGE);
+        }
+    }
+    resp->data[0] = debounce_get_time(&debouncer, channel);
     resp->len = sizeof(uint8_t);
     return 1;
 }
@@ -292,6 +665,130 @@ static tbg_conf_t din_confs[] = {
         .rd_fn = din_conf_debounce_time_rd,
         .descr = "Debounce Time",
     },
+    {
+        .wr_fn = din_conf_edge_stamp_mask_wr,
+        .rd_fn = din_conf_edge_stamp_mask_rd,
+        .descr = "Edge Timestamp Mask",
+    },
+    {
+        .wr_fn = din_conf_ev_format_wr,
+        .rd_fn = din_conf_ev_format_rd,
+        .descr = "Event Format",
+    },
+};
+
+/*
+ * Counter/timer port. Reads a channel's count (optionally resetting it)
+ * or period, see TBG_CTR_REQ_DATA_CMD.
+ */
+static int ctr_in(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port)
+{
+    if (req->len < TBG_CTR_REQ_LEN) {
+        return tbg_err_resp(req, resp, TBG_ERR_LENGTH);
+    }
+    uint8_t channel = req->data[TBG_CTR_REQ_DATA_CHANNEL];
+    uint8_t cmd = req->data[TBG_CTR_REQ_DATA_CMD];
+    if (channel >= NUM_INPUTS) {
+        return tbg_err_resp(req, resp, TBG_ERR_RANGE);
+    }
+    ctr_chan_t *c = ctr_chans + channel;
+    uint32_t a, b;
+
+    switch (cmd) {
+        case TBG_CTR_CMD_COUNT:
+        case TBG_CTR_CMD_COUNT_RESET: {
+            __disable_irq();
+            uint32_t now = tbg_time_us();
+            uint32_t total = c->total;
+            a = total - c->base;
+            b = now - c->start;
+            if (cmd == TBG_CTR_CMD_COUNT_RESET) {
+                c->base = total;
+                c->start = now;
+            }
+            __enable_irq();
+            break;
+        }
+        case TBG_CTR_CMD_PERIOD:
+            __disable_irq();
+            a = c->period;
+            b = c->last_edge;
+            __enable_irq();
+            b = tbg_node_time(node, b);
+            break;
+        default:
+            return tbg_err_resp(req, resp, TBG_ERR_VALUE);
+    }
+    memcpy(resp->data + TBG_CTR_RESP_DATA_A, &a, sizeof(a));
+    memcpy(resp->data + TBG_CTR_RESP_DATA_B, &b, sizeof(b));
+    resp->len = TBG_CTR_RESP_LEN;
+    return 1;
+}
+
+static int ctr_conf_report_interval_wr(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
+{
+    if (req->len < TBG_PORTCONF_REQ_LEN_MIN + sizeof(uint16_t)) {
+        return tbg_err_resp(req, resp, TBG_ERR_LENGTH);
+    }
+    memcpy(&ctr_conf.report_interval, req->data + TBG_PORTCONF_REQ_LEN_MIN, sizeof(uint16_t));
+    return 1;
+}
+
+static int ctr_conf_report_interval_rd(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
+{
+    memcpy(resp->data, &ctr_conf.report_interval, sizeof(uint16_t));
+    resp->len = sizeof(uint16_t);
+    return 1;
+}
+
+static int ctr_conf_report_mask_wr(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
+{
+    if (req->len < TBG_PORTCONF_REQ_LEN_MIN + sizeof(uint32_t)) {
+        return tbg_err_resp(req, resp, TBG_ERR_LENGTH);
+    }
+    memcpy(&ctr_conf.report_mask, req->data + TBG_PORTCONF_REQ_LEN_MIN, sizeof(uint32_t));
+    return 1;
+}
+
+static int ctr_conf_report_mask_rd(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
+{
+    memcpy(resp->data, &ctr_conf.report_mask, sizeof(uint32_t));
+    resp->len = sizeof(uint32_t);
+    return 1;
+}
+
+static int ctr_conf_debounce_mask_wr(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
+{
+    if (req->len < TBG_PORTCONF_REQ_LEN_MIN + sizeof(uint32_t)) {
+        return tbg_err_resp(req, resp, TBG_ERR_LENGTH);
+    }
+    memcpy(&ctr_conf.debounce_mask, req->data + TBG_PORTCONF_REQ_LEN_MIN, sizeof(uint32_t));
+    return 1;
+}
+
+static int ctr_conf_debounce_mask_rd(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
+{
+    memcpy(resp->data, &ctr_conf.debounce_mask, sizeof(uint32_t));
+    resp->len = sizeof(uint32_t);
+    return 1;
+}
+
+static tbg_conf_t ctr_confs[] = {
+    {
+        .wr_fn = ctr_conf_report_interval_wr,
+        .rd_fn = ctr_conf_report_interval_rd,
+        .descr = "Report Interval",
+    },
+    {
+        .wr_fn = ctr_conf_report_mask_wr,
+        .rd_fn = ctr_conf_report_mask_rd,
+        .descr = "Report Mask",
+    },
+    {
+        .wr_fn = ctr_conf_debounce_mask_wr,
+        .rd_fn = ctr_conf_debounce_mask_rd,
+        .descr = "Debounce Mask",
+    },
 };
 
 static tbg_port_t input1_ports[] = {
@@ -305,6 +802,16 @@ static tbg_port_t input1_ports[] = {
         .confs = din_confs,
         .num_confs = sizeof(din_confs)/sizeof(tbg_conf_t),
     },
+    {
+        .port_number = 9,
+        .port_class = TBG_PORT_CLASS_COUNTER_TIMER,
+        .fn = ctr_in,
+        .fn_data = NULL,
+        .descr = "Counter/Timer;{uint8_t channel,uint8_t cmd}",
+        .conf_data = NULL,
+        .confs = ctr_confs,
+        .num_confs = sizeof(ctr_confs)/sizeof(tbg_conf_t),
+    },
 };
 
 static tbg_node_t node = {
@@ -318,20 +825,116 @@ static tbg_node_t node = {
     .shortlist_flag = 0,
 };
 
-static uint32_t get_events(uint32_t *in)
+/*
+ * Send the counter reports, if it's time. The running totals go out,
+ * so the receiver can work out rates even if some get lost.
+ */
+static void ctr_report(void)
 {
-    uint32_t events;
-    uint32_t inputs;
-    __disable_irq();
-    events = debounce_events;
-    inputs = debounce_inputs;
-    debounce_events = 0;
-    __enable_irq();
-    if (events) {
-        *in = inputs;
+    static uint32_t last;
+    uint32_t mask = ctr_conf.report_mask & ((1 << NUM_INPUTS) - 1);
+
+    if (!ctr_conf.report_interval || !mask
+            || (uint32_t)(sys_counter - last) < ctr_conf.report_interval
+            || tbg_can_tx_room() < __builtin_popcount(mask)) {
+        return;
+    }
+    last = sys_counter;
+    while (mask) {
+        int i = __builtin_ctz(mask);
+        tbg_msg_t ind;
+        tbg_msg_init(&ind);
+        TBG_MSG_SET_TYPE(&ind, TBG_MSG_TYPE_IND);
+        TBG_MSG_SET_SRC_ADDR(&ind, node.my_addr);
+        TBG_MSG_SET_SRC_PORT(&ind, 9);
+        TBG_MSG_SET_DST_ADDR(&ind, TBG_ADDR_BROADCAST);
+        TBG_MSG_SET_DST_PORT(&ind, 0);
+        __disable_irq();
+        uint32_t total = ctr_chans[i].total;
+        uint32_t now = tbg_time_us();
+        __enable_irq();
+        now = tbg_node_time(&node, now);
+        ind.data[TBG_CTR_IND_DATA_CHANNEL] = i;
+        ind.data[TBG_CTR_IND_DATA_TOTAL + 0] = total;
+        ind.data[TBG_CTR_IND_DATA_TOTAL + 1] = total >> 8;
+        ind.data[TBG_CTR_IND_DATA_TOTAL + 2] = total >> 16;
+        memcpy(ind.data + TBG_CTR_IND_DATA_TIME, &now, sizeof(now));
+        ind.len = TBG_CTR_IND_LEN;
+        tbg_msg_tx(&ind);
+        mask &= mask - 1;
     }
+}
+
+/*
+ * Fill in an IND with as many of the queued events as are waiting, up
+ * to TBG_DIN_EV_PACKED_MAX, in the packed format. Only called with at
+ * least one waiting.
+ */
+static void get_events_packed(tbg_msg_t *ind)
+{
+    uint16_t out = din_ev_out;
+    int n = 0;
+
+    do {
+        TBG_MSG_FIFO_BARRIER();
+        din_event_t *ev = din_ev_queue + (out & (DIN_EV_QUEUE_SIZE - 1));
+        uint8_t *rec = ind->data + n * TBG_DIN_EV_PACKED_REC_LEN;
+        uint32_t t = tbg_node_time(&node, ev->stamp) >> TBG_DIN_EV_PACKED_TIME_SHIFT;
+        rec[TBG_DIN_EV_PACKED_DATA_EVENTS] = ev->events;
+        rec[TBG_DIN_EV_PACKED_DATA_INPUTS] = ev->inputs;
+        rec[TBG_DIN_EV_PACKED_DATA_TIME + 0] = t;
+        rec[TBG_DIN_EV_PACKED_DATA_TIME + 1] = t >> 8;
+        out++;
+        n++;
+    } while (n < TBG_DIN_EV_PACKED_MAX && out != din_ev_in);
+    ind->len = n * TBG_DIN_EV_PACKED_REC_LEN;
+    TBG_MSG_FIFO_BARRIER();
+    din_ev_out = out;
+}
+
+/*
+ * Fill in an IND with the next queued input event, in the format set
+ * by din_conf.ev_format. In the timed format each input that changed
+ * gets an IND of its own, so an event only comes off the queue once
+ * they've all gone; the packed one takes several at a go. Returns
+ * non-zero if there was one.
+ */
+static int get_event(tbg_msg_t *ind)
+{
+    uint16_t out = din_ev_out;
 
-    return events;
+    if (out == din_ev_in) {
+        return 0;
+    }
+    TBG_MSG_FIFO_BARRIER();
+    if (din_conf.ev_format == TBG_DIN_EV_FORMAT_PACKED) {
+        get_events_packed(ind);
+        return 1;
+    }
+    din_event_t *ev = din_ev_queue + (out & (DIN_EV_QUEUE_SIZE - 1));
+    if (din_conf.ev_format == TBG_DIN_EV_FORMAT_TIMED) {
+        uint32_t left = ev->events & ~din_ev_sent;
+        int channel = __builtin_ctz(left);
+        uint32_t t = tbg_node_time(&node, ev->stamp) >> TBG_DIN_EV_TIME_SHIFT;
+        memcpy(ind->data + TBG_DIN_EV_TIMED_DATA_INPUTS, &ev->inputs, sizeof(ev->inputs));
+        ind->data[TBG_DIN_EV_TIMED_DATA_CHANNEL] = channel;
+        ind->data[TBG_DIN_EV_TIMED_DATA_TIME + 0] = t;
+        ind->data[TBG_DIN_EV_TIMED_DATA_TIME + 1] = t >> 8;
+        ind->data[TBG_DIN_EV_TIMED_DATA_TIME + 2] = t >> 16;
+        ind->len = TBG_DIN_EV_TIMED_LEN;
+        din_ev_sent |= 1u << channel;
+        if (left & (left - 1)) {
+            return 1;
+        }
+    } else {
+        memcpy(ind->data + TBG_DIN_EV_DATA_EVENTS, &ev->events, sizeof(ev->events));
+        memcpy(ind->data + TBG_DIN_EV_DATA_INPUTS, &ev->inputs, sizeof(ev->inputs));
+        ind->len = TBG_DIN_EV_LEN;
+    }
+    din_ev_sent = 0;
+    TBG_MSG_FIFO_BARRIER();
+    din_ev_out = out + 1;
+    return 1;
 }
 
 int main(void)
@@ -355,7 +958,12 @@ int main(void)
     // We need this in order that PB4 is usable as GPIO.
     AFIO->MAPR |= AFIO_MAPR_SWJ_CFG_NOJNTRST;
 
-    timer2_setup(100);
+    debounce_set_time(&debouncer, 0xffffffff, DEFAULT_DEBOUNCE_TIME);
+    timer2_setup(1000 / SCAN_PRESCALE);
+    tbg_time_setup();
+#ifdef TBG_INPUT_DMA
+    din_dma_setup();
+#endif
 
     board_setup();
 
@@ -370,14 +978,14 @@ int main(void)
     CLR(LED_GRN_PIN);
     CLR(LED_RED_PIN);
 
-    tbg_can_setup(TBG_CAN_SETUP_RX_IE);
+    tbg_node_init(&node);
+    tbg_can_setup(TBG_CAN_SETUP_RX_IE | TBG_CAN_SETUP_TX_IE | TBG_CAN_SETUP_AUTOBAUD);
+    tbg_node_set_filters(&node);
 
     while (1) {
         tbg_msg_t msg;
-        uint32_t evt;
-        uint32_t inp;
 
-        if (tbg_msg_fifo_out(&rx_msg_fifo, &msg)) {
+        if (tbg_msg_fifo_out_stamped(&rx_msg_fifo, &msg, &node.rx_stamp)) {
 
             if (tbg_check_addr_or_broadcast(&node, &msg) && tbg_msg_check_not_resp(&msg)) {
                 led_pulse(LED_GRN, LED_BLINK_DURATION);
@@ -387,21 +995,22 @@ int main(void)
                 }
             }
         }
-        if ((evt = get_events(&inp))) {
+        // Only take events off the queue when there's room to send them,
+        // so a busy bus holds them up rather than losing them.
+        tbg_msg_t ind;
+        tbg_msg_init(&ind);
+        if (tbg_can_tx_room() && get_event(&ind)) {
             led_pulse(LED_RED, 10);
             // Send a broadcast message with the event data
-            tbg_msg_t ind;
-            tbg_msg_init(&ind);
             TBG_MSG_SET_TYPE(&ind, TBG_MSG_TYPE_IND);
             TBG_MSG_SET_SRC_ADDR(&ind, node.my_addr);
             TBG_MSG_SET_SRC_PORT(&ind, 8); // Mark it as from the din port
             TBG_MSG_SET_DST_ADDR(&ind, TBG_ADDR_BROADCAST);
             TBG_MSG_SET_DST_PORT(&ind, 0);
-            ind.len = 8;
-            memcpy(ind.data + 0, &evt, sizeof(uint32_t));
-            memcpy(ind.data + 4, &inp, sizeof(uint32_t));
             tbg_msg_tx(&ind);
         }
+        ctr_report();
+        tbg_node_poll(&node);
     }
 }
 
@@ -427,13 +1036,15 @@ void assert_failed(uint8_t* file, uint32_t line)
 #endif
 
 
-void USB_LP_CAN1_RX0_IRQHandler(void)
+void USB_HP_CAN1_TX_IRQHandler(void)
 {
-    tbg_msg_t msg;
-
-    // Get the message from the CAN hardware
-    tbg_can_rx(&msg);
+    // Refill the mailboxes from the TX queues.
+    tbg_can_tx_int();
+}
 
-    // Put message in our software FIFO.
-    tbg_msg_fifo_in(&rx_msg_fifo, &msg);
+void USB_LP_CAN1_RX0_IRQHandler(void)
+{
+    // Get the messages from the CAN hardware straight into our
+    // software FIFO, with when they arrived for time sync.
+    tbg_can_rx_drain(&rx_msg_fifo, 0, tbg_time_us());
 }
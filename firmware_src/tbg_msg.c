@@ -107,29 +107,53 @@ void tbg_resp(tbg_msg_t *req, tbg_msg_t *resp, uint8_t state, uint8_t cont, uint
 
 int8_t tbg_msg_fifo_in(tbg_msg_fifo_t *f, tbg_msg_t *msg)
 {
+    return tbg_msg_fifo_in_stamped(f, msg, 0);
+}
+
+int8_t tbg_msg_fifo_out(tbg_msg_fifo_t *f, tbg_msg_t *msg)
+{
+    return tbg_msg_fifo_out_stamped(f, msg, NULL);
+}
+
+/*
+ * As tbg_msg_fifo_in() but also store stamp with the message, if the
+ * fifo has somewhere to put it.
+ */
+int8_t tbg_msg_fifo_in_stamped(tbg_msg_fifo_t *f, tbg_msg_t *msg, uint32_t stamp)
+{
+    tbg_msg_t *slot = tbg_msg_fifo_in_slot(f);
+
     // Check for overflow
-    if (f->used == f->size) {
+    if (slot == NULL) {
         return 0;
     }
-    // Copy data into fifo buffer.
-    memcpy(f->bufs + f->in++, msg, TBG_MSG_SIZE);
-    // Wrap input pointer.
-    f->in = (f->in >= f->size) ? 0 : f->in;
-    f->used++;
+    memcpy(slot, msg, TBG_MSG_SIZE);
+    tbg_msg_fifo_in_commit(f, stamp);
     return 1;
 }
 
-int8_t tbg_msg_fifo_out(tbg_msg_fifo_t *f, tbg_msg_t *msg)
+/*
+ * As tbg_msg_fifo_out() but also get the message's timestamp, or zero
+ * if the fifo doesn't keep them. stamp may be NULL.
+ */
+int8_t tbg_msg_fifo_out_stamped(tbg_msg_fifo_t *f, tbg_msg_t *msg, uint32_t *stamp)
 {
+    uint16_t out = f->out;
+    uint16_t i = out & (f->size - 1);
+
     // Check for underflow
-    if (f->used == 0) {
+    if (f->in == out) {
         return 0;
     }
+    TBG_MSG_FIFO_BARRIER();
+    if (stamp) {
+        *stamp = f->stamps ? f->stamps[i] : 0;
+    }
     // Copy data from fifo buffer.
-    memcpy(msg, f->bufs + f->out++, TBG_MSG_SIZE);
-    // Wrap output pointer.
-    f->out = (f->out >= f->size) ? 0 : f->out;
-    f->used--;
+    memcpy(msg, f->bufs + i, TBG_MSG_SIZE);
+    // Only now let the producer have the slot back.
+    TBG_MSG_FIFO_BARRIER();
+    f->out = out + 1;
     return 1;
 }
 
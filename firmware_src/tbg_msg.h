@@ -21,22 +21,81 @@
 #ifndef TBG_MSG_H
 #define TBG_MSG_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "tbg_protocol.h"
 
+/*
+ * Single-producer, single-consumer message FIFO, safe for an interrupt
+ * handler to fill while the main loop (or another handler) empties it
+ * without disabling interrupts. in is only written by the producer and
+ * out by the consumer. They count up freely, wrapping at 2^16, and are
+ * masked to index bufs, so size must be a power of 2 (up to 32768.)
+ */
 typedef struct tbg_msg_fifo_s {
-    uint8_t in;
-    uint8_t out;
-    uint8_t used;
-    uint8_t size;
+    volatile uint16_t in;
+    volatile uint16_t out;
+    uint16_t size;
     tbg_msg_t *bufs;
+    uint32_t *stamps;   // Timestamp per message, or NULL if not wanted
 } tbg_msg_fifo_t;
 
-#define TBG_MSG_FIFO_EMPTY(f)    ((f)->used == 0)
+#define TBG_MSG_FIFO_USED(f)     ((uint16_t)((f)->in - (f)->out))
+#define TBG_MSG_FIFO_EMPTY(f)    ((f)->in == (f)->out)
+
+// Stops the compiler moving buffer accesses past an index update.
+// Cortex-M3 is in-order so nothing more is needed.
+#define TBG_MSG_FIFO_BARRIER()   __asm volatile ("" ::: "memory")
+
+/*
+ * Get the slot the next message will go in, or NULL if the fifo is
+ * full, so the producer can build it in place. It isn't in the fifo
+ * until tbg_msg_fifo_in_commit().
+ */
+static inline tbg_msg_t *tbg_msg_fifo_in_slot(tbg_msg_fifo_t *f)
+{
+    if (TBG_MSG_FIFO_USED(f) == f->size) {
+        return NULL;
+    }
+    return f->bufs + (f->in & (f->size - 1));
+}
+
+static inline void tbg_msg_fifo_in_commit(tbg_msg_fifo_t *f, uint32_t stamp)
+{
+    uint16_t in = f->in;
+
+    if (f->stamps) {
+        f->stamps[in & (f->size - 1)] = stamp;
+    }
+    TBG_MSG_FIFO_BARRIER();
+    f->in = in + 1;
+}
+
+/*
+ * The consumer's equivalent: get the oldest message, or NULL if the
+ * fifo is empty, to use in place. It stays in the fifo until
+ * tbg_msg_fifo_out_commit().
+ */
+static inline tbg_msg_t *tbg_msg_fifo_out_slot(tbg_msg_fifo_t *f)
+{
+    if (TBG_MSG_FIFO_EMPTY(f)) {
+        return NULL;
+    }
+    TBG_MSG_FIFO_BARRIER();
+    return f->bufs + (f->out & (f->size - 1));
+}
+
+static inline void tbg_msg_fifo_out_commit(tbg_msg_fifo_t *f)
+{
+    TBG_MSG_FIFO_BARRIER();
+    f->out = f->out + 1;
+}
 
 int8_t tbg_msg_fifo_in(tbg_msg_fifo_t *f, tbg_msg_t *msg);
 int8_t tbg_msg_fifo_out(tbg_msg_fifo_t *f, tbg_msg_t *msg);
+int8_t tbg_msg_fifo_in_stamped(tbg_msg_fifo_t *f, tbg_msg_t *msg, uint32_t stamp);
+int8_t tbg_msg_fifo_out_stamped(tbg_msg_fifo_t *f, tbg_msg_t *msg, uint32_t *stamp);
 
 int tbg_msg_is_valid(tbg_msg_t *msg);
 int tbg_msg_check_not_resp(tbg_msg_t *req);
@@ -40,7 +40,39 @@ int tbg_node_check_addr(tbg_node_t *node, tbg_msg_t *msg)
  */
 int tbg_check_addr_or_broadcast(tbg_node_t *node, tbg_msg_t *msg)
 {
-    return (TBG_MSG_IS_BROADCAST(msg) || (TBG_MSG_GET_DST_ADDR(msg) == node->my_addr));
+    uint8_t dst_addr = TBG_MSG_GET_DST_ADDR(msg);
+
+    return (TBG_MSG_IS_BROADCAST(msg) || (dst_addr == node->my_addr) || (node->group_addrs & (1ULL << dst_addr)));
+}
+
+/*
+ * Program the CAN controller's filters so it only takes messages the
+ * node wants: those addressed to it, broadcasts and those for any of
+ * its group addresses. If there are too many groups the last bank
+ * passes everything and tbg_check_addr_or_broadcast() sorts it out.
+ * Call this after tbg_can_setup() and whenever the addresses change.
+ */
+void tbg_node_set_filters(tbg_node_t *node)
+{
+    uint8_t bank = 0;
+
+    // Set up the new filters before turning the catch-all off.
+    tbg_can_filter_set(TBG_CAN_FILTER_BANKS - 1, 0, 0, 0, 1);
+    tbg_can_filter_set(bank++, TBG_CAN_FILTER_DST_ID(node->my_addr), TBG_CAN_FILTER_DST_MASK, 0, 1);
+    tbg_can_filter_set(bank++, TBG_CAN_FILTER_DST_ID(TBG_ADDR_BROADCAST), TBG_CAN_FILTER_DST_MASK, 0, 1);
+    for (int addr = 0; addr < 64; addr++) {
+        if (!(node->group_addrs & (1ULL << addr))) {
+            continue;
+        }
+        if (bank == TBG_CAN_FILTER_BANKS - 1) {
+            // Out of banks: leave the catch-all in the last one.
+            return;
+        }
+        tbg_can_filter_set(bank++, TBG_CAN_FILTER_DST_ID(addr), TBG_CAN_FILTER_DST_MASK, 0, 1);
+    }
+    while (bank < TBG_CAN_FILTER_BANKS) {
+        tbg_can_filter_set(bank++, 0, 0, 0, 0);
+    }
 }
 
 /*
@@ -54,22 +86,159 @@ static int call_port_fn(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_p
     return port->fn(node, req, resp, port);
 }
 
+/*
+ * Helper function for tbg_port_mux(). Keep req for the next timestamp
+ * trigger, replacing anything already held for its port. resp is left
+ * as the empty response to acknowledge it.
+ */
+static int tstrigger_hold(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp)
+{
+    uint8_t port_number = TBG_MSG_GET_DST_PORT(req);
+    int i;
+
+    for (i = 0; i < node->num_tstrigger_reqs; i++) {
+        if (TBG_MSG_GET_DST_PORT(node->tstrigger_reqs + i) == port_number) {
+            break;
+        }
+    }
+    if (i == TBG_NODE_TSTRIGGER_SLOTS) {
+        return tbg_err_resp(req, resp, TBG_ERR_RANGE);
+    }
+    node->tstrigger_reqs[i] = *req;
+    if (i == node->num_tstrigger_reqs) {
+        node->num_tstrigger_reqs++;
+    }
+    return 1;
+}
+
+/*
+ * Forget whatever's held for the trigger on port_number.
+ */
+static void tstrigger_drop(tbg_node_t *node, uint8_t port_number)
+{
+    for (int i = 0; i < node->num_tstrigger_reqs; i++) {
+        if (TBG_MSG_GET_DST_PORT(node->tstrigger_reqs + i) == port_number) {
+            node->num_tstrigger_reqs--;
+            node->tstrigger_reqs[i] = node->tstrigger_reqs[node->num_tstrigger_reqs];
+            return;
+        }
+    }
+}
+
+/*
+ * Build the node's port table, so a port can be found from its number
+ * without searching. Call once before handling any requests.
+ */
+void tbg_node_init(tbg_node_t *node)
+{
+    memset(node->port_table, 0, sizeof(node->port_table));
+    for (int i = 0; i < TBG_NODE_COMMON_PORTS_NUMOF; i++) {
+        node->port_table[i] = i + 1;
+    }
+    // If a port number turns up twice the first one wins, as it did
+    // when we searched the list.
+    for (int i = node->num_ports - 1; i >= 0; i--) {
+        uint8_t port_number = node->ports[i].port_number;
+        if (port_number >= TBG_DEVICE_PORT_BASE && port_number < TBG_NODE_PORTS_NUMOF) {
+            node->port_table[port_number] = i + 1;
+        }
+    }
+}
+
 /*
  * Helper function for tbg_port_mux() and do_conf().
  */
 static tbg_port_t *find_port(tbg_node_t *node, uint8_t port_number)
 {
-    // Check if it's a common port
+    if (port_number >= TBG_NODE_PORTS_NUMOF || !node->port_table[port_number]) {
+        return NULL;
+    }
+    uint8_t i = node->port_table[port_number] - 1;
     if (port_number < TBG_DEVICE_PORT_BASE) {
-        return node->common_ports + port_number;
+        return node->common_ports + i;
     } else {
-        // Search through device port list
-        for (int i = 0; i < node->num_ports; i++) {
-            if (node->ports[i].port_number == port_number) {
-                return node->ports + i;
+        return node->ports + i;
+    }
+}
+
+/*
+ * Returns the subscription on port_number, or NULL.
+ */
+static tbg_subscription_t *find_sub(tbg_node_t *node, uint8_t port_number)
+{
+    for (int i = 0; i < node->num_subs; i++) {
+        if (TBG_MSG_GET_DST_PORT(&node->subs[i].req) == port_number) {
+            return node->subs + i;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns non-zero if the result of a subscription with a deadband has
+ * moved far enough from what was last sent to be worth sending.
+ */
+static int sub_moved(tbg_subscription_t *sub, tbg_msg_t *result)
+{
+    if (result->len != sub->sent_len || TBG_MSG_GET_TYPE(result) != sub->sent_type) {
+        return 1;
+    }
+    for (int i = 0; i + 1 < result->len; i += 2) {
+        int32_t v = result->data[i] | (result->data[i + 1] << 8);
+        int32_t was = sub->sent[i] | (sub->sent[i + 1] << 8);
+        if (v - was > sub->deadband || was - v > sub->deadband) {
+            return 1;
+        }
+    }
+    return (result->len & 1) && result->data[result->len - 1] != sub->sent[result->len - 1];
+}
+
+/*
+ * Run any subscriptions that are due, and save settings waiting to be.
+ * Call from the main loop. A subscription that can't be sent for want of
+ * room in the TX queue waits for the next go.
+ */
+void tbg_node_poll(tbg_node_t *node)
+{
+    uint32_t now = tbg_time_us();
+
+    if (node->nv_save_pending && (int32_t)(now - node->nv_save_at) >= 0) {
+        tbg_nv_t nv = *tbg_nv;
+        nv.can_bitrate = tbg_can_bitrate;
+        tbg_nv_write(&nv);
+        node->nv_save_pending = 0;
+    }
+
+    for (int i = 0; i < node->num_subs; i++) {
+        tbg_subscription_t *sub = node->subs + i;
+        if ((int32_t)(now - sub->next) < 0 || !tbg_can_tx_room()) {
+            continue;
+        }
+        sub->next += sub->interval_us;
+        if ((int32_t)(now - sub->next) >= 0) {
+            // Fallen behind, so don't try to catch up.
+            sub->next = now + sub->interval_us;
+        }
+
+        tbg_port_t *port = find_port(node, TBG_MSG_GET_DST_PORT(&sub->req));
+        tbg_msg_t result;
+        tbg_resp(&sub->req, &result, 0, 0, 0);
+        TBG_MSG_SET_SRC_ADDR(&result, node->my_addr);
+        if (!port || !call_port_fn(node, &sub->req, &result, port)) {
+            continue;
+        }
+        if (TBG_MSG_GET_TYPE(&result) == TBG_MSG_TYPE_RESP) {
+            TBG_MSG_SET_TYPE(&result, TBG_MSG_TYPE_IND);
+        }
+        if (sub->deadband) {
+            if (!sub_moved(sub, &result)) {
+                continue;
             }
+            sub->sent_len = result.len;
+            sub->sent_type = TBG_MSG_GET_TYPE(&result);
+            memcpy(sub->sent, result.data, result.len);
         }
-        return NULL;
+        tbg_msg_tx(&result);
     }
 }
 
@@ -104,6 +273,9 @@ int tbg_port_mux(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp)
 
     tbg_port_t *port = find_port(node, port_number);
     if (port) {
+        if (node->tstrigger_ports & (1ULL << port_number)) {
+            return tstrigger_hold(node, req, resp);
+        }
         return call_port_fn(node, req, resp, port);
     } else {
         // Port not found
@@ -118,16 +290,57 @@ void tbg_msg_tx(tbg_msg_t *msg)
 {
     TBG_MSG_SET_RTR(msg, 0);
     TBG_MSG_SET_EID(msg, 1);
-    tbg_can_tx(msg);
+    tbg_can_tx_queue(msg);
 }
 
 /*****************************************************************************
  * Common port functions
  *****************************************************************************/
 
+/*
+ * Carry out the requests held for the trigger. Only a request will
+ * do: nodes broadcast their IND's to port 0, and those mustn't set it
+ * off.
+ */
 static int tbg_port_fn_tstrigger(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port)
 {
-    return tbg_err_resp(req, resp, TBG_ERR_UNIMPLEMENTED);
+    int n = node->num_tstrigger_reqs;
+    uint8_t send = 0;
+
+    if (TBG_MSG_GET_TYPE(req) != TBG_MSG_TYPE_REQ) {
+        return 0;
+    }
+
+    // Do them all before sending anything, so they happen as close
+    // together as we can manage. Each result replaces its request.
+    for (int i = 0; i < n; i++) {
+        tbg_msg_t *held = node->tstrigger_reqs + i;
+        tbg_port_t *held_port = find_port(node, TBG_MSG_GET_DST_PORT(held));
+        tbg_msg_t result;
+
+        tbg_resp(held, &result, 0, 0, 0);
+        TBG_MSG_SET_SRC_ADDR(&result, node->my_addr);
+        if (held_port && call_port_fn(node, held, &result, held_port)) {
+            if (TBG_MSG_GET_TYPE(&result) == TBG_MSG_TYPE_RESP) {
+                TBG_MSG_SET_TYPE(&result, TBG_MSG_TYPE_IND);
+            }
+            *held = result;
+            send |= 1 << i;
+        }
+    }
+    node->num_tstrigger_reqs = 0;
+    for (int i = 0; i < n; i++) {
+        if (send & (1 << i)) {
+            tbg_msg_tx(node->tstrigger_reqs + i);
+        }
+    }
+
+    if (TBG_MSG_IS_BROADCAST(req)) {
+        return 0;
+    }
+    resp->data[0] = n;
+    resp->len = 1;
+    return 1;
 }
 
 static int tbg_port_fn_adisc(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port)
@@ -166,6 +379,7 @@ static int tbg_port_fn_adisc(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp,
     // Set our address from one supplied in request
     if (cmd & TBG_ADISC_BIT_ASSIG_ADDR) {
         node->my_addr = req->data[TBG_ADISC_REQ_DATA_ADDR];
+        tbg_node_set_filters(node);
     }
 
     // Set Shortlist flag
@@ -286,6 +500,77 @@ static int tbg_port_fn_config(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp,
     return call_conf_fn(node, req, resp, port, conf, write_flag);
 }
 
+/*
+ * Time sync from the HAT, see TBG_PORT_TIME_SYNC. Relies on the main
+ * loop having set node->rx_stamp.
+ */
+static int tbg_port_fn_time_sync(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *conf_port)
+{
+    tbg_time_sync_t *ts = &node->time_sync;
+
+    (void)conf_port; // Not used
+
+    if (TBG_MSG_GET_TYPE(req) != TBG_MSG_TYPE_IND || req->len < TBG_TIME_SYNC_SYNC_LEN) {
+        return 0;
+    }
+    uint8_t seq = req->data[TBG_TIME_SYNC_DATA_SEQ];
+
+    if (req->data[TBG_TIME_SYNC_DATA_CMD] == TBG_TIME_SYNC_CMD_SYNC) {
+        ts->sync_local = node->rx_stamp;
+        ts->sync_seq = seq;
+        ts->have_sync = 1;
+        return 0;
+    }
+    if (req->data[TBG_TIME_SYNC_DATA_CMD] != TBG_TIME_SYNC_CMD_FOLLOW_UP
+            || req->len < TBG_TIME_SYNC_FOLLOW_UP_LEN || !ts->have_sync || seq != ts->sync_seq) {
+        return 0;
+    }
+    ts->have_sync = 0;
+
+    uint32_t master;
+    memcpy(&master, req->data + TBG_TIME_SYNC_DATA_TIME, sizeof(master));
+
+    // Rate from how far both clocks have gone since the last one.
+    int32_t dl = ts->sync_local - ts->ref_local;
+    int32_t dm = master - ts->ref_master;
+    if (ts->synced && dl > 0 && dl < TBG_TIME_SYNC_GAP_MAX_US) {
+        int32_t drift = ((int64_t)(dm - dl) << TBG_TIME_SYNC_DRIFT_SHIFT) / dl;
+        if (drift > TBG_TIME_SYNC_DRIFT_MAX || drift < -TBG_TIME_SYNC_DRIFT_MAX) {
+            // The HAT's been restarted, say.
+            ts->have_drift = 0;
+        } else if (ts->have_drift) {
+            ts->drift += (drift - ts->drift) / 4;
+        } else {
+            ts->drift = drift;
+            ts->have_drift = 1;
+        }
+    } else {
+        ts->have_drift = 0;
+    }
+    if (!ts->have_drift) {
+        ts->drift = 0;
+    }
+    ts->ref_local = ts->sync_local;
+    ts->ref_master = master;
+    ts->synced = 1;
+    return 0;
+}
+
+/*
+ * Convert local, a tbg_time_us() time, to the HAT's clock. Until
+ * we've had a time sync it's returned unchanged.
+ */
+uint32_t tbg_node_time(tbg_node_t *node, uint32_t local)
+{
+    tbg_time_sync_t *ts = &node->time_sync;
+
+    if (!ts->synced) {
+        return local;
+    }
+    int32_t dt = local - ts->ref_local;
+    return ts->ref_master + dt + (int32_t)(((int64_t)dt * ts->drift) >> TBG_TIME_SYNC_DRIFT_SHIFT);
+}
+
 /*
  * Get and clear fault flags.
  */
@@ -345,6 +630,15 @@ tbg_port_t tbg_common_ports[] = {
         .port_number = TBG_PORT_FAULTS,
         .port_class = TBG_PORT_CLASS_COMMON,
     },
+    {
+        .fn = tbg_port_fn_time_sync,
+        .fn_data = NULL,
+        .descr = "Time Sync",
+        .confs = NULL,
+        .num_confs = 0,
+        .port_number = TBG_PORT_TIME_SYNC,
+        .port_class = TBG_PORT_CLASS_COMMON,
+    },
 
 };
 
@@ -449,6 +743,42 @@ static int tbg_conf_fn_global_firmware_version(tbg_node_t *node, tbg_msg_t *req,
     return read_str8(req, resp, version, offset);
 }
 
+static int tbg_conf_fn_global_can_bitrate_rd(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
+{
+    resp->data[0] = tbg_can_bitrate & 0xff;
+    resp->data[1] = tbg_can_bitrate >> 8;
+    resp->len = 2;
+    return 1;
+}
+
+/*
+ * Change to a new CAN bit rate. The response has to go out at the old
+ * rate, so we send it ourselves first. Nodes which miss the change will
+ * find the new rate by auto-baud when they next start.
+ *
+ * Saving it stalls us for ~20ms (see tbg_nv_write), long enough for the
+ * CAN controller's FIFOs to overflow if anything's being sent to us. On
+ * a broadcast change every node would do that at once, so it's left to
+ * tbg_node_poll() a while after the switch, each node in its turn.
+ */
+static int tbg_conf_fn_global_can_bitrate_wr(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
+{
+    if (req->len < TBG_CONF_CAN_BITRATE_REQ_LEN) {
+        return tbg_err_resp(req, resp, TBG_ERR_LENGTH);
+    }
+    uint16_t kbps = req->data[TBG_CONF_CAN_BITRATE_DATA];
+    kbps |= req->data[TBG_CONF_CAN_BITRATE_DATA + 1] << 8;
+    if (!tbg_can_bitrate_ok(kbps)) {
+        return tbg_err_resp(req, resp, TBG_ERR_VALUE);
+    }
+
+    tbg_msg_tx(resp);
+    tbg_can_set_bitrate(kbps);
+    node->nv_save_at = tbg_time_us() + (TBG_NODE_NV_SAVE_DELAY_MS +
+        (uint32_t)node->my_addr * TBG_NODE_NV_SAVE_STAGGER_MS) * 1000;
+    node->nv_save_pending = 1;
+    return 0;
+}
 
 tbg_conf_t tbg_global_confs[] = {
     {
@@ -511,6 +841,11 @@ tbg_conf_t tbg_global_confs[] = {
         .rd_fn = NULL,
         .descr = "Write User ID String to non-volatile memory",
     },
+    {
+        .wr_fn = tbg_conf_fn_global_can_bitrate_wr,
+        .rd_fn = tbg_conf_fn_global_can_bitrate_rd,
+        .descr = "CAN Bit Rate (kbit/s)",
+    },
 };
 
 static int tbg_conf_fn_port_common_class(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
@@ -549,9 +884,91 @@ static int tbg_conf_fn_port_common_conf_descr(tbg_node_t *node, tbg_msg_t *req,
     }
 }
 
-static int tbg_conf_fn_port_common_tstrigger(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
+static int tbg_conf_fn_port_common_tstrigger_wr(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
 {
-    return tbg_err_resp(req, resp, TBG_ERR_UNIMPLEMENTED);
+    if (req->len < TBG_TSTRIGGER_CONF_REQ_LEN) {
+        return tbg_err_resp(req, resp, TBG_ERR_LENGTH);
+    }
+    uint8_t port_number = port->port_number;
+    if (port_number < TBG_DEVICE_PORT_BASE || port_number >= TBG_NODE_PORTS_NUMOF) {
+        return tbg_err_resp(req, resp, TBG_ERR_RANGE);
+    }
+    if (req->data[TBG_TSTRIGGER_CONF_DATA_EN]) {
+        if (port->flags & TBG_PORT_FLAG_NO_TSTRIGGER) {
+            return tbg_err_resp(req, resp, TBG_ERR_UNIMPLEMENTED);
+        }
+        node->tstrigger_ports |= 1ULL << port_number;
+    } else {
+        node->tstrigger_ports &= ~(1ULL << port_number);
+        tstrigger_drop(node, port_number);
+    }
+    return 1;
+}
+
+static int tbg_conf_fn_port_common_tstrigger_rd(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
+{
+    resp->data[0] = (node->tstrigger_ports >> port->port_number) & 1;
+    resp->len = 1;
+    return 1;
+}
+
+static int tbg_conf_fn_port_common_subscribe_wr(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
+{
+    uint16_t interval, deadband;
+
+    if (req->len < TBG_SUBSCRIBE_CONF_REQ_LEN) {
+        return tbg_err_resp(req, resp, TBG_ERR_LENGTH);
+    }
+    uint8_t port_number = port->port_number;
+    if (port_number < TBG_DEVICE_PORT_BASE) {
+        return tbg_err_resp(req, resp, TBG_ERR_RANGE);
+    }
+    memcpy(&interval, req->data + TBG_SUBSCRIBE_CONF_DATA_INTERVAL, sizeof(interval));
+    memcpy(&deadband, req->data + TBG_SUBSCRIBE_CONF_DATA_DEADBAND, sizeof(deadband));
+
+    tbg_subscription_t *sub = find_sub(node, port_number);
+    if (!interval) {
+        if (sub) {
+            node->num_subs--;
+            *sub = node->subs[node->num_subs];
+        }
+        return 1;
+    }
+    if (port->flags & TBG_PORT_FLAG_NO_SUBSCRIBE) {
+        return tbg_err_resp(req, resp, TBG_ERR_UNIMPLEMENTED);
+    }
+    if (!sub) {
+        if (node->num_subs == TBG_NODE_SUBSCRIPTIONS) {
+            return tbg_err_resp(req, resp, TBG_ERR_RANGE);
+        }
+        sub = node->subs + node->num_subs++;
+    }
+
+    // The config request with its ports and data swapped for the ones
+    // we want stands in for the subscriber's request to the port.
+    sub->req = *req;
+    TBG_MSG_SET_TYPE(&sub->req, TBG_MSG_TYPE_REQ);
+    TBG_MSG_SET_DST_ADDR(&sub->req, node->my_addr);
+    TBG_MSG_SET_DST_PORT(&sub->req, port_number);
+    sub->req.len = req->len - TBG_SUBSCRIBE_CONF_DATA_REQ;
+    memmove(sub->req.data, req->data + TBG_SUBSCRIBE_CONF_DATA_REQ, sub->req.len);
+    sub->interval_us = interval * 1000UL;
+    sub->next = tbg_time_us();
+    sub->deadband = deadband;
+    sub->sent_len = 0xff; // Nothing sent yet
+    return 1;
+}
+
+static int tbg_conf_fn_port_common_subscribe_rd(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp, tbg_port_t *port, tbg_conf_t *conf)
+{
+    tbg_subscription_t *sub = find_sub(node, port->port_number);
+    uint16_t interval = sub ? sub->interval_us / 1000 : 0;
+    uint16_t deadband = sub ? sub->deadband : 0;
+
+    memcpy(resp->data, &interval, sizeof(interval));
+    memcpy(resp->data + sizeof(interval), &deadband, sizeof(deadband));
+    resp->len = sizeof(interval) + sizeof(deadband);
+    return 1;
 }
 
 tbg_conf_t tbg_port_common_confs[TBG_PORTCONF_CMD_COM_NUMOF] = {
@@ -571,8 +988,13 @@ tbg_conf_t tbg_port_common_confs[TBG_PORTCONF_CMD_COM_NUMOF] = {
         .descr = "Port Config Description",
     },
     {
-        .wr_fn = tbg_conf_fn_port_common_tstrigger,
-        .rd_fn = NULL,
+        .wr_fn = tbg_conf_fn_port_common_tstrigger_wr,
+        .rd_fn = tbg_conf_fn_port_common_tstrigger_rd,
         .descr = "Timestamp Trigger",
     },
+    {
+        .wr_fn = tbg_conf_fn_port_common_subscribe_wr,
+        .rd_fn = tbg_conf_fn_port_common_subscribe_rd,
+        .descr = "Subscribe",
+    },
 };
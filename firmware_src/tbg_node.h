@@ -29,6 +29,54 @@
 
 #include "tbg_protocol.h"
 
+// Port numbers are 6 bits. The first TBG_NODE_COMMON_PORTS_NUMOF are
+// the common ports every node has.
+#define TBG_NODE_PORTS_NUMOF            (TBG_PORTS_MAX)
+#define TBG_NODE_COMMON_PORTS_NUMOF     (TBG_PORT_TIME_SYNC + 1)
+
+// Most requests a node will hold for the timestamp trigger.
+#define TBG_NODE_TSTRIGGER_SLOTS        (8)
+
+// Settings changed over the bus (the CAN bit rate) are saved to flash
+// this long after, plus the stagger times our address, so that nodes
+// changed together don't all stall at once.
+#define TBG_NODE_NV_SAVE_DELAY_MS       (200)
+#define TBG_NODE_NV_SAVE_STAGGER_MS     (25)
+
+// Most ports a node will run subscriptions on.
+#define TBG_NODE_SUBSCRIPTIONS          (8)
+
+// A request run every so often for a subscriber, see
+// TBG_PORTCONF_CMD_COM_SUBSCRIBE.
+typedef struct tbg_subscription_s {
+    tbg_msg_t req;          // As if from the subscriber
+    uint32_t next;          // tbg_time_us() when it's next due
+    uint32_t interval_us;
+    uint16_t deadband;      // 0 to send every time
+    uint8_t sent_len;       // What was last sent, if deadband
+    uint8_t sent_type;
+    uint8_t sent[8];
+} tbg_subscription_t;
+
+// Our clock's rate relative to the HAT's is kept in units of 2^-24,
+// about 0.06 ppm. Syncs further apart than TBG_TIME_SYNC_GAP_MAX_US, or
+// which disagree by more than TBG_TIME_SYNC_DRIFT_MAX (about 1000 ppm),
+// start it again.
+#define TBG_TIME_SYNC_DRIFT_SHIFT       (24)
+#define TBG_TIME_SYNC_DRIFT_MAX         (1L << (TBG_TIME_SYNC_DRIFT_SHIFT - 10))
+#define TBG_TIME_SYNC_GAP_MAX_US        (10000000)
+
+typedef struct tbg_time_sync_s {
+    uint32_t sync_local;    // tbg_time_us() when the last SYNC arrived
+    uint32_t ref_local;     // Our time and the HAT's at the last SYNC
+    uint32_t ref_master;    // which was followed up
+    int32_t drift;          // HAT's clock rate over ours, less 1
+    uint8_t sync_seq;       // Sequence number of the last SYNC
+    uint8_t have_sync;      // Non-zero if sync_local is waiting for its FOLLOW_UP
+    uint8_t synced;         // Non-zero once ref_* are valid
+    uint8_t have_drift;
+} tbg_time_sync_t;
+
 struct tbg_node_s;
 struct tbg_port_s;
 struct tbg_conf_s;
@@ -43,6 +91,12 @@ typedef struct tbg_conf_s {
     const char *descr;
 } tbg_conf_t;
 
+// Port flags, for ports whose requests can't be held for a trigger or
+// run by a subscription: for instance ones that answer in more than one
+// frame, of which only the last would become the IND.
+#define TBG_PORT_FLAG_NO_TSTRIGGER      (1 << 0)
+#define TBG_PORT_FLAG_NO_SUBSCRIBE      (1 << 1)
+
 typedef struct tbg_port_s {
     port_fn_t *fn;
     void *fn_data;
@@ -52,6 +106,7 @@ typedef struct tbg_port_s {
     uint8_t num_confs;
     uint8_t port_number;
     uint8_t port_class;
+    uint8_t flags;
 } tbg_port_t;
 
 
@@ -61,19 +116,36 @@ typedef struct tbg_node_s {
     tbg_conf_t *confs; // Global confs
     tbg_conf_t *port_common_confs;
     const char *product_id;
+    uint64_t group_addrs; // Other destination addresses to accept, bit per address
+    uint64_t tstrigger_ports; // Ports with the timestamp trigger enabled, bit per port
+    tbg_msg_t tstrigger_reqs[TBG_NODE_TSTRIGGER_SLOTS]; // Requests held for the trigger
+    uint8_t num_tstrigger_reqs;
+    tbg_subscription_t subs[TBG_NODE_SUBSCRIPTIONS];
+    uint8_t num_subs;
+    uint32_t rx_stamp;    // tbg_time_us() when the request being handled arrived
+    tbg_time_sync_t time_sync;
+    uint32_t nv_save_at;  // tbg_time_us() to save settings, if nv_save_pending
+    uint8_t nv_save_pending;
     uint16_t faults;
     uint8_t num_ports;
     uint8_t my_addr;
     uint8_t shortlist_flag;
+    // Filled in by tbg_node_init(): one plus the index into common_ports
+    // or ports (for device ports) of each port number, or 0 if none.
+    uint8_t port_table[TBG_NODE_PORTS_NUMOF];
 } tbg_node_t;
 
 extern tbg_port_t tbg_common_ports[];
 extern tbg_conf_t tbg_global_confs[];
 extern tbg_conf_t tbg_port_common_confs[];
 
+void tbg_node_init(tbg_node_t *node);
 int tbg_node_check_addr(tbg_node_t *node, tbg_msg_t *msg);
 int tbg_check_addr_or_broadcast(tbg_node_t *node, tbg_msg_t *msg);
+void tbg_node_set_filters(tbg_node_t *node);
 int tbg_port_mux(tbg_node_t *node, tbg_msg_t *req, tbg_msg_t *resp);
 void tbg_msg_tx(tbg_msg_t *msg);
+uint32_t tbg_node_time(tbg_node_t *node, uint32_t local);
+void tbg_node_poll(tbg_node_t *node);
 
 #endif // TBG_NODE_H
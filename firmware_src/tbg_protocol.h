@@ -32,6 +32,8 @@
 #define TBG_MSG_TYPE_ERR_RESP   (2)
 #define TBG_MSG_TYPE_IND        (3)
 
+// A response too big for one frame comes as several, in order, all but
+// the last with the continued bit set to TBG_MSG_CONT.
 #define TBG_MSG_CONT            (1)
 
 #define TBG_ADDR_BROADCAST      (0)
@@ -124,6 +126,7 @@ typedef union {
 #define TBG_ERR_RANGE                   (7)
 #define TBG_ERR_VALUE                   (8)
 #define TBG_ERR_FAULT                   (9)
+#define TBG_ERR_BUSY                    (10)
 
 #define TBG_ERROR_STRINGS {\
     "Success",\
@@ -136,6 +139,7 @@ typedef union {
     "Out of range",\
     "Incorrect Value",\
     "Hardware Fault",\
+    "Busy, try again",\
 }
 
 
@@ -144,6 +148,7 @@ typedef union {
 #define TBG_PORT_ADISC                  (1)
 #define TBG_PORT_CONFIG                 (2)
 #define TBG_PORT_FAULTS                 (3)
+#define TBG_PORT_TIME_SYNC              (4)
 
 // Base port number for device-specific ports
 #define TBG_DEVICE_PORT_BASE            (8)
@@ -226,8 +231,20 @@ enum {
 #define TBG_CONF_GLOBAL_FIRMWARE_VER_STR    (9)
 #define TBG_CONF_GLOBAL_USER_ID_STRING      (10)
 #define TBG_CONF_GLOBAL_SAVE_USER_ID_STRING (11)
+#define TBG_CONF_GLOBAL_CAN_BITRATE         (12)
 
-#define TBG_CONF_GLOBAL_NUMOF               (12)
+#define TBG_CONF_GLOBAL_NUMOF               (13)
+
+// CAN bit rate config data: kbit/s, uint16_t little-endian, one of
+// TBG_CAN_BITRATES. Writing it switches the node to the new rate after
+// sending its response. The rate is saved in flash a little later (see
+// TBG_NODE_NV_SAVE_DELAY_MS), which stops the node for about 20ms; it
+// misses anything sent to it meanwhile.
+#define TBG_CONF_CAN_BITRATE_DATA           (1)
+#define TBG_CONF_CAN_BITRATE_REQ_LEN        (3)
+
+// CAN bit rates supported, in kbit/s, in the order auto-baud tries them.
+#define TBG_CAN_BITRATES                    { 1000, 500, 250, 125 }
 
 #define TBG_CONF_REQ_LEN_MIN                (1)
 #define TBG_PORTCONF_REQ_LEN_MIN            (2)
@@ -251,12 +268,55 @@ enum {
 #define TBG_PORTCONF_CMD_COM_GET_DESCR      (1)
 #define TBG_PORTCONF_CMD_COM_GET_CONF_DESCR (2)
 #define TBG_PORTCONF_CMD_COM_EN_TSTRIGGER   (3)
-#define TBG_PORTCONF_CMD_COM_RESERVED0      (4)
+#define TBG_PORTCONF_CMD_COM_SUBSCRIBE      (4)
 #define TBG_PORTCONF_CMD_COM_RESERVED1      (5)
 #define TBG_PORTCONF_CMD_COM_RESERVED2      (6)
 #define TBG_PORTCONF_CMD_COM_RESERVED3      (7)
 
-#define TBG_PORTCONF_CMD_COM_NUMOF          (4)
+#define TBG_PORTCONF_CMD_COM_NUMOF          (5)
+
+// Timestamp trigger. With it enabled on a device port (by writing 1 to
+// the port's TBG_PORTCONF_CMD_COM_EN_TSTRIGGER config) requests to the
+// port are acknowledged with an empty response and held, the latest one
+// per port, until a request arrives on TBG_PORT_TSTRIGGER. That's
+// usually broadcast, so every node acts on the same frame. All the held
+// requests are then carried out together, and each one's response goes
+// back to its sender as an IND from the port (or an ERR_RESP.) A trigger
+// addressed to one node is answered with the number it carried out.
+// Ports that can't work that way refuse it with TBG_ERR_UNIMPLEMENTED.
+#define TBG_TSTRIGGER_CONF_DATA_EN          (2)
+#define TBG_TSTRIGGER_CONF_REQ_LEN          (3)
+
+// Subscription. Writing a device port's TBG_PORTCONF_CMD_COM_SUBSCRIBE
+// config has the node carry out a request on the port (of up to two
+// bytes, the rest of the config data) every INTERVAL ms, as if it came
+// from whoever wrote the config, and send them the response as an IND
+// from the port. With a DEADBAND, the response is taken as uint16_t's
+// and only sent when one of them is more than that from what was last
+// sent (or it's changed length or become an error.) An interval of 0
+// cancels it. Reading gives the interval and deadband. Both uint16_t.
+// As with the trigger, some ports refuse it.
+#define TBG_SUBSCRIBE_CONF_DATA_INTERVAL    (2)
+#define TBG_SUBSCRIBE_CONF_DATA_DEADBAND    (4)
+#define TBG_SUBSCRIBE_CONF_DATA_REQ         (6)
+#define TBG_SUBSCRIBE_CONF_REQ_LEN          (6)
+
+// Time sync. The HAT broadcasts a SYNC IND to TBG_PORT_TIME_SYNC every
+// second or so, notes its own time when it's gone and follows it up
+// with that time in a FOLLOW_UP IND. All the nodes get the SYNC at the
+// same moment, so each can work out the offset (and drift) of its clock
+// from the HAT's and give times on the HAT's clock. Times are uint32_t
+// microseconds, little-endian, and wrap. The FOLLOW_UP is also passed
+// up to the Pi, timestamped as of the SYNC.
+#define TBG_TIME_SYNC_DATA_CMD              (0)
+#define TBG_TIME_SYNC_DATA_SEQ              (1)
+#define TBG_TIME_SYNC_DATA_TIME             (4)
+
+#define TBG_TIME_SYNC_CMD_SYNC              (0)
+#define TBG_TIME_SYNC_CMD_FOLLOW_UP         (1)
+
+#define TBG_TIME_SYNC_SYNC_LEN              (2)
+#define TBG_TIME_SYNC_FOLLOW_UP_LEN         (8)
 
 #define TBG_DEVICE_PORTCONF_CMD_BASE        (8)
 
@@ -265,5 +325,184 @@ enum {
 #define TBG_PORTCONF_CMD_DIN_EV_FALLING_EN_MSK  (TBG_DEVICE_PORTCONF_CMD_BASE+1)
 #define TBG_PORTCONF_CMD_DIN_EV_DEBOUNCE_EN_MSK (TBG_DEVICE_PORTCONF_CMD_BASE+2)
 #define TBG_PORTCONF_CMD_DIN_EV_DEBOUNCE_TIME   (TBG_DEVICE_PORTCONF_CMD_BASE+3)
+// Inputs whose events are timed from the edge itself, by interrupt,
+// rather than from the scan that finds it. uint32_t mask.
+#define TBG_PORTCONF_CMD_DIN_EV_EDGE_STAMP_MSK  (TBG_DEVICE_PORTCONF_CMD_BASE+4)
+// Format of the event INDs, uint8_t TBG_DIN_EV_FORMAT_*. It's the same
+// for everyone listening, so only change it if they all understand it.
+#define TBG_PORTCONF_CMD_DIN_EV_FORMAT          (TBG_DEVICE_PORTCONF_CMD_BASE+5)
+
+// Debounce time config data. Writing sets the time (ms, uint8_t) of the
+// inputs in the optional uint32_t mask, or all of them. Reading gives
+// the time of the input numbered in the optional channel byte, or of
+// input 0.
+#define TBG_DIN_DEBOUNCE_TIME_DATA_TIME         (2)
+#define TBG_DIN_DEBOUNCE_TIME_DATA_CHANNEL      (2)
+#define TBG_DIN_DEBOUNCE_TIME_DATA_MASK         (3)
+#define TBG_DIN_DEBOUNCE_TIME_REQ_LEN           (3)
+#define TBG_DIN_DEBOUNCE_TIME_REQ_LEN_MASK      (7)
+
+// Port Config commands for counter/timer class
+#define TBG_PORTCONF_CMD_CTR_REPORT_INTERVAL    (TBG_DEVICE_PORTCONF_CMD_BASE+0)
+#define TBG_PORTCONF_CMD_CTR_REPORT_MSK         (TBG_DEVICE_PORTCONF_CMD_BASE+1)
+// Channels counting debounced edges, uint32_t mask. The rest (all, to
+// start with) count edges in the raw samples of the input, up to half
+// the rate the inputs are scanned at.
+#define TBG_PORTCONF_CMD_CTR_DEBOUNCE_MSK       (TBG_DEVICE_PORTCONF_CMD_BASE+2)
+
+// Counter/timer ports. Each channel counts the rising edges of an input,
+// either as sampled or, for bouncing contacts, after debouncing (see
+// TBG_PORTCONF_CMD_CTR_DEBOUNCE_MSK). A request names the channel and
+// one of:
+// COUNT: the edges since the count was last reset, and the time since
+// then (us), uint32_t's A and B. COUNT_RESET also resets it, atomically.
+// PERIOD: the time between the last two edges (us, 0 if not known yet)
+// and of the last one, on the HAT's clock, in A and B.
+// With a report interval (ms, uint16_t) set, every so often each channel
+// in the report mask sends an IND with the low 24 bits of its running
+// total and the time, on the HAT's clock. Totals aren't reset with the
+// count, so any two reports give the rate between them.
+#define TBG_CTR_REQ_DATA_CHANNEL            (0)
+#define TBG_CTR_REQ_DATA_CMD                (1)
+#define TBG_CTR_REQ_LEN                     (2)
+
+#define TBG_CTR_CMD_COUNT                   (0)
+#define TBG_CTR_CMD_COUNT_RESET             (1)
+#define TBG_CTR_CMD_PERIOD                  (2)
+
+#define TBG_CTR_RESP_DATA_A                 (0)
+#define TBG_CTR_RESP_DATA_B                 (4)
+#define TBG_CTR_RESP_LEN                    (8)
+
+#define TBG_CTR_IND_DATA_CHANNEL            (0)
+#define TBG_CTR_IND_DATA_TOTAL              (1)
+#define TBG_CTR_IND_DATA_TIME               (4)
+#define TBG_CTR_IND_LEN                     (8)
+
+// PWM ramp requests: move the duty of each output in MASK (bit per
+// channel) in a straight line from where it is to DUTY (uint16_t, PWM
+// counts) over MS milliseconds (uint16_t, 0 to set it at once.) The
+// ramp is run by the node, a step every PWM cycle. Setting a duty
+// directly stops a ramp.
+#define TBG_PWM_RAMP_REQ_DATA_MASK          (0)
+#define TBG_PWM_RAMP_REQ_DATA_DUTY          (1)
+#define TBG_PWM_RAMP_REQ_DATA_MS            (3)
+#define TBG_PWM_RAMP_REQ_LEN                (5)
+
+// Motion buffer ports: a queue of timed PWM setpoints, played back by
+// the node from the PWM timer. The first byte of a request is the CMD:
+// POINT: queue a point: set the duty (uint16_t, PWM counts) of the
+// channels in MASK, then hold for DWELL (uint16_t) PWM cycles before
+// the next point. Points with no dwell take effect with the one after,
+// and a profile ends with one. Responds with the room left (uint16_t),
+// or a range error if the buffer's full.
+// START: start playing at once or, given TIME, at that time on the
+// HAT's clock (see TBG_PORT_TIME_SYNC.)
+// STOP: stop and throw away what's queued. The outputs stay put.
+// Setting a channel that's in the queued points by other means (the PWM
+// output or ramp ports) while it's armed or playing stops it too.
+// STATUS: the STATE, the room left (uint16_t) and the count of times
+// the buffer's run dry mid-profile (uint16_t). Playback holds where it
+// is until more points arrive.
+// The timestamp trigger only holds the latest request, so it can't be
+// used to queue points; use START with a TIME instead.
+#define TBG_MOTION_REQ_DATA_CMD             (0)
+
+#define TBG_MOTION_CMD_POINT                (0)
+#define TBG_MOTION_CMD_START                (1)
+#define TBG_MOTION_CMD_STOP                 (2)
+#define TBG_MOTION_CMD_STATUS               (3)
+
+#define TBG_MOTION_POINT_REQ_DATA_MASK      (1)
+#define TBG_MOTION_POINT_REQ_DATA_DUTY      (2)
+#define TBG_MOTION_POINT_REQ_DATA_DWELL     (4)
+#define TBG_MOTION_POINT_REQ_LEN            (6)
+
+#define TBG_MOTION_START_REQ_DATA_TIME      (1)
+#define TBG_MOTION_START_REQ_LEN            (5)
+
+#define TBG_MOTION_STATUS_RESP_DATA_STATE   (0)
+#define TBG_MOTION_STATUS_RESP_DATA_FREE    (2)
+#define TBG_MOTION_STATUS_RESP_DATA_UNDERRUNS (4)
+#define TBG_MOTION_STATUS_RESP_LEN          (6)
+
+#define TBG_MOTION_STATE_IDLE               (0)
+#define TBG_MOTION_STATE_ARMED              (1)
+#define TBG_MOTION_STATE_RUNNING            (2)
+
+// Stepper ports: step and direction outputs, the steps timed by the
+// node. The first byte of a request is the CMD:
+// MOVE: move STEPS (int24_t, the sign giving the direction), speeding up
+// at ACCEL (uint16_t, steps/s/s, 0 to start at full speed) to RATE
+// (uint16_t, steps/s) and slowing down again to stop. Not while a move's
+// under way. Accelerations too low for the node to time the first step
+// of give a range error.
+// STOP: stop at once.
+// STATUS: the STATE and the position (int32_t) the last move left it at.
+// When a move ends the port broadcasts an IND with the REASON and the
+// position.
+#define TBG_STEPPER_REQ_DATA_CMD            (0)
+
+#define TBG_STEPPER_CMD_MOVE                (0)
+#define TBG_STEPPER_CMD_STOP                (1)
+#define TBG_STEPPER_CMD_STATUS              (2)
+
+#define TBG_STEPPER_MOVE_REQ_DATA_STEPS     (1)
+#define TBG_STEPPER_MOVE_REQ_DATA_RATE      (4)
+#define TBG_STEPPER_MOVE_REQ_DATA_ACCEL     (6)
+#define TBG_STEPPER_MOVE_REQ_LEN            (8)
+
+#define TBG_STEPPER_STATUS_RESP_DATA_STATE  (0)
+#define TBG_STEPPER_STATUS_RESP_DATA_POS    (4)
+#define TBG_STEPPER_STATUS_RESP_LEN         (8)
+
+#define TBG_STEPPER_STATE_IDLE              (0)
+#define TBG_STEPPER_STATE_RUNNING           (1)
+
+#define TBG_STEPPER_IND_DATA_REASON         (0)
+#define TBG_STEPPER_IND_DATA_POS            (4)
+#define TBG_STEPPER_IND_LEN                 (8)
+
+#define TBG_STEPPER_IND_DONE                (1)
+#define TBG_STEPPER_IND_STOPPED             (2)
+
+// Digital input event INDs, broadcast from the port, one per event in
+// the order found. In the PLAIN format they carry the inputs that
+// changed and the state of all the inputs just after, uint32_t's, but
+// not when. The TIMED format (the default) has an IND for each input
+// that changed, with the state of all the inputs just after, the
+// input's number, and when, as bits
+// [TBG_DIN_EV_TIME_SHIFT+23:TBG_DIN_EV_TIME_SHIFT] of the time on the
+// HAT's clock (see TBG_PORT_TIME_SYNC), 24 bits. The
+// receiver fills in the top bits from when the IND arrived, which works
+// as long as the node sent it within half a minute or so.
+// The PACKED format is for busy inputs: an IND carries up to
+// TBG_DIN_EV_PACKED_MAX events, as records of the first 8 inputs that
+// changed, the state of the first 8 after, and the low 16 bits of the
+// time, in units of 1 << TBG_DIN_EV_PACKED_TIME_SHIFT us. That only
+// reaches back a second, so it's no good if the bus holds events up
+// for longer.
+#define TBG_DIN_EV_FORMAT_PLAIN             (0)
+#define TBG_DIN_EV_FORMAT_TIMED             (1)
+#define TBG_DIN_EV_FORMAT_PACKED            (2)
+
+#define TBG_DIN_EV_DATA_EVENTS              (0)
+#define TBG_DIN_EV_DATA_INPUTS              (4)
+#define TBG_DIN_EV_LEN                      (8)
+
+#define TBG_DIN_EV_TIMED_DATA_INPUTS        (0)
+#define TBG_DIN_EV_TIMED_DATA_CHANNEL       (4)
+#define TBG_DIN_EV_TIMED_DATA_TIME          (5)
+#define TBG_DIN_EV_TIMED_LEN                (8)
+#define TBG_DIN_EV_TIME_SHIFT               (2)
+#define TBG_DIN_EV_TIME_BITS                (24)
+
+#define TBG_DIN_EV_PACKED_DATA_EVENTS       (0)
+#define TBG_DIN_EV_PACKED_DATA_INPUTS       (1)
+#define TBG_DIN_EV_PACKED_DATA_TIME         (2)
+#define TBG_DIN_EV_PACKED_REC_LEN           (4)
+#define TBG_DIN_EV_PACKED_MAX               (2)
+#define TBG_DIN_EV_PACKED_TIME_SHIFT        (4)
+#define TBG_DIN_EV_PACKED_TIME_BITS         (16)
 
 #endif // TBG_PROTOCOL_H
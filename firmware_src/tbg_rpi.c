@@ -31,15 +31,43 @@
 #include "tbg_hat_board_conf.h"
 
 
-#define TBG_MSG_RX_FIFO_SIZE            (8)
+// Number of CAN messages buffered for the Pi. Override with
+// make HAT_RX_FIFO_SIZE=n, which must be a power of 2. Each takes
+// TBG_MSG_SIZE bytes of RAM, plus 4 for its timestamp.
+#ifndef TBG_MSG_RX_FIFO_SIZE
+#define TBG_MSG_RX_FIFO_SIZE            (512)
+#endif
+
+#if TBG_MSG_RX_FIFO_SIZE & (TBG_MSG_RX_FIFO_SIZE - 1)
+#error "TBG_MSG_RX_FIFO_SIZE must be a power of 2"
+#endif
 
 static tbg_msg_t tbg_rx_msg_bufs[TBG_MSG_RX_FIFO_SIZE];
+static uint32_t tbg_rx_msg_stamps[TBG_MSG_RX_FIFO_SIZE];
 
 uint32_t tbg_rpi_cfg1;
 
-tbg_msg_fifo_t tbg_rx_msg_fifo = { .in = 0, .out = 0, .used = 0, .size = TBG_MSG_RX_FIFO_SIZE, .bufs = tbg_rx_msg_bufs };
+static uint16_t tbg_rpi_rx_hwm;
+static uint32_t tbg_rpi_rx_overflows;
+
+// Set when the bit rate's changed, for tbg_rpi_poll() to save it.
+static volatile uint8_t nv_save_pending;
+
+// Time sync master state, see tbg_rpi_time_sync_int().
+static volatile uint8_t time_sync_due;  // Set by tbg_rpi_tick()
+static uint16_t time_sync_ms;
+static uint8_t time_sync_seq;
+static int8_t time_sync_mb = -1;        // Mailbox the SYNC's in, or -1
+static uint8_t time_sync_follow_up;     // Non-zero if FOLLOW_UP is to go
+static uint32_t time_sync_stamp;        // When the SYNC went
 
-typedef void reg_fn_t(uint8_t addr, uint8_t *buf, int size);
+tbg_msg_fifo_t tbg_rx_msg_fifo = { .in = 0, .out = 0, .size = TBG_MSG_RX_FIFO_SIZE, .bufs = tbg_rx_msg_bufs, .stamps = tbg_rx_msg_stamps };
+
+/*
+ * Register access functions. Read functions return the number of
+ * bytes they put in buf, which may be less than the register size.
+ */
+typedef int reg_fn_t(uint8_t addr, uint8_t *buf, int size);
 
 typedef struct tbg_rpi_reg_s {
     reg_fn_t *wr_fn;
@@ -47,17 +75,27 @@ typedef struct tbg_rpi_reg_s {
     uint8_t size;
 } tbg_rpi_reg_t;
 
-static void msg_put(uint8_t reg, uint8_t *buf, int size);
-static void msg_get(uint8_t reg, uint8_t *buf, int size);
-static void filter_set(uint8_t reg, uint8_t *buf, int size);
-static void cfg_reg_write(uint8_t reg, uint8_t *buf, int size);
-static void cfg_reg_read(uint8_t reg, uint8_t *buf, int size);
+static int msg_put(uint8_t reg, uint8_t *buf, int size);
+static int msg_get(uint8_t reg, uint8_t *buf, int size);
+static int msg_burst_put(uint8_t reg, uint8_t *buf, int size);
+static int msg_burst_get(uint8_t reg, uint8_t *buf, int size);
+static int msg_burst_ts_get(uint8_t reg, uint8_t *buf, int size);
+static int filter_set(uint8_t reg, uint8_t *buf, int size);
+static int filter_write(uint8_t reg, uint8_t *buf, int size);
+static int cfg_reg_write(uint8_t reg, uint8_t *buf, int size);
+static int cfg_reg_read(uint8_t reg, uint8_t *buf, int size);
+static int stats_reset(uint8_t reg, uint8_t *buf, int size);
+static int stats_read(uint8_t reg, uint8_t *buf, int size);
 
 static const tbg_rpi_reg_t tbg_rpi_regs[TBGRPI_REG_NUMOF] = {
     [TBGRPI_REG_ADDR_CAN] =  { .size = TBG_MSG_SIZE,     .wr_fn = msg_put, .rd_fn = msg_get },
     [TBGRPI_REG_ADDR_FILT1] = { .size = 8, .wr_fn = filter_set, .rd_fn = NULL },
     [TBGRPI_REG_ADDR_FILT2] = { .size = 8, .wr_fn = filter_set, .rd_fn = NULL },
     [TBGRPI_REG_ADDR_CFG1] = { .size = 8, .wr_fn = cfg_reg_write, .rd_fn = cfg_reg_read },
+    [TBGRPI_REG_ADDR_BURST] = { .size = TBGRPI_BURST_SIZE, .wr_fn = msg_burst_put, .rd_fn = msg_burst_get },
+    [TBGRPI_REG_ADDR_STATS] = { .size = TBGRPI_STATS_SIZE, .wr_fn = stats_reset, .rd_fn = stats_read },
+    [TBGRPI_REG_ADDR_FILTER] = { .size = TBGRPI_FILTER_SIZE, .wr_fn = filter_write, .rd_fn = NULL },
+    [TBGRPI_REG_ADDR_BURST_TS] = { .size = TBGRPI_BURST_SIZE, .wr_fn = NULL, .rd_fn = msg_burst_ts_get },
 };
 
 typedef struct tbg_rpi_s {
@@ -65,12 +103,16 @@ typedef struct tbg_rpi_s {
     uint8_t conf;
     volatile uint8_t stat;
     uint8_t rd_ptr;
+    uint8_t rd_len;
     uint8_t wr_ptr;
     uint8_t *rd_buf;
     uint8_t *wr_buf;
+    uint8_t burst_len;      // Length of pending burst data phase, or 0
+    uint8_t burst_wr;       // Non-zero if the Pi is writing it
+    uint8_t *burst_buf;
 } tbg_rpi_t;
 
-#define TBGRPI_REG_BUF_SIZE             (16)
+#define TBGRPI_REG_BUF_SIZE             (TBGRPI_BURST_SIZE)
 
 uint8_t tbg_rpi_wr_buf[TBGRPI_REG_BUF_SIZE];
 uint8_t tbg_rpi_rd_buf[TBGRPI_REG_BUF_SIZE];
@@ -80,51 +122,126 @@ static tbg_rpi_t tbgrpi = {
     .conf = 0,
     .stat = 0,
     .rd_ptr = 0,
+    .rd_len = 0,
     .wr_ptr = 0,
     .rd_buf = tbg_rpi_wr_buf,
     .wr_buf = tbg_rpi_rd_buf,
+    .burst_len = 0,
+    .burst_wr = 0,
+    .burst_buf = NULL,
 };
 
-static void msg_put(uint8_t reg, uint8_t *buf, int size)
+static int msg_put(uint8_t reg, uint8_t *buf, int size)
 {
-    tbg_can_tx((tbg_msg_t *)buf);
+    tbg_can_tx_queue((tbg_msg_t *)buf);
+    return size;
 }
 
-static void msg_get(uint8_t reg, uint8_t *buf, int size)
+static int msg_get(uint8_t reg, uint8_t *buf, int size)
 {
     tbg_msg_fifo_out(&tbg_rx_msg_fifo, (tbg_msg_t *)buf);
+    return size;
 }
 
-static void filter_set(uint8_t reg, uint8_t *buf, int size)
+/*
+ * Queue the messages written in a burst. buf[0] is the count, already
+ * checked. TX buffer empty in the status register means there's room
+ * for a full burst; anything that doesn't fit counts as a TX drop.
+ */
+static int msg_burst_put(uint8_t reg, uint8_t *buf, int size)
+{
+    tbg_msg_t *msgs = (tbg_msg_t *)(buf + 1);
+
+    for (int i = 0; i < buf[0]; i++) {
+        tbg_can_tx_queue(msgs + i);
+    }
+    return size;
+}
+
+/*
+ * Fill buf with a count byte followed by as many messages from the
+ * RX buffer as will fit. Lets the Pi empty the buffer without an
+ * addr/status cycle between each message.
+ */
+static int msg_burst_get(uint8_t reg, uint8_t *buf, int size)
+{
+    tbg_msg_t *msgs = (tbg_msg_t *)(buf + 1);
+    uint8_t n = 0;
+
+    while (n < TBGRPI_BURST_MSGS_MAX && tbg_msg_fifo_out(&tbg_rx_msg_fifo, msgs + n)) {
+        n++;
+    }
+    buf[0] = n;
+    return 1 + n * TBG_MSG_SIZE;
+}
+
+/*
+ * As msg_burst_get() but with the current time and each message's
+ * arrival time, as many as fit in size bytes.
+ */
+static int msg_burst_ts_get(uint8_t reg, uint8_t *buf, int size)
+{
+    uint8_t *rec = buf + 1 + TBGRPI_BURST_TS_NOW_SIZE;
+    uint32_t now = tbg_time_us();
+    uint32_t stamp;
+    uint8_t n = 0;
+    int max = (size - 1 - TBGRPI_BURST_TS_NOW_SIZE) / TBGRPI_BURST_TS_REC_SIZE;
+
+    if (max > TBGRPI_BURST_MSGS_MAX) {
+        max = TBGRPI_BURST_MSGS_MAX;
+    }
+    memcpy(buf + 1, &now, sizeof(now));
+    while (n < max && tbg_msg_fifo_out_stamped(&tbg_rx_msg_fifo, (tbg_msg_t *)rec, &stamp)) {
+        memcpy(rec + TBG_MSG_SIZE, &stamp, sizeof(stamp));
+        rec += TBGRPI_BURST_TS_REC_SIZE;
+        n++;
+    }
+    buf[0] = n;
+    return n ? rec - buf : 1;
+}
+
+static int filter_set(uint8_t reg, uint8_t *buf, int size)
 {
     uint8_t filtnum = reg - TBGRPI_REG_ADDR_FILT1;
-    uint32_t *x = (void *)buf; // Point to an array of 2 TBG CAN IDs
+    uint32_t x[2]; // 2 TBG CAN IDs
+
+    // buf needn't be aligned (an SPI frame's records aren't.)
+    memcpy(x, buf, sizeof(x));
+    // Odd filters go to FIFO 1, as set up by tbg_can_setup().
+    tbg_can_filter_set(filtnum, x[0], x[1], filtnum & 1, 1);
+    return size;
+}
 
-    CAN1->FMR |= CAN_FMR_FINIT;         // Enter Filter Init mode.
-    CAN1->sFilterRegister[filtnum].FR1 = TBG_STM32_TBGID2STM(x[0]); // Id
-    CAN1->sFilterRegister[filtnum].FR2 = TBG_STM32_TBGID2STM(x[1]); // Mask
-    CAN1->FM1R &= ~(1L << filtnum);     // Id/Mask mode
-    CAN1->FS1R |= 1L << filtnum;        // 32-bit Id/mask
-    CAN1->FFA1R &= ~(1L << filtnum);    // Filter assigned to FIFO 0
-    CAN1->FA1R |= 1L << filtnum;        // Activate this filter.
+static int filter_write(uint8_t reg, uint8_t *buf, int size)
+{
+    uint8_t filtnum = buf[TBGRPI_FILTER_BANK];
+    uint32_t id, mask;
 
-    CAN1->FMR &= ~CAN_FMR_FINIT;        // Leave Filter Init mode.
+    if (filtnum >= TBGRPI_FILTER_BANKS) {
+        return size;
+    }
+    memcpy(&id, buf + TBGRPI_FILTER_ID, sizeof(id));
+    memcpy(&mask, buf + TBGRPI_FILTER_MASK, sizeof(mask));
+    tbg_can_filter_set(filtnum, id, mask, filtnum & 1, buf[TBGRPI_FILTER_FLAGS] & TBGRPI_FILTER_FLAG_ACTIVE);
+    return size;
 }
 
 #define CAN_INIT_TIMEOUT (0x10000)
 
-static void cfg_reg_write(uint8_t reg, uint8_t *buf, int size)
+static int cfg_reg_write(uint8_t reg, uint8_t *buf, int size)
 {
-    uint32_t *x = (void *)buf;
-    uint32_t data = x[0], mask = x[1];
+    uint32_t data, mask;
 
-    tbg_rpi_cfg1 &= mask;
-    tbg_rpi_cfg1 |= data;
+    memcpy(&data, buf, sizeof(data));
+    memcpy(&mask, buf + sizeof(data), sizeof(mask));
+
+    tbg_rpi_cfg1 &= ~mask;
+    tbg_rpi_cfg1 |= data & mask;
     if (mask & TBGRPI_CFG1_LOOPBACK) {
         // To access BTR we need to enter Initialisation mode.
         CAN1->MCR |= CAN_MCR_INRQ;
         for (uint32_t i = 0; (!(CAN1->MSR & CAN_MSR_INAK)) && (i < CAN_INIT_TIMEOUT); i++);
-        if (data && TBGRPI_CFG1_LOOPBACK)
+        if (data & TBGRPI_CFG1_LOOPBACK)
             CAN1->BTR |= CAN_BTR_LBKM;
         else
             CAN1->BTR &= ~CAN_BTR_LBKM;
@@ -135,28 +252,81 @@ static void cfg_reg_write(uint8_t reg, uint8_t *buf, int size)
         // To access BTR we need to enter Initialisation mode.
         CAN1->MCR |= CAN_MCR_INRQ;
         for (uint32_t i = 0; (!(CAN1->MSR & CAN_MSR_INAK)) && (i < CAN_INIT_TIMEOUT); i++);
-        if (data && TBGRPI_CFG1_SILENT)
+        if (data & TBGRPI_CFG1_SILENT)
             CAN1->BTR |= CAN_BTR_SILM;
         else
             CAN1->BTR &= ~CAN_BTR_SILM;
         CAN1->MCR &= ~CAN_MCR_INRQ;
         for (uint32_t i = 0; (CAN1->MSR & CAN_MSR_INAK) && (i < CAN_INIT_TIMEOUT); i++);
     }
+    if ((mask & TBGRPI_CFG1_BITRATE_MASK) == TBGRPI_CFG1_BITRATE_MASK) {
+        uint16_t kbps = data >> TBGRPI_CFG1_BITRATE_SHIFT;
+        if (tbg_can_bitrate_ok(kbps) && kbps != tbg_can_bitrate) {
+            tbg_can_set_bitrate(kbps);
+            // Not from here: the flash stalls everything for ~20ms.
+            nv_save_pending = 1;
+        }
+    }
+    return size;
 }
 
-static void cfg_reg_read(uint8_t reg, uint8_t *buf, int size)
+static int cfg_reg_read(uint8_t reg, uint8_t *buf, int size)
 {
-    memcpy(buf, &tbg_rpi_cfg1, sizeof(tbg_rpi_cfg1));
+    uint32_t cfg1 = tbg_rpi_cfg1 & ~TBGRPI_CFG1_BITRATE_MASK;
+
+    cfg1 |= (uint32_t)tbg_can_bitrate << TBGRPI_CFG1_BITRATE_SHIFT;
+    memcpy(buf, &cfg1, sizeof(cfg1));
+    return size;
+}
+
+static int stats_reset(uint8_t reg, uint8_t *buf, int size)
+{
+    __disable_irq();
+    tbg_rpi_rx_hwm = TBG_MSG_FIFO_USED(&tbg_rx_msg_fifo);
+    tbg_rpi_rx_overflows = 0;
+    for (int prio = 0; prio < TBG_CAN_TX_PRIOS; prio++) {
+        tbg_can_tx_drops[prio] = 0;
+    }
+    __enable_irq();
+    return size;
+}
+
+static int stats_read(uint8_t reg, uint8_t *buf, int size)
+{
+    uint16_t rx_buf_size = tbg_rx_msg_fifo.size;
+    uint32_t tx_drops = 0;
+
+    __disable_irq();
+    for (int prio = 0; prio < TBG_CAN_TX_PRIOS; prio++) {
+        tx_drops += tbg_can_tx_drops[prio];
+    }
+    memcpy(buf + TBGRPI_STATS_TX_DROPS, &tx_drops, sizeof(tx_drops));
+    memcpy(buf + TBGRPI_STATS_RX_BUF_SIZE, &rx_buf_size, sizeof(rx_buf_size));
+    memcpy(buf + TBGRPI_STATS_RX_HWM, &tbg_rpi_rx_hwm, sizeof(tbg_rpi_rx_hwm));
+    memcpy(buf + TBGRPI_STATS_RX_OVERFLOWS, &tbg_rpi_rx_overflows, sizeof(tbg_rpi_rx_overflows));
+    __enable_irq();
+    return size;
 }
 
 void tbg_rpi_wr_data(uint8_t data)
 {
     tbg_rpi_t *tp = &tbgrpi;
     // Bounds-check the register address.
-    if (tp->addr > TBGRPI_REG_NUMOF) {
+    if (tp->addr >= TBGRPI_REG_NUMOF) {
         return;
     }
     const tbg_rpi_reg_t *reg = tbg_rpi_regs + tp->addr;
+    if (tp->addr == TBGRPI_REG_ADDR_BURST) {
+        // Count byte. The messages follow in a data phase.
+        if (data > TBGRPI_BURST_MSGS_MAX) {
+            data = TBGRPI_BURST_MSGS_MAX;
+        }
+        tp->wr_buf[0] = data;
+        tp->burst_len = TBGRPI_BURST_DATA_LEN(data);
+        tp->burst_buf = tp->wr_buf + 1;
+        tp->burst_wr = 1;
+        return;
+    }
     tp->wr_buf[tp->wr_ptr++] = data;
     if (tp->wr_ptr == reg->size) {
         tp->wr_ptr = 0;
@@ -170,18 +340,28 @@ uint8_t tbg_rpi_rd_data(void)
 {
     tbg_rpi_t *tp = &tbgrpi;
     // Bounds-check the register address.
-    if (tp->addr > TBGRPI_REG_NUMOF) {
+    if (tp->addr >= TBGRPI_REG_NUMOF) {
         return 0x55;
     }
     const tbg_rpi_reg_t *reg = tbg_rpi_regs + tp->addr;
+    if (tp->addr == TBGRPI_REG_ADDR_BURST || tp->addr == TBGRPI_REG_ADDR_BURST_TS) {
+        // Count byte. The rest follows in a data phase, padded to
+        // an odd length.
+        int len = reg->rd_fn(tp->addr, tp->rd_buf, reg->size);
+        tp->burst_len = (len > 1) ? (len - 1) | 1 : 0;
+        tp->burst_buf = tp->rd_buf + 1;
+        tp->burst_wr = 0;
+        return tp->rd_buf[0];
+    }
     if (tp->rd_ptr == 0) {
         // Fetch some new data
+        tp->rd_len = reg->size;
         if (reg->rd_fn) {
-            reg->rd_fn(tp->addr, tp->rd_buf, reg->size);
+            tp->rd_len = reg->rd_fn(tp->addr, tp->rd_buf, reg->size);
         }
     }
     uint8_t data = tp->rd_buf[tp->rd_ptr++];
-    if (tp->rd_ptr == reg->size) {
+    if (tp->rd_ptr >= tp->rd_len) {
         // If we read too much, just wrap back to beginning.
         tp->rd_ptr = 0;
     }
@@ -193,6 +373,7 @@ void tbg_rpi_wr_addr_config(uint8_t data)
     tbg_rpi_t *tp = &tbgrpi;
     tp->rd_ptr = 0;
     tp->wr_ptr = 0;
+    tp->burst_len = 0;
     tp->addr = (data & TBGRPI_ADDR_BIT_MASK) >> TBGRPI_ADDR_BIT_SHIFT;
     tp->conf = (data & TBGRPI_CONF_BIT_MASK);
     if (data & TBGRPI_CONF_RX_OVERFLOW_RESET) {
@@ -205,6 +386,7 @@ uint8_t tbg_rpi_rd_addr_status(void)
     tbg_rpi_t *tp = &tbgrpi;
     tp->rd_ptr = 0;
     tp->wr_ptr = 0;
+    tp->burst_len = 0;
     __disable_irq();
     // Capture status value.
     uint8_t stat = tp->stat;
@@ -215,16 +397,105 @@ uint8_t tbg_rpi_rd_addr_status(void)
     stat = (TBG_MSG_FIFO_EMPTY(&tbg_rx_msg_fifo)) ?
         stat & ~TBGRPI_STAT_RX_DATA_AVAIL :
         stat | TBGRPI_STAT_RX_DATA_AVAIL;
-    stat = ((CAN1->TSR & CAN_TSR_TME0) || (CAN1->TSR & CAN_TSR_TME1) || (CAN1->TSR & CAN_TSR_TME2)) ?
+    stat = (tbg_can_tx_room() >= TBGRPI_BURST_MSGS_MAX) ?
         stat | TBGRPI_STAT_TX_BUF_EMPTY :
         stat & ~TBGRPI_STAT_TX_BUF_EMPTY;
     __enable_irq();
     return (tp->addr << TBGRPI_ADDR_BIT_SHIFT) | (stat & TBGRPI_STAT_BIT_MASK);
 }
 
+/*
+ * Called at the end of each bus cycle. If it started a burst, returns
+ * the length of the data phase and sets *buf to where the data goes
+ * (or comes from) and *wr to non-zero if the Pi is writing. Otherwise
+ * returns 0.
+ */
+int tbg_rpi_burst_start(uint8_t **buf, uint8_t *wr)
+{
+    tbg_rpi_t *tp = &tbgrpi;
+
+    *buf = tp->burst_buf;
+    *wr = tp->burst_wr;
+    return tp->burst_len;
+}
+
+/*
+ * Called once a burst's data phase is over. Sends the messages if the
+ * Pi was writing.
+ */
+void tbg_rpi_burst_end(void)
+{
+    tbg_rpi_t *tp = &tbgrpi;
+
+    if (tp->burst_len && tp->burst_wr) {
+        const tbg_rpi_reg_t *reg = tbg_rpi_regs + TBGRPI_REG_ADDR_BURST;
+        reg->wr_fn(TBGRPI_REG_ADDR_BURST, tp->wr_buf, reg->size);
+    }
+    tp->burst_len = 0;
+}
+
+/*
+ * Act on a frame from the Pi over the SPI transport: write the
+ * addr/conf byte, then pass each record to the selected register's
+ * write function, as the parallel bus would a byte at a time.
+ */
+void tbg_rpi_spi_frame_rx(uint8_t *frame)
+{
+    tbg_rpi_t *tp = &tbgrpi;
+
+    tbg_rpi_wr_addr_config(frame[TBGRPI_SPI_ADDR]);
+    if (tp->addr >= TBGRPI_REG_NUMOF) {
+        return;
+    }
+    const tbg_rpi_reg_t *reg = tbg_rpi_regs + tp->addr;
+    if (!reg->wr_fn) {
+        return;
+    }
+    uint8_t *rec = frame + TBGRPI_SPI_HDR_SIZE;
+    for (int i = 0; i < frame[TBGRPI_SPI_COUNT]; i++) {
+        if (rec + reg->size > frame + TBGRPI_SPI_FRAME_SIZE) {
+            break;
+        }
+        reg->wr_fn(tp->addr, rec, reg->size);
+        rec += reg->size;
+    }
+}
+
+/*
+ * Fill in the frame the Pi will get at its next SPI transaction with
+ * records read from the selected register. For the CAN register that's
+ * as many messages as we have (or will fit), with their arrival times,
+ * for others it's one.
+ */
+void tbg_rpi_spi_frame_tx(uint8_t *frame)
+{
+    tbg_rpi_t *tp = &tbgrpi;
+    uint8_t *rec = frame + TBGRPI_SPI_HDR_SIZE;
+    uint8_t n = 0;
+
+    if (tp->addr == TBGRPI_REG_ADDR_CAN || tp->addr == TBGRPI_REG_ADDR_BURST_TS) {
+        // Count and data phase laid out as the timestamped burst
+        // register's on the parallel bus.
+        msg_burst_ts_get(tp->addr, frame + TBGRPI_SPI_COUNT, 1 + TBGRPI_SPI_PAYLOAD_SIZE);
+        n = frame[TBGRPI_SPI_COUNT];
+    } else if (tp->addr < TBGRPI_REG_NUMOF) {
+        const tbg_rpi_reg_t *reg = tbg_rpi_regs + tp->addr;
+        if (reg->rd_fn && reg->size <= TBGRPI_SPI_PAYLOAD_SIZE) {
+            reg->rd_fn(tp->addr, rec, reg->size);
+            n = 1;
+        }
+    }
+    frame[TBGRPI_SPI_COUNT] = n;
+    // Do the status last so RX data available says if anything's left.
+    frame[TBGRPI_SPI_ADDR] = tbg_rpi_rd_addr_status();
+}
+
 void tbg_rpi_txe_int(void)
 {
     tbg_rpi_t *tp = &tbgrpi;
+    if (tbg_can_tx_room() < TBGRPI_BURST_MSGS_MAX) {
+        return;
+    }
     tp->stat |= TBGRPI_STAT_TX_BUF_EMPTY;
     if (tp->conf & TBGRPI_CONF_TX_BUF_EMPTY_IE) {
         // Assert RPi's INT pin
@@ -232,12 +503,24 @@ void tbg_rpi_txe_int(void)
     }
 }
 
-void tbg_rpi_rxda_int(tbg_msg_t *msg)
+/*
+ * Take all the messages waiting in CAN hardware FIFO fifo_num into the
+ * RX buffer, stamped with stamp, and tell the Pi. Call it from the
+ * FIFO's interrupt handler.
+ */
+void tbg_rpi_rxda_int(int fifo_num, uint32_t stamp)
 {
     tbg_rpi_t *tp = &tbgrpi;
+    uint16_t used;
 
-    if (!tbg_msg_fifo_in(&tbg_rx_msg_fifo, msg)) {
+    int dropped = tbg_can_rx_drain(&tbg_rx_msg_fifo, fifo_num, stamp);
+    if (dropped) {
         tp->stat |= TBGRPI_STAT_RX_OVERFLOW;
+        tbg_rpi_rx_overflows += dropped;
+    }
+    used = TBG_MSG_FIFO_USED(&tbg_rx_msg_fifo);
+    if (used > tbg_rpi_rx_hwm) {
+        tbg_rpi_rx_hwm = used;
     }
 
     tp->stat |= TBGRPI_STAT_RX_DATA_AVAIL;
@@ -247,3 +530,109 @@ void tbg_rpi_rxda_int(tbg_msg_t *msg)
         CLR(RPI_PIN_INT);
     }
 }
+
+/*
+ * Save the bit rate if it's been changed. Call from the main loop, so
+ * the flash stall doesn't hold up the bus cycle that changed it.
+ */
+void tbg_rpi_poll(void)
+{
+    if (!nv_save_pending) {
+        return;
+    }
+    nv_save_pending = 0;
+    tbg_nv_t nv = *tbg_nv;
+    nv.can_bitrate = tbg_can_bitrate;
+    tbg_nv_write(&nv);
+}
+
+/*
+ * Call at 1kHz.
+ */
+void tbg_rpi_tick(void)
+{
+    if (!(tbg_rpi_cfg1 & TBGRPI_CFG1_TIME_SYNC)) {
+        return;
+    }
+    if (++time_sync_ms >= TBGRPI_TIME_SYNC_INTERVAL_MS) {
+        time_sync_ms = 0;
+        time_sync_due = 1;
+        NVIC_SetPendingIRQ(USB_HP_CAN1_TX_IRQn);
+    }
+}
+
+static void time_sync_msg(tbg_msg_t *msg, uint8_t cmd)
+{
+    tbg_msg_init(msg);
+    TBG_MSG_SET_EID(msg, 1);
+    TBG_MSG_SET_TYPE(msg, TBG_MSG_TYPE_IND);
+    TBG_MSG_SET_SRC_ADDR(msg, (tbg_rpi_cfg1 & TBGRPI_CFG1_SRC_ADDR_MASK) >> TBGRPI_CFG1_SRC_ADDR_SHIFT);
+    TBG_MSG_SET_DST_ADDR(msg, TBG_ADDR_BROADCAST);
+    TBG_MSG_SET_SRC_PORT(msg, TBG_PORT_TIME_SYNC);
+    TBG_MSG_SET_DST_PORT(msg, TBG_PORT_TIME_SYNC);
+    msg->data[TBG_TIME_SYNC_DATA_CMD] = cmd;
+    msg->data[TBG_TIME_SYNC_DATA_SEQ] = time_sync_seq;
+}
+
+/*
+ * Time sync master. Call from the TX interrupt handler before
+ * tbg_can_tx_int(), with the time it was entered. When the mailbox we
+ * put the SYNC in is done, that's when it went; the FOLLOW_UP takes
+ * the time to the nodes, and to the Pi, stamped with it. They skip the
+ * TX queues: this is where they're emptied from so nothing else will
+ * be using the mailboxes.
+ */
+void tbg_rpi_time_sync_int(uint32_t now)
+{
+    tbg_rpi_t *tp = &tbgrpi;
+    tbg_msg_t msg;
+
+    if (time_sync_mb >= 0) {
+        uint32_t tsr = CAN1->TSR;
+        if (tsr & (CAN_TSR_RQCP0 << (8 * time_sync_mb))) {
+            if (tsr & (CAN_TSR_TXOK0 << (8 * time_sync_mb))) {
+                time_sync_stamp = now;
+                time_sync_follow_up = 1;
+            }
+            time_sync_mb = -1;
+        }
+    }
+    if (time_sync_follow_up) {
+        time_sync_msg(&msg, TBG_TIME_SYNC_CMD_FOLLOW_UP);
+        memcpy(msg.data + TBG_TIME_SYNC_DATA_TIME, &time_sync_stamp, sizeof(time_sync_stamp));
+        msg.len = TBG_TIME_SYNC_FOLLOW_UP_LEN;
+        if (tbg_can_tx(&msg)) {
+            time_sync_follow_up = 0;
+            time_sync_seq++;
+            // We share a priority with the CAN RX handlers so can add to
+            // their buffer.
+            if (tbg_msg_fifo_in_stamped(&tbg_rx_msg_fifo, &msg, time_sync_stamp)) {
+                tp->stat |= TBGRPI_STAT_RX_DATA_AVAIL;
+                if (tp->conf & TBGRPI_CONF_RX_DATA_AVAIL_IE) {
+                    CLR(RPI_PIN_INT);
+                }
+            }
+        }
+    }
+    if (time_sync_due && time_sync_mb < 0 && !time_sync_follow_up) {
+        time_sync_msg(&msg, TBG_TIME_SYNC_CMD_SYNC);
+        msg.len = TBG_TIME_SYNC_SYNC_LEN;
+        int mb = tbg_can_tx(&msg);
+        if (mb) {
+            time_sync_mb = mb - 1;
+            time_sync_due = 0;
+        }
+    }
+}
+
+/*
+ * Called when the CAN controller had to drop messages because its
+ * own FIFOs were full.
+ */
+void tbg_rpi_rx_lost(void)
+{
+    tbg_rpi_t *tp = &tbgrpi;
+
+    tp->stat |= TBGRPI_STAT_RX_OVERFLOW;
+    tbg_rpi_rx_overflows++;
+}
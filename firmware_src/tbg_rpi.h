@@ -37,7 +37,17 @@ uint8_t tbg_rpi_rd_data(void);
 void tbg_rpi_wr_addr_config(uint8_t data);
 uint8_t tbg_rpi_rd_addr_status(void);
 
+int tbg_rpi_burst_start(uint8_t **buf, uint8_t *wr);
+void tbg_rpi_burst_end(void);
+
+void tbg_rpi_spi_frame_rx(uint8_t *frame);
+void tbg_rpi_spi_frame_tx(uint8_t *frame);
+
 void tbg_rpi_txe_int(void);
-void tbg_rpi_rxda_int(tbg_msg_t *msg);
+void tbg_rpi_rxda_int(int fifo_num, uint32_t stamp);
+void tbg_rpi_rx_lost(void);
+void tbg_rpi_tick(void);
+void tbg_rpi_poll(void);
+void tbg_rpi_time_sync_int(uint32_t now);
 
 #endif // TBGRPI_H
@@ -20,16 +20,50 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "stm32f10x.h"
 #include "tbg_stm32.h"
+#include "delay.h"
 
 // STM32 96-bit Unique ID
 tbg_stm32_unique_id_t *tbg_stm32_unique_id = (void *)0x1FFFF7E8;
 
+// Settings page, placed by the linker script at the end of flash.
+static const tbg_nv_t tbg_nv_page __attribute__ ((section (".tbg_nv")));
+const tbg_nv_t *tbg_nv = &tbg_nv_page;
+
+#define TBG_FLASH_KEY1              (0x45670123)
+#define TBG_FLASH_KEY2              (0xCDEF89AB)
+
+// Current CAN bit rate in kbit/s.
+uint16_t tbg_can_bitrate;
+
+static tbg_msg_t tbg_can_tx_bufs[TBG_CAN_TX_PRIOS][TBG_CAN_TX_QUEUE_SIZE];
+static tbg_msg_fifo_t tbg_can_tx_fifos[TBG_CAN_TX_PRIOS] = {
+    { .in = 0, .out = 0, .size = TBG_CAN_TX_QUEUE_SIZE, .bufs = tbg_can_tx_bufs[0], .stamps = NULL },
+    { .in = 0, .out = 0, .size = TBG_CAN_TX_QUEUE_SIZE, .bufs = tbg_can_tx_bufs[1], .stamps = NULL },
+    { .in = 0, .out = 0, .size = TBG_CAN_TX_QUEUE_SIZE, .bufs = tbg_can_tx_bufs[2], .stamps = NULL },
+    { .in = 0, .out = 0, .size = TBG_CAN_TX_QUEUE_SIZE, .bufs = tbg_can_tx_bufs[3], .stamps = NULL },
+};
+
+// Messages dropped because their TX queue was full, per priority.
+volatile uint32_t tbg_can_tx_drops[TBG_CAN_TX_PRIOS];
+
+static const uint16_t tbg_can_bitrates[] = TBG_CAN_BITRATES;
+
+// CAN bit timing: APB1 is 36MHz and a bit is 18 time quanta (SYNC + BS1
+// 11 + BS2 6, sampling at 67%) at any rate, so just the prescaler
+// changes. 1Mbit/s needs a short bus.
+#define TBG_CAN_PCLK_KHZ            (36000)
+#define TBG_CAN_TQ_PER_BIT          (18)
+#define TBG_CAN_PRESCALER(kbps)     (TBG_CAN_PCLK_KHZ / TBG_CAN_TQ_PER_BIT / (kbps))
+
+#define TBG_CAN_INIT_TIMEOUT        (0x10000)
+
 // Transmit a Touchbridge message on the CAN bus.
-// Returns 1 if sucessful, 0 if no TX mailboxes
-// were free.
+// Returns one more than the number of the TX mailbox
+// used if sucessful, 0 if none were free.
 int tbg_can_tx(tbg_msg_t *msg)
 {
     uint8_t tme = 7 & (CAN1->TSR >> 26); // TME[2:0]
@@ -56,13 +90,180 @@ int tbg_can_tx(tbg_msg_t *msg)
     mailbox->TDLR = data[0];
     mailbox->TDHR = data[1];
     mailbox->TIR |= CAN_TI0R_TXRQ; // Trigger transmission.
+    return mb_num + 1;
+}
+
+/*
+ * Move messages from the TX queues into free mailboxes, highest
+ * priority first. The queues' consumer: only call this from the TX
+ * interrupt handler or with interrupts disabled.
+ */
+static void can_tx_refill(void)
+{
+    for (int prio = 0; prio < TBG_CAN_TX_PRIOS; prio++) {
+        tbg_msg_fifo_t *f = tbg_can_tx_fifos + prio;
+        tbg_msg_t *msg;
+        while ((msg = tbg_msg_fifo_out_slot(f))) {
+            if (!tbg_can_tx(msg)) {
+                return;
+            }
+            tbg_msg_fifo_out_commit(f);
+        }
+    }
+}
+
+static int can_tx_idle(void)
+{
+    for (int prio = 0; prio < TBG_CAN_TX_PRIOS; prio++) {
+        if (!TBG_MSG_FIFO_EMPTY(tbg_can_tx_fifos + prio)) {
+            return 0;
+        }
+    }
+    return (CAN1->TSR & CAN_TSR_TME) == CAN_TSR_TME;
+}
+
+/*
+ * Queue msg to be sent from the TX interrupt (so TBG_CAN_SETUP_TX_IE
+ * is needed.) Returns 1 if successful, 0 if its queue was full, when
+ * it's counted in tbg_can_tx_drops. The queues have a single producer:
+ * only call this from one context, the main loop or one interrupt
+ * handler.
+ */
+int tbg_can_tx_queue(tbg_msg_t *msg)
+{
+    int prio = TBG_CAN_TX_PRIO(msg);
+
+    if (!tbg_msg_fifo_in(tbg_can_tx_fifos + prio, msg)) {
+        tbg_can_tx_drops[prio]++;
+        return 0;
+    }
+    // There may be a mailbox free already, in which case there's no
+    // TX interrupt coming to send it, so make one.
+    NVIC_SetPendingIRQ(USB_HP_CAN1_TX_IRQn);
     return 1;
 }
 
+/*
+ * Returns the number of messages that can be queued without any
+ * being dropped, whatever their priority.
+ */
+int tbg_can_tx_room(void)
+{
+    int room = TBG_CAN_TX_QUEUE_SIZE;
+
+    for (int prio = 0; prio < TBG_CAN_TX_PRIOS; prio++) {
+        int n = TBG_CAN_TX_QUEUE_SIZE - TBG_MSG_FIFO_USED(tbg_can_tx_fifos + prio);
+        if (n < room) {
+            room = n;
+        }
+    }
+    return room;
+}
+
+/*
+ * Call from USB_HP_CAN1_TX_IRQHandler.
+ */
+void tbg_can_tx_int(void)
+{
+    uint32_t tsr = CAN1->TSR;
+    if (tsr & CAN_TSR_RQCP2) CAN1->TSR |= CAN_TSR_RQCP2;
+    if (tsr & CAN_TSR_RQCP1) CAN1->TSR |= CAN_TSR_RQCP1;
+    if (tsr & CAN_TSR_RQCP0) CAN1->TSR |= CAN_TSR_RQCP0;
+
+    can_tx_refill();
+}
+
+/*
+ * Returns non-zero if kbps is one of the bit rates we support.
+ */
+int tbg_can_bitrate_ok(uint16_t kbps)
+{
+    for (int i = 0; i < sizeof(tbg_can_bitrates) / sizeof(tbg_can_bitrates[0]); i++) {
+        if (tbg_can_bitrates[i] == kbps) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void can_init(uint16_t kbps, uint8_t mode)
+{
+    CAN_InitTypeDef CAN_InitStructure;
+
+    CAN_InitStructure.CAN_Prescaler = TBG_CAN_PRESCALER(kbps);
+    CAN_InitStructure.CAN_SJW = CAN_SJW_2tq;
+    CAN_InitStructure.CAN_BS1 = CAN_BS1_11tq;
+    CAN_InitStructure.CAN_BS2 = CAN_BS2_6tq;
+    CAN_InitStructure.CAN_Mode = mode;
+    CAN_InitStructure.CAN_TTCM = DISABLE;
+
+    // Automatic recovery from "Bus-off" state, which is
+    // entered if too many errors occur.
+    CAN_InitStructure.CAN_ABOM = ENABLE;
+
+    CAN_InitStructure.CAN_AWUM = DISABLE;
+
+    // Allow automatic re-transmission
+    CAN_InitStructure.CAN_NART = DISABLE;
+
+    CAN_InitStructure.CAN_RFLM = DISABLE;
+    CAN_InitStructure.CAN_TXFP = ENABLE; // Tx MB priority by Tx order not ID.
+    CAN_Init(CAN1, &CAN_InitStructure);
+    tbg_can_bitrate = kbps;
+}
+
+static void can_rx_flush(void)
+{
+    while (CAN1->RF0R & CAN_RF0R_FMP0) {
+        CAN1->RF0R |= CAN_RF0R_RFOM0;
+    }
+    while (CAN1->RF1R & CAN_RF1R_FMP1) {
+        CAN1->RF1R |= CAN_RF1R_RFOM1;
+    }
+}
+
+/*
+ * Listen for a message at each bit rate in turn, starting with first.
+ * Returns the rate at which one was received, or 0 if none was (the
+ * bus is quiet, say.) This is done in silent mode, where we don't
+ * acknowledge or send error frames, so a wrong guess doesn't disturb
+ * the bus. A protocol error means we've got the wrong rate so we move
+ * straight on to the next.
+ */
+static uint16_t can_autobaud(uint16_t first)
+{
+    int n = sizeof(tbg_can_bitrates) / sizeof(tbg_can_bitrates[0]);
+
+    for (int i = -1; i < n; i++) {
+        uint16_t kbps = (i < 0) ? first : tbg_can_bitrates[i];
+        if (i >= 0 && kbps == first) {
+            continue;
+        }
+        can_init(kbps, CAN_Mode_Silent);
+        CAN1->ESR &= ~CAN_ESR_LEC;
+        for (int ms = 0; ms < TBG_CAN_AUTOBAUD_MS; ms++) {
+            if (CAN1->RF0R & CAN_RF0R_FMP0 || CAN1->RF1R & CAN_RF1R_FMP1) {
+                can_rx_flush();
+                return kbps;
+            }
+            if (CAN1->ESR & CAN_ESR_LEC) {
+                break;
+            }
+            delay_ms(1);
+        }
+        can_rx_flush();
+    }
+    return 0;
+}
+
+/*
+ * Set up the CAN controller, at the bit rate saved in flash if there
+ * is one. With TBG_CAN_SETUP_AUTOBAUD, listen for the rate the bus is
+ * actually running at first.
+ */
 void tbg_can_setup(int ie)
 {
     GPIO_InitTypeDef GPIO_InitStructure;
-    CAN_InitTypeDef CAN_InitStructure;
      
     RCC_APB1PeriphClockCmd(RCC_APB1Periph_CAN1, ENABLE);
     RCC_APB2PeriphClockCmd(RCC_APB2Periph_GPIOB | RCC_APB2Periph_AFIO, ENABLE);
@@ -78,29 +279,53 @@ void tbg_can_setup(int ie)
     GPIO_Init(GPIOB, &GPIO_InitStructure);
      
     GPIO_PinRemapConfig(GPIO_Remap1_CAN1 , ENABLE);
-     
-    // Set up timing for 500Kb/s CAN bus
-    CAN_InitStructure.CAN_Prescaler = 4;
-    CAN_InitStructure.CAN_SJW = CAN_SJW_2tq;
-    CAN_InitStructure.CAN_BS1 = CAN_BS1_11tq;
-    CAN_InitStructure.CAN_BS2 = CAN_BS2_6tq;
-    CAN_InitStructure.CAN_Mode = CAN_Mode_Normal;
-    //CAN_InitStructure.CAN_Mode = CAN_Mode_LoopBack;
-    CAN_InitStructure.CAN_TTCM = DISABLE;
 
-    // Automatic recovery from "Bus-off" state, which is
-    // entered if too many errors occur.
-    CAN_InitStructure.CAN_ABOM = ENABLE;
-
-    CAN_InitStructure.CAN_AWUM = DISABLE;
+    // Default "catch-all" filter setup.
+    CAN_FilterInitTypeDef CAN_FilterInitStructure;
+    CAN_FilterInitStructure.CAN_FilterNumber = 0;
+    CAN_FilterInitStructure.CAN_FilterMode = CAN_FilterMode_IdMask;
+    CAN_FilterInitStructure.CAN_FilterScale = CAN_FilterScale_32bit;
+    CAN_FilterInitStructure.CAN_FilterIdHigh = 0x0000;
+    CAN_FilterInitStructure.CAN_FilterIdLow = 0x0000;
+    CAN_FilterInitStructure.CAN_FilterMaskIdHigh = 0x0000;
+    CAN_FilterInitStructure.CAN_FilterMaskIdLow = 0x0000;
+    CAN_FilterInitStructure.CAN_FilterFIFOAssignment = 0;
+    CAN_FilterInitStructure.CAN_FilterActivation = ENABLE;
 
-    // Allow automatic re-transmission
-    CAN_InitStructure.CAN_NART = DISABLE;
+    if (ie & TBG_CAN_SETUP_RX1_IE) {
+        // Split the catch-all between both FIFOs, giving twice as much
+        // hardware buffering: filter 0 takes extended ID's with the split
+        // bit clear into FIFO 0, filter 1 those with it set into FIFO 1.
+        uint32_t mask = TBG_STM32_TBGID2STM(TBG_MSG_ID_BIT_EID | TBG_CAN_RX_FIFO_SPLIT_BIT);
+        uint32_t id = TBG_STM32_TBGID2STM(TBG_MSG_ID_BIT_EID);
+        CAN_FilterInitStructure.CAN_FilterIdHigh = id >> 16;
+        CAN_FilterInitStructure.CAN_FilterIdLow = id & 0xffff;
+        CAN_FilterInitStructure.CAN_FilterMaskIdHigh = mask >> 16;
+        CAN_FilterInitStructure.CAN_FilterMaskIdLow = mask & 0xffff;
+        CAN_FilterInit(&CAN_FilterInitStructure);
 
-    CAN_InitStructure.CAN_RFLM = DISABLE;
-    CAN_InitStructure.CAN_TXFP = ENABLE; // Tx MB priority by Tx order not ID.
-    CAN_Init(CAN1, &CAN_InitStructure);
+        id = mask;
+        CAN_FilterInitStructure.CAN_FilterNumber = 1;
+        CAN_FilterInitStructure.CAN_FilterIdHigh = id >> 16;
+        CAN_FilterInitStructure.CAN_FilterIdLow = id & 0xffff;
+        CAN_FilterInitStructure.CAN_FilterFIFOAssignment = 1;
+        CAN_FilterInit(&CAN_FilterInitStructure);
+    } else {
+        CAN_FilterInit(&CAN_FilterInitStructure);
+    }
 
+    uint16_t kbps = tbg_nv->can_bitrate;
+    if (!tbg_can_bitrate_ok(kbps)) {
+        kbps = TBG_CAN_BITRATE_DEFAULT;
+    }
+    if (ie & TBG_CAN_SETUP_AUTOBAUD) {
+        uint16_t found = can_autobaud(kbps);
+        if (found) {
+            kbps = found;
+        }
+    }
+    can_init(kbps, CAN_Mode_Normal);
+    //can_init(kbps, CAN_Mode_LoopBack);
 
     if (ie & TBG_CAN_SETUP_RX_IE) {
         NVIC_InitTypeDef NVIC_InitStructure;
@@ -114,6 +339,18 @@ void tbg_can_setup(int ie)
         CAN_ITConfig(CAN1, CAN_IT_FMP0, ENABLE);
     }
 
+    if (ie & TBG_CAN_SETUP_RX1_IE) {
+        NVIC_InitTypeDef NVIC_InitStructure;
+
+        NVIC_InitStructure.NVIC_IRQChannel = CAN1_RX1_IRQn;
+        NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
+        NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+        NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+        NVIC_Init(&NVIC_InitStructure);
+
+        CAN_ITConfig(CAN1, CAN_IT_FMP1, ENABLE);
+    }
+
     if (ie & TBG_CAN_SETUP_TX_IE) {
         NVIC_InitTypeDef NVIC_InitStructure;
 
@@ -125,20 +362,30 @@ void tbg_can_setup(int ie)
 
         CAN_ITConfig(CAN1, CAN_IT_TME, ENABLE);
     }
+}
 
-    // Default "catch-all" filter setup.
-    CAN_FilterInitTypeDef CAN_FilterInitStructure;
-    CAN_FilterInitStructure.CAN_FilterNumber = 0;
-    CAN_FilterInitStructure.CAN_FilterMode = CAN_FilterMode_IdMask;
-    CAN_FilterInitStructure.CAN_FilterScale = CAN_FilterScale_32bit;
-    CAN_FilterInitStructure.CAN_FilterIdHigh = 0x0000;
-    CAN_FilterInitStructure.CAN_FilterIdLow = 0x0000;
-    CAN_FilterInitStructure.CAN_FilterMaskIdHigh = 0x0000;
-    CAN_FilterInitStructure.CAN_FilterMaskIdLow = 0x0000;
-    CAN_FilterInitStructure.CAN_FilterFIFOAssignment = 0;
-    CAN_FilterInitStructure.CAN_FilterActivation = ENABLE;
-
-    CAN_FilterInit(&CAN_FilterInitStructure);
+/*
+ * Set up CAN filter bank filtnum to pass messages whose TBG ID matches
+ * id in the bits set in mask into hardware FIFO fifo_num, or just turn
+ * it off if active is zero.
+ */
+void tbg_can_filter_set(uint8_t filtnum, uint32_t id, uint32_t mask, int fifo_num, int active)
+{
+    CAN1->FMR |= CAN_FMR_FINIT;         // Enter Filter Init mode.
+    CAN1->FA1R &= ~(1L << filtnum);     // Deactivate while we change it.
+    if (active) {
+        CAN1->sFilterRegister[filtnum].FR1 = TBG_STM32_TBGID2STM(id);   // Id
+        CAN1->sFilterRegister[filtnum].FR2 = TBG_STM32_TBGID2STM(mask); // Mask
+        CAN1->FM1R &= ~(1L << filtnum);     // Id/Mask mode
+        CAN1->FS1R |= 1L << filtnum;        // 32-bit Id/mask
+        if (fifo_num) {
+            CAN1->FFA1R |= 1L << filtnum;
+        } else {
+            CAN1->FFA1R &= ~(1L << filtnum);
+        }
+        CAN1->FA1R |= 1L << filtnum;        // Activate this filter.
+    }
+    CAN1->FMR &= ~CAN_FMR_FINIT;        // Leave Filter Init mode.
 }
 
 /*
@@ -147,7 +394,15 @@ void tbg_can_setup(int ie)
  */
 void tbg_can_rx(tbg_msg_t *msg)
 {
-    CAN_FIFOMailBox_TypeDef *fifo = CAN1->sFIFOMailBox + 0;
+    tbg_can_rx_fifo(msg, 0);
+}
+
+/*
+ * Receive a CAN message from hardware FIFO fifo_num (0 or 1.)
+ */
+void tbg_can_rx_fifo(tbg_msg_t *msg, int fifo_num)
+{
+    CAN_FIFOMailBox_TypeDef *fifo = CAN1->sFIFOMailBox + fifo_num;
     if (fifo->RIR & CAN_RI0R_IDE) {
         msg->id = (uint32_t)0x1FFFFFFF & (fifo->RIR >> 3);
     } else {
@@ -160,5 +415,150 @@ void tbg_can_rx(tbg_msg_t *msg)
     data[0] = fifo->RDLR;
     data[1] = fifo->RDHR;
     // Release the CAN hardware FIFO
-    CAN1->RF0R |= CAN_RF0R_RFOM0;
+    if (fifo_num) {
+        CAN1->RF1R |= CAN_RF1R_RFOM1;
+    } else {
+        CAN1->RF0R |= CAN_RF0R_RFOM0;
+    }
+}
+
+/*
+ * Move every message pending in hardware FIFO fifo_num into f, decoding
+ * each straight into its slot, all with timestamp stamp. Call it from
+ * the FIFO's interrupt handler. Returns the number of messages dropped
+ * because f was full.
+ */
+int tbg_can_rx_drain(tbg_msg_fifo_t *f, int fifo_num, uint32_t stamp)
+{
+    // RF0R and RF1R have the same layout.
+    volatile uint32_t *rfr = fifo_num ? &CAN1->RF1R : &CAN1->RF0R;
+    int dropped = 0;
+
+    // Keep going until FMP is zero, which takes in anything that
+    // arrives while we're at it.
+    while (*rfr & CAN_RF0R_FMP0) {
+        tbg_msg_t *msg = tbg_msg_fifo_in_slot(f);
+        if (msg) {
+            tbg_can_rx_fifo(msg, fifo_num);
+            tbg_msg_fifo_in_commit(f, stamp);
+        } else {
+            *rfr |= CAN_RF0R_RFOM0;
+            dropped++;
+        }
+        // Wait for the next message to reach the output mailbox.
+        while (*rfr & CAN_RF0R_RFOM0);
+    }
+    return dropped;
+}
+
+/*
+ * Change the CAN bit rate, once anything queued has gone out at the
+ * old one. Loopback and silent mode are kept.
+ */
+void tbg_can_set_bitrate(uint16_t kbps)
+{
+    // We might be in an interrupt handler which stops the TX one
+    // running, so empty the queues ourselves.
+    for (uint32_t i = 0; !can_tx_idle() && i < TBG_CAN_INIT_TIMEOUT * 16; i++) {
+        __disable_irq();
+        can_tx_refill();
+        __enable_irq();
+    }
+
+    // To access BTR we need to enter Initialisation mode.
+    CAN1->MCR |= CAN_MCR_INRQ;
+    for (uint32_t i = 0; (!(CAN1->MSR & CAN_MSR_INAK)) && (i < TBG_CAN_INIT_TIMEOUT); i++);
+    CAN1->BTR = (CAN1->BTR & ~CAN_BTR_BRP) | (TBG_CAN_PRESCALER(kbps) - 1);
+    CAN1->MCR &= ~CAN_MCR_INRQ;
+    for (uint32_t i = 0; (CAN1->MSR & CAN_MSR_INAK) && (i < TBG_CAN_INIT_TIMEOUT); i++);
+    tbg_can_bitrate = kbps;
+}
+
+/*
+ * Save settings to flash. The page is only rewritten if they've changed.
+ * Erasing takes ~20ms, during which the CPU stalls, interrupts and all,
+ * so this is for occasional configuration only. Returns 1 if successful.
+ */
+int tbg_nv_write(const tbg_nv_t *nv)
+{
+    const uint16_t *src = (const void *)nv;
+    volatile uint16_t *dst = (volatile uint16_t *)&tbg_nv_page;
+
+    if (memcmp(nv, &tbg_nv_page, sizeof(*nv)) == 0) {
+        return 1;
+    }
+
+    FLASH->KEYR = TBG_FLASH_KEY1;
+    FLASH->KEYR = TBG_FLASH_KEY2;
+    while (FLASH->SR & FLASH_SR_BSY);
+
+    FLASH->CR |= FLASH_CR_PER;
+    FLASH->AR = (uint32_t)dst;
+    FLASH->CR |= FLASH_CR_STRT;
+    while (FLASH->SR & FLASH_SR_BSY);
+    FLASH->CR &= ~FLASH_CR_PER;
+
+    // Flash is programmed a half-word at a time.
+    FLASH->CR |= FLASH_CR_PG;
+    for (int i = 0; i < sizeof(*nv) / sizeof(uint16_t); i++) {
+        dst[i] = src[i];
+        while (FLASH->SR & FLASH_SR_BSY);
+    }
+    FLASH->CR &= ~FLASH_CR_PG;
+    FLASH->CR |= FLASH_CR_LOCK;
+
+    return memcmp(nv, &tbg_nv_page, sizeof(*nv)) == 0;
+}
+
+// High half of the microsecond counter.
+static volatile uint16_t tbg_time_hi;
+
+/*
+ * Free-running microsecond counter for timestamps. TIM4 counts at
+ * 1MHz and its update interrupt counts the high half, giving 32 bits
+ * which wrap every 71 minutes or so. It only takes the one timer so
+ * the nodes can have it too (the HCO uses TIM3 for PWM.)
+ */
+void tbg_time_setup(void)
+{
+    NVIC_InitTypeDef NVIC_InitStructure;
+
+    RCC->APB1ENR |= RCC_APB1ENR_TIM4EN;
+
+    TIM4->PSC = 72-1;   //  1 MHz after prescaler
+    TIM4->ARR = 0xffff;
+    TIM4->EGR = TIM_EGR_UG;
+    TIM4->SR = 0;
+    TIM4->DIER = TIM_DIER_UIE;
+
+    NVIC_InitStructure.NVIC_IRQChannel = TIM4_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 3;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+
+    TIM4->CR1 = TIM_CR1_CEN;
+}
+
+void TIM4_IRQHandler(void)
+{
+    TIM4->SR = ~TIM_SR_UIF;
+    tbg_time_hi++;
+}
+
+uint32_t tbg_time_us(void)
+{
+    uint32_t primask = __get_PRIMASK();
+    uint16_t hi, lo;
+
+    __disable_irq();
+    hi = tbg_time_hi;
+    lo = TIM4->CNT;
+    // If it's wrapped but the interrupt hasn't run yet (we might be in
+    // a handler which stops it) count the wrap ourselves.
+    if ((TIM4->SR & TIM_SR_UIF) && lo < 0x8000) {
+        hi++;
+    }
+    __set_PRIMASK(primask);
+    return ((uint32_t)hi << 16) | lo;
 }
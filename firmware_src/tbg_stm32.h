@@ -22,6 +22,7 @@
 #define TBG_STM32_H
 
 #include "tbg_protocol.h"
+#include "tbg_msg.h"
 
 /*
  * STM32 CAN FIFO ID format is:
@@ -35,6 +36,45 @@
 
 #define TBG_CAN_SETUP_RX_IE         (0x01)
 #define TBG_CAN_SETUP_TX_IE         (0x02)
+#define TBG_CAN_SETUP_RX1_IE        (0x04)
+#define TBG_CAN_SETUP_AUTOBAUD      (0x08)
+
+// With TBG_CAN_SETUP_RX1_IE the default filters send messages to
+// FIFO 0 or 1 according to this ID bit (LSB of source address.)
+#define TBG_CAN_RX_FIFO_SPLIT_BIT   (1 << 6)
+
+#define TBG_CAN_FILTER_BANKS        (14)
+
+// Filter ID & mask, in TBG format, for messages addressed to node addr.
+#define TBG_CAN_FILTER_DST_ID(addr) (TBG_MSG_ID_BIT_EID | ((uint32_t)(addr) << 18))
+#define TBG_CAN_FILTER_DST_MASK     (TBG_MSG_ID_BIT_EID | ((uint32_t)0x3f << 18))
+
+// Software TX queues, one per message type, emptied in the order the
+// bus would arbitrate them: RESP, REQ, ERR_RESP then IND. Each holds
+// TBG_CAN_TX_QUEUE_SIZE messages, which must be a power of 2.
+#define TBG_CAN_TX_PRIOS            (4)
+#define TBG_CAN_TX_PRIO(msg)        (TBG_MSG_GET_TYPE(msg))
+#ifndef TBG_CAN_TX_QUEUE_SIZE
+#define TBG_CAN_TX_QUEUE_SIZE       (16)
+#endif
+
+// The default CAN bit rate (see TBG_CAN_BITRATES) is used if none has
+// been saved and auto-baud (if asked for) doesn't find one.
+#define TBG_CAN_BITRATE_DEFAULT     (500)
+
+// Time auto-baud listens at each bit rate, in ms.
+#define TBG_CAN_AUTOBAUD_MS         (100)
+
+// Settings kept in the last page of flash. Erased flash reads as all
+// ones, so fields which haven't been saved are 0xffff.
+typedef struct tbg_nv_s {
+    uint16_t can_bitrate;       // kbit/s
+    uint16_t reserved;
+} tbg_nv_t;
+
+extern const tbg_nv_t *tbg_nv;
+extern uint16_t tbg_can_bitrate;
+extern volatile uint32_t tbg_can_tx_drops[TBG_CAN_TX_PRIOS];
 
 typedef union tbg_stm32_unique_id_u {
     uint32_t word32[3];
@@ -44,8 +84,21 @@ typedef union tbg_stm32_unique_id_u {
 extern tbg_stm32_unique_id_t *tbg_stm32_unique_id;
 
 int tbg_can_tx(tbg_msg_t *msg);
+int tbg_can_tx_queue(tbg_msg_t *msg);
+int tbg_can_tx_room(void);
+void tbg_can_tx_int(void);
 void tbg_can_rx(tbg_msg_t *msg);
+void tbg_can_rx_fifo(tbg_msg_t *msg, int fifo_num);
+int tbg_can_rx_drain(tbg_msg_fifo_t *f, int fifo_num, uint32_t stamp);
+void tbg_can_filter_set(uint8_t filtnum, uint32_t id, uint32_t mask, int fifo_num, int active);
 void tbg_can_setup(int ie);
+int tbg_can_bitrate_ok(uint16_t kbps);
+void tbg_can_set_bitrate(uint16_t kbps);
+
+int tbg_nv_write(const tbg_nv_t *nv);
+
+void tbg_time_setup(void);
+uint32_t tbg_time_us(void);
 
 
 #endif // TBG_STM32_H
@@ -34,7 +34,7 @@
 // Bit 3 Reserved
 // Bit 2 RX Buffer Overflow
 // Bit 1 RX Data Available
-// Bit 0 TX Buffer Empty
+// Bit 0 TX Buffer Empty (room for a full burst in the TX queues)
 //
 // When writing, if ADSEL bit is high,  addr/conf reg is:
 // Bits [7:4] Address
@@ -61,9 +61,112 @@
 #define TBGRPI_REG_ADDR_FILT1           (1)
 #define TBGRPI_REG_ADDR_FILT2           (2)
 #define TBGRPI_REG_ADDR_CFG1            (3)
-#define TBGRPI_REG_NUMOF                (4) 
+#define TBGRPI_REG_ADDR_BURST           (4)
+#define TBGRPI_REG_ADDR_STATS           (5)
+#define TBGRPI_REG_ADDR_FILTER          (6)
+#define TBGRPI_REG_ADDR_BURST_TS        (7)
+#define TBGRPI_REG_NUMOF                (8)
+
+// Burst register. Reading it returns a count byte, n, taken from the
+// RX buffer, then a data phase of n back-to-back tbg_msg_t's. Writing it
+// takes a count byte then a data phase of n messages to transmit. n may
+// be zero, in which case there's no data phase.
+//
+// The count byte is an ordinary bus cycle. In the data phase the
+// handshake is two-phase: /EN is still pulsed low for each byte but
+// /ACK just changes state once the byte's been latched (or, when the
+// Pi is reading, put on the bus), going low for the first byte, high
+// for the second and so on. The Pi needn't wait for anything after
+// raising /EN. The data phase is padded with a dummy byte if need be
+// to make its length odd, so /ACK always ends up low. The HAT raises
+// it again, once it's dealt with the messages and /EN is high, to say
+// it's ready for the next cycle.
+#define TBGRPI_BURST_MSGS_MAX           (8)
+#define TBGRPI_BURST_DATA_LEN(n)        ((n) ? ((n) * TBG_MSG_SIZE) | 1 : 0)
+
+// Timestamped burst register, read only. The same as reading the burst
+// register except that the data phase starts with the HAT's current
+// time and each message is followed by the time it arrived. Times are
+// uint32_t microseconds from a free-running counter which wraps; only
+// the difference between the two matters.
+#define TBGRPI_BURST_TS_NOW_SIZE        (4)
+#define TBGRPI_BURST_TS_REC_SIZE        (TBG_MSG_SIZE + 4)
+#define TBGRPI_BURST_TS_DATA_LEN(n)     ((n) ? (TBGRPI_BURST_TS_NOW_SIZE + (n) * TBGRPI_BURST_TS_REC_SIZE) | 1 : 0)
+
+#define TBGRPI_BURST_DATA_MAX           (TBGRPI_BURST_TS_DATA_LEN(TBGRPI_BURST_MSGS_MAX))
+#define TBGRPI_BURST_SIZE               (1 + TBGRPI_BURST_DATA_MAX)
 
 #define TBGRPI_CFG1_LOOPBACK            (0x00000001)
 #define TBGRPI_CFG1_SILENT              (0x00000002)
 
+// Be the time sync master (see TBG_PORT_TIME_SYNC), sending SYNCs every
+// TBGRPI_TIME_SYNC_INTERVAL_MS from the Touchbridge address in SRC_ADDR.
+#define TBGRPI_CFG1_TIME_SYNC           (0x00000004)
+#define TBGRPI_CFG1_SRC_ADDR_MASK       (0x00003f00)
+#define TBGRPI_CFG1_SRC_ADDR_SHIFT      (8)
+
+#define TBGRPI_TIME_SYNC_INTERVAL_MS    (1000)
+
+// CAN bit rate in kbit/s (125, 250, 500 or 1000.) Writing it changes the
+// rate, once anything queued has gone out, and saves it in flash for
+// next time. Other values are ignored.
+#define TBGRPI_CFG1_BITRATE_MASK        (0xffff0000)
+#define TBGRPI_CFG1_BITRATE_SHIFT       (16)
+
+// Stats register layout. All little-endian. RX_HWM is the most messages
+// the RX buffer has held and RX_OVERFLOWS counts messages lost, whether
+// the RX buffer or the CAN controller's FIFOs were full. TX_DROPS counts
+// messages from the Pi lost because the TX queues were full. Writing
+// (any value) resets the lot.
+#define TBGRPI_STATS_RX_BUF_SIZE        (0)     // uint16_t
+#define TBGRPI_STATS_RX_HWM             (2)     // uint16_t
+#define TBGRPI_STATS_RX_OVERFLOWS       (4)     // uint32_t
+#define TBGRPI_STATS_TX_DROPS           (8)     // uint32_t
+#define TBGRPI_STATS_SIZE               (12)
+
+// Filter register layout. Each write sets up one of the CAN controller's
+// acceptance filter banks with a 32-bit ID/mask pair, in Touchbridge
+// ID format (which must include TBG_MSG_ID_BIT_EID) or turns it off.
+// Messages matching even banks go to CAN FIFO 0, odd ones to FIFO 1.
+// Banks 0 & 1 start off as the catch-all set up by tbg_can_setup().
+#define TBGRPI_FILTER_BANKS             (14)
+#define TBGRPI_FILTER_BANK              (0)     // uint8_t
+#define TBGRPI_FILTER_FLAGS             (1)     // uint8_t
+#define TBGRPI_FILTER_ID                (4)     // uint32_t
+#define TBGRPI_FILTER_MASK              (8)     // uint32_t
+#define TBGRPI_FILTER_SIZE              (12)
+
+#define TBGRPI_FILTER_FLAG_ACTIVE       (0x01)
+
+// SPI transport (HAT firmware built with TBGRPI_SPI).
+//
+// Each SPI transaction is a full-duplex exchange of one fixed-size
+// frame in each direction. Frame layout, Pi to HAT:
+// Byte 0 addr/conf, as written with ADSEL high on the parallel bus
+// Byte 1 Number of records that follow
+// Bytes 2.. Records to write to the addressed register
+//
+// HAT to Pi:
+// Byte 0 addr/stat, as read with ADSEL high on the parallel bus
+// Byte 1 Number of records that follow
+// Bytes 2.. Records read from the register named in byte 0
+//
+// The HAT prepares its frame when the previous one ends, so the records
+// come from the register selected by the previous frame the Pi sent.
+// For the CAN register (or the timestamped burst register) the count is
+// of messages, up to TBGRPI_SPI_MSGS_MAX, and they're laid out as the
+// timestamped burst register's data phase: the HAT's time, then each
+// message followed by its arrival time. Messages written to the CAN
+// register are plain tbg_msg_t's. Other registers give one record per
+// frame.
+// The Pi must leave at least TBGRPI_SPI_GAP_US between frames.
+
+#define TBGRPI_SPI_ADDR                 (0)
+#define TBGRPI_SPI_COUNT                (1)
+#define TBGRPI_SPI_HDR_SIZE             (2)
+#define TBGRPI_SPI_MSGS_MAX             (8)
+#define TBGRPI_SPI_PAYLOAD_SIZE         (TBGRPI_BURST_TS_NOW_SIZE + TBGRPI_SPI_MSGS_MAX * TBGRPI_BURST_TS_REC_SIZE)
+#define TBGRPI_SPI_FRAME_SIZE           (TBGRPI_SPI_HDR_SIZE + TBGRPI_SPI_PAYLOAD_SIZE)
+#define TBGRPI_SPI_GAP_US               (50)
+
 #endif // TBGRPI_PROTOCOL_H
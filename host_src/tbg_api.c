@@ -60,6 +60,9 @@ tbg_socket_t *tbg_open(char *server_uri)
     tbg_socket_t *tsock = g_new(tbg_socket_t, 1);
 
     tsock->timeout = TBG_DEFAULT_TIMEOUT;
+    tsock->rx_us = 0;
+    tsock->sync_hat_us = 0;
+    tsock->sync_host_us = 0;
 
     tsock->zsocket = zmq_socket(zcontext, ZMQ_DEALER);
     if (tsock->zsocket == NULL) {
@@ -179,6 +182,57 @@ int tbg_port_request(tbg_port_t *port, uint8_t *data, int len)
 
 #define RESP_BUF_SIZE   (256)
 
+/*
+ * Returns non-zero if msg is a time sync FOLLOW_UP passed on by the
+ * HAT, after noting the time in it. Its arrival time is our time at
+ * the SYNC, and it carries the HAT's.
+ */
+static int time_sync_check(tbg_socket_t *tsock, tbg_msg_t *msg)
+{
+    if (TBG_MSG_GET_TYPE(msg) != TBG_MSG_TYPE_IND
+            || TBG_MSG_GET_SRC_PORT(msg) != TBG_PORT_TIME_SYNC
+            || msg->len < TBG_TIME_SYNC_FOLLOW_UP_LEN
+            || msg->data[TBG_TIME_SYNC_DATA_CMD] != TBG_TIME_SYNC_CMD_FOLLOW_UP) {
+        return 0;
+    }
+    if (tsock->rx_us) {
+        memcpy(&tsock->sync_hat_us, msg->data + TBG_TIME_SYNC_DATA_TIME, sizeof(tsock->sync_hat_us));
+        tsock->sync_host_us = tsock->rx_us;
+    }
+    return 1;
+}
+
+/*
+ * Send a request and collect its response, which may come in several
+ * frames (see TBG_MSG_CONT), putting their data together in buf.
+ * Returns the length, or -1 on timeout, an error response or if it
+ * won't fit in max bytes.
+ */
+int tbg_request_cont(tbg_socket_t *tsock, int node, int port, uint8_t *data, int len, uint8_t *buf, int max)
+{
+    tbg_msg_t resp;
+    int n = 0;
+
+    tbg_request(tsock, node, port, data, len, NULL);
+    while (tbg_wait_response2(tsock, tsock->timeout, &resp, node, port)) {
+        if (TBG_MSG_GET_TYPE(&resp) == TBG_MSG_TYPE_ERR_RESP) {
+            return -1;
+        }
+        if (TBG_MSG_GET_TYPE(&resp) != TBG_MSG_TYPE_RESP) {
+            continue;
+        }
+        if (n + resp.len > max) {
+            return -1;
+        }
+        memcpy(buf + n, resp.data, resp.len);
+        n += resp.len;
+        if (TBG_MSG_GET_CONT(&resp) != TBG_MSG_CONT) {
+            return n;
+        }
+    }
+    return -1;
+}
+
 /*
  * Wait for a message to arrive with timeout.
  * Returns zero on timeout, non-zero on success.
@@ -196,8 +250,16 @@ int tbg_wait_response(tbg_socket_t *tsock, int timeout, tbg_msg_t *resp)
         if (len >= RESP_BUF_SIZE) ERROR("response buffer overflow");
         buf[len] = '\0';
         PRINTD(4, "response: len=%d, buf=\"%s\"\n", len, buf);
+        tsock->rx_us = tbg_msg_time_from_hex(buf);
+        tbg_msg_t msg;
+        tbg_msg_from_hex(&msg, buf);
+        if (time_sync_check(tsock, &msg)) {
+            // Not for our caller. They come a second apart so this
+            // won't keep them waiting much longer than they asked.
+            return tbg_wait_response(tsock, timeout, resp);
+        }
         if (resp != NULL) {
-            tbg_msg_from_hex(resp, buf);
+            *resp = msg;
             if (TBG_MSG_IS_ERR_RESP(resp)) {
                 uint8_t err_code = resp->data[0];
                 if (err_code >= sizeof(tbg_error_strings)/sizeof(char*)) {
@@ -721,6 +783,40 @@ void tbg_port_close(tbg_port_t *port)
     g_free(port);
 }
 
+/*
+ * Read all the channels of an analogue snapshot port (like the HCO's
+ * port 13) into values, which has room for max. Returns the number of
+ * channels, or -1 on failure.
+ */
+int tbg_analogue_snapshot(tbg_port_t *port, uint16_t *values, int max)
+{
+    int n = tbg_request_cont(port->tsock, port->addr, port->port, NULL, 0, (uint8_t *)values, max * sizeof(uint16_t));
+    return (n < 0) ? n : n / (int)sizeof(uint16_t);
+}
+
+/*
+ * Make a counter/timer port request (TBG_CTR_CMD_*) of a channel,
+ * returning its two words in a and b. Returns non-zero on success.
+ */
+int tbg_ctr_read(tbg_port_t *port, int channel, int cmd, uint32_t *a, uint32_t *b)
+{
+    uint8_t req_data[TBG_CTR_REQ_LEN];
+    tbg_msg_t resp;
+
+    req_data[TBG_CTR_REQ_DATA_CHANNEL] = channel;
+    req_data[TBG_CTR_REQ_DATA_CMD] = cmd;
+    PRINTD(2, "ctr: addr %d, port %d, channel %d, cmd %d\n", port->addr, port->port, channel, cmd);
+    tbg_request(port->tsock, port->addr, port->port, req_data, sizeof(req_data), NULL);
+    if (!tbg_wait_response2(port->tsock, port->timeout, &resp, port->addr, port->port)
+            || TBG_MSG_GET_TYPE(&resp) != TBG_MSG_TYPE_RESP
+            || resp.len != TBG_CTR_RESP_LEN) {
+        return 0;
+    }
+    memcpy(a, resp.data + TBG_CTR_RESP_DATA_A, sizeof(*a));
+    memcpy(b, resp.data + TBG_CTR_RESP_DATA_B, sizeof(*b));
+    return 1;
+}
+
 int tbg_dout(tbg_port_t *port, uint32_t value, uint32_t mask)
 {
     uint32_t req_data[2] = { value, mask };
@@ -754,3 +850,119 @@ int tbg_port_conf_write(tbg_port_t *port, uint8_t cmd, uint8_t *conf_data, int l
     g_free(conf_port);
     return ret;
 }
+
+/*
+ * Enable or disable the timestamp trigger on port. While it's enabled,
+ * requests to the port are held by the node until tbg_tstrigger(), and
+ * their results come back as IND messages from the port.
+ */
+int tbg_port_tstrigger_enable(tbg_port_t *port, int enable)
+{
+    uint8_t en = enable ? 1 : 0;
+    return tbg_port_conf_write(port, TBG_PORTCONF_CMD_COM_EN_TSTRIGGER, &en, sizeof(en));
+}
+
+/*
+ * Have the node carry out a request on port, with len (up to two) bytes
+ * of data, every interval_ms and send us the results as IND messages
+ * from the port. With a deadband they only come when some uint16_t in
+ * the result moves by more than that. An interval of 0 cancels it.
+ */
+int tbg_port_subscribe(tbg_port_t *port, uint16_t interval_ms, uint16_t deadband, uint8_t *data, int len)
+{
+    uint8_t conf_data[6];
+
+    assert(len <= sizeof(conf_data) - 4);
+    memcpy(conf_data + TBG_SUBSCRIBE_CONF_DATA_INTERVAL - TBG_PORTCONF_REQ_LEN_MIN, &interval_ms, sizeof(interval_ms));
+    memcpy(conf_data + TBG_SUBSCRIBE_CONF_DATA_DEADBAND - TBG_PORTCONF_REQ_LEN_MIN, &deadband, sizeof(deadband));
+    memcpy(conf_data + TBG_SUBSCRIBE_CONF_DATA_REQ - TBG_PORTCONF_REQ_LEN_MIN, data, len);
+    return tbg_port_conf_write(port, TBG_PORTCONF_CMD_COM_SUBSCRIBE, conf_data, 4 + len);
+}
+
+/*
+ * Have every node carry out the requests it's holding for the trigger,
+ * all with the one broadcast frame.
+ */
+void tbg_tstrigger(tbg_socket_t *tsock)
+{
+    uint8_t data[1] = { 0 };
+    tbg_request(tsock, TBG_ADDR_BROADCAST, TBG_PORT_TSTRIGGER, data, 0, NULL);
+}
+
+/*
+ * Convert a time from a node (which nodes keep on the HAT's clock, see
+ * TBG_PORT_TIME_SYNC) to our CLOCK_MONOTONIC microseconds, like rx_us.
+ * Returns 0 if we haven't seen a time sync yet. Only as good as the
+ * last one, and only within half an hour or so of it, as the HAT's
+ * clock wraps.
+ */
+uint64_t tbg_time_to_host_us(tbg_socket_t *tsock, uint32_t node_us)
+{
+    if (!tsock->sync_host_us) {
+        return 0;
+    }
+    return tsock->sync_host_us + (int32_t)(node_us - tsock->sync_hat_us);
+}
+
+/*
+ * When an event happened, from the low bits of its time on the HAT's
+ * clock, t, in units of 1 << shift us, put together with the time the
+ * IND it came in got to the HAT. 0 without a time sync.
+ */
+static uint64_t din_ev_host_us(tbg_socket_t *tsock, uint32_t t, int shift, int bits)
+{
+    if (!tsock->sync_host_us || !tsock->rx_us) {
+        return 0;
+    }
+    const uint32_t wrap = 1u << bits;
+    uint32_t hat_rx_us = tsock->sync_hat_us + (uint32_t)(tsock->rx_us - tsock->sync_host_us);
+    uint32_t age = ((hat_rx_us >> shift) - t) & (wrap - 1);
+    return tsock->rx_us - ((uint64_t)age << shift);
+}
+
+/*
+ * Unpack the events from a digital input IND, just received on tsock,
+ * sent in format (TBG_DIN_EV_FORMAT_*, as set up on the port), into ev,
+ * which must have room for TBG_DIN_EV_PACKED_MAX. Returns how many
+ * there were, 0 if it's not a valid one. The timed and packed formats
+ * say when; their times only carry the low bits, so they're put
+ * together with the time the IND got to the HAT. They can't be known
+ * without a time sync.
+ */
+int tbg_din_event(tbg_socket_t *tsock, tbg_msg_t *msg, int format, tbg_din_event_t *ev)
+{
+    ev->host_us = 0;
+    if (format == TBG_DIN_EV_FORMAT_PACKED) {
+        int n = msg->len / TBG_DIN_EV_PACKED_REC_LEN;
+        if (!n || n > TBG_DIN_EV_PACKED_MAX || msg->len % TBG_DIN_EV_PACKED_REC_LEN) {
+            return 0;
+        }
+        for (int i = 0; i < n; i++) {
+            uint8_t *rec = msg->data + i * TBG_DIN_EV_PACKED_REC_LEN;
+            uint8_t *p = rec + TBG_DIN_EV_PACKED_DATA_TIME;
+            ev[i].events = rec[TBG_DIN_EV_PACKED_DATA_EVENTS];
+            ev[i].inputs = rec[TBG_DIN_EV_PACKED_DATA_INPUTS];
+            ev[i].host_us = din_ev_host_us(tsock, p[0] | p[1] << 8,
+                    TBG_DIN_EV_PACKED_TIME_SHIFT, TBG_DIN_EV_PACKED_TIME_BITS);
+        }
+        return n;
+    }
+    if (format != TBG_DIN_EV_FORMAT_TIMED) {
+        if (msg->len != TBG_DIN_EV_LEN) {
+            return 0;
+        }
+        memcpy(&ev->events, msg->data + TBG_DIN_EV_DATA_EVENTS, sizeof(ev->events));
+        memcpy(&ev->inputs, msg->data + TBG_DIN_EV_DATA_INPUTS, sizeof(ev->inputs));
+        return 1;
+    }
+
+    if (msg->len != TBG_DIN_EV_TIMED_LEN || msg->data[TBG_DIN_EV_TIMED_DATA_CHANNEL] > 31) {
+        return 0;
+    }
+    memcpy(&ev->inputs, msg->data + TBG_DIN_EV_TIMED_DATA_INPUTS, sizeof(ev->inputs));
+    ev->events = 1u << msg->data[TBG_DIN_EV_TIMED_DATA_CHANNEL];
+    uint8_t *p = msg->data + TBG_DIN_EV_TIMED_DATA_TIME;
+    ev->host_us = din_ev_host_us(tsock, p[0] | p[1] << 8 | (uint32_t)p[2] << 16,
+            TBG_DIN_EV_TIME_SHIFT, TBG_DIN_EV_TIME_BITS);
+    return 1;
+}
@@ -34,6 +34,9 @@
 typedef struct {
     void *zsocket; // 0MQ socket
     int timeout;
+    uint64_t rx_us; // When the last message received got to the HAT, 0 if unknown
+    uint32_t sync_hat_us;  // HAT's time at the last time sync
+    uint64_t sync_host_us; // and ours, 0 if there hasn't been one
 } tbg_socket_t;
 
 typedef struct {
@@ -43,6 +46,13 @@ typedef struct {
     int timeout;
 } tbg_port_t;
 
+// An input event from a digital input IND, see tbg_din_event().
+typedef struct tbg_din_event_s {
+    uint32_t events;    // Inputs that changed
+    uint32_t inputs;    // State of all the inputs after
+    uint64_t host_us;   // When, as for rx_us, 0 if unknown
+} tbg_din_event_t;
+
 typedef struct tbg_node_info_s {
     uint64_t id_msw;
     uint64_t id_lsw;
@@ -56,6 +66,7 @@ void tbg_close(tbg_socket_t *tsock);
 tbg_port_t *tbg_port_open(tbg_socket_t *tsock, uint8_t addr, uint8_t portnum);
 void tbg_port_close(tbg_port_t *port);
 int tbg_request(tbg_socket_t *tsock, int node, int port, uint8_t *data, int len, tbg_msg_t *resp);
+int tbg_request_cont(tbg_socket_t *tsock, int node, int port, uint8_t *data, int len, uint8_t *buf, int max);
 int tbg_wait_response(tbg_socket_t *tsock, int timeout, tbg_msg_t *resp);
 int tbg_wait_response2(tbg_socket_t *tsock, int timeout, tbg_msg_t *resp, int addr, int port);
 void tbg_flush_responses(tbg_socket_t *tsock, int timeout);
@@ -69,8 +80,15 @@ void tbg_node_info_free(tbg_node_info_t *node);
 
 int tbg_dout(tbg_port_t *port, uint32_t value, uint32_t mask);
 int tbg_aout(tbg_port_t *port, int pin, int value);
+int tbg_analogue_snapshot(tbg_port_t *port, uint16_t *values, int max);
+int tbg_ctr_read(tbg_port_t *port, int channel, int cmd, uint32_t *a, uint32_t *b);
 
 int tbg_port_conf_write(tbg_port_t *port, uint8_t cmd, uint8_t *conf_data, int len);
 int tbg_port_wait_msg(tbg_port_t *port, int msg_type, int timeout, tbg_msg_t *msg);
+int tbg_port_tstrigger_enable(tbg_port_t *port, int enable);
+int tbg_port_subscribe(tbg_port_t *port, uint16_t interval_ms, uint16_t deadband, uint8_t *data, int len);
+uint64_t tbg_time_to_host_us(tbg_socket_t *tsock, uint32_t node_us);
+int tbg_din_event(tbg_socket_t *tsock, tbg_msg_t *msg, int format, tbg_din_event_t *ev);
+void tbg_tstrigger(tbg_socket_t *tsock);
 
 #endif // TBG_API_H
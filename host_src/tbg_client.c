@@ -249,13 +249,15 @@ int din_cmd(int argc, char **argv, tbg_socket_t *tsock)
     while (1) {
         ret = tbg_port_wait_msg(port, TBG_MSG_TYPE_IND, TBG_TIMEOUT_FOREVER, &msg);
         if (ret) {
-            uint32_t events = msg.data32[0];
-            uint32_t state = msg.data32[1];
-            if (events & mask) {
-                //printf("mask = 0x%08X, events = 0x%08X, state = 0x%08X\n", mask, events, state);
-                printf("%c\n", (state & mask) ? '1' : '0');
-                fflush(stdout);
+            tbg_din_event_t ev[TBG_DIN_EV_PACKED_MAX];
+            int n = tbg_din_event(tsock, &msg, TBG_DIN_EV_FORMAT_TIMED, ev);
+            for (int i = 0; i < n; i++) {
+                if (ev[i].events & mask) {
+                    //printf("mask = 0x%08X, events = 0x%08X, state = 0x%08X\n", mask, ev[i].events, ev[i].inputs);
+                    printf("%c\n", (ev[i].inputs & mask) ? '1' : '0');
+                }
             }
+            fflush(stdout);
         }
     }
     tbg_port_close(port);
@@ -267,6 +269,45 @@ void din_usage(char *name)
     printf("usage: %s %s node pin\n", progname, name);
 }
 
+int ctr_cmd(int argc, char **argv, tbg_socket_t *tsock)
+{
+    uint32_t a, b;
+    int cmd = TBG_CTR_CMD_COUNT;
+    int node = atoi(argv[1]);
+    int portnum = 9;
+    int channel = atoi(argv[2]);
+    if (channel < 1 || channel > 32)
+        ERROR("channel number \"%s\" out of bounds", argv[2]);
+    channel--;
+    if (argc > 3) {
+        if (strcmp(argv[3], "count") == 0) {
+            cmd = TBG_CTR_CMD_COUNT;
+        } else if (strcmp(argv[3], "reset") == 0) {
+            cmd = TBG_CTR_CMD_COUNT_RESET;
+        } else if (strcmp(argv[3], "period") == 0) {
+            cmd = TBG_CTR_CMD_PERIOD;
+        } else {
+            ERROR("unknown counter command \"%s\"", argv[3]);
+        }
+    }
+    tbg_port_t *port = tbg_port_open(tsock, node, portnum);
+    if (!tbg_ctr_read(port, channel, cmd, &a, &b)) {
+        ERROR("no response from node %d", node);
+    }
+    if (cmd == TBG_CTR_CMD_PERIOD) {
+        printf("period %u us, last edge at %u us\n", a, b);
+    } else {
+        printf("count %u in %u us\n", a, b);
+    }
+    tbg_port_close(port);
+    return 0;
+}
+
+void ctr_usage(char *name)
+{
+    printf("usage: %s %s node channel [count|reset|period]\n", progname, name);
+}
+
 int aout_cmd(int argc, char **argv, tbg_socket_t *tsock)
 {
     int ret;
@@ -446,6 +487,7 @@ const command_t commands[] = {
     {  "dout", dout_cmd, 2, dout_usage },
     {  "dout2", dout_cmd2, 2, dout_cmd2_usage },
     {  "din", din_cmd, 2, din_usage },
+    {  "ctr", ctr_cmd, 2, ctr_usage },
     {  "aout", aout_cmd, 2, aout_usage },
     {  "ain", ain_cmd, 2, ain_usage },
     {  "tbg", tbg_cmd, 2, tbg_usage },
@@ -0,0 +1,112 @@
+/*
+ *
+ * tbg_filter.c
+ *
+ * This file is part of Touchbridge
+ *
+ * Copyright 2015 James L Macfarlane
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Squeeze a set of CAN acceptance filters into the number of filter
+ * banks the hardware has.
+ */
+
+#include <stdint.h>
+
+#include "tbg_filter.h"
+
+static int popcount(uint32_t x)
+{
+    int n = 0;
+    for (; x; x &= x - 1) {
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Return non-zero if everything b passes, a passes too.
+ */
+static int tbg_filter_covers(tbg_filter_t *a, tbg_filter_t *b)
+{
+    return (a->mask & ~b->mask) == 0 && ((a->id ^ b->id) & a->mask) == 0;
+}
+
+/*
+ * The smallest filter passing everything a and b do.
+ */
+static tbg_filter_t tbg_filter_union(tbg_filter_t *a, tbg_filter_t *b)
+{
+    tbg_filter_t u;
+    u.mask = a->mask & b->mask & ~(a->id ^ b->id);
+    u.id = a->id & u.mask;
+    return u;
+}
+
+static void tbg_filter_remove(tbg_filter_t *filters, int n, int i)
+{
+    for (; i < n - 1; i++) {
+        filters[i] = filters[i + 1];
+    }
+}
+
+/*
+ * Reduce the n filters in filters to at most max, returning how many
+ * are left. Filters made redundant by others are dropped first, then
+ * pairs are merged, each time picking the pair whose union has the
+ * most bits in its mask, i.e. lets the fewest extra ID's through.
+ */
+int tbg_filter_merge(tbg_filter_t *filters, int n, int max)
+{
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            if (i != j && tbg_filter_covers(filters + i, filters + j)) {
+                tbg_filter_remove(filters, n--, j);
+                if (j < i) {
+                    i--;
+                }
+                j--;
+            }
+        }
+    }
+
+    while (n > max && n > 1) {
+        int best_i = 0, best_j = 1, best_bits = -1;
+        for (int i = 0; i < n; i++) {
+            for (int j = i + 1; j < n; j++) {
+                tbg_filter_t u = tbg_filter_union(filters + i, filters + j);
+                int bits = popcount(u.mask);
+                if (bits > best_bits) {
+                    best_bits = bits;
+                    best_i = i;
+                    best_j = j;
+                }
+            }
+        }
+        filters[best_i] = tbg_filter_union(filters + best_i, filters + best_j);
+        tbg_filter_remove(filters, n--, best_j);
+        // The wider filter may now cover others.
+        for (int j = 0; j < n; j++) {
+            if (j != best_i && tbg_filter_covers(filters + best_i, filters + j)) {
+                tbg_filter_remove(filters, n--, j);
+                if (j < best_i) {
+                    best_i--;
+                }
+                j--;
+            }
+        }
+    }
+    return n;
+}
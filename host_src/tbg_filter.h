@@ -0,0 +1,55 @@
+/*
+ *
+ * tbg_filter.h
+ *
+ * This file is part of Touchbridge
+ *
+ * Copyright 2015 James L Macfarlane
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef TBG_FILTER_H
+#define TBG_FILTER_H
+
+/*
+ * CAN acceptance filters in Touchbridge ID format. A message passes
+ * if (msg->id & mask) == (id & mask).
+ */
+
+#include <stdint.h>
+
+#include "tbg_protocol.h"
+
+typedef struct tbg_filter_s {
+    uint32_t id;
+    uint32_t mask;
+} tbg_filter_t;
+
+// Matches messages of any type addressed to node addr.
+#define TBG_FILTER_DST_ADDR(addr) ((tbg_filter_t){ \
+    .id = TBG_MSG_ID_BIT_EID | ((uint32_t)(addr) << 18), \
+    .mask = TBG_MSG_ID_BIT_EID | (0x3fL << 18) })
+
+// Matches all messages of a given type.
+#define TBG_FILTER_TYPE(type) ((tbg_filter_t){ \
+    .id = TBG_MSG_ID_BIT_EID | ((uint32_t)(type) << 27), \
+    .mask = TBG_MSG_ID_BIT_EID | (0x3L << 27) })
+
+// Matches messages of a given type sent by node addr.
+#define TBG_FILTER_TYPE_SRC_ADDR(type, addr) ((tbg_filter_t){ \
+    .id = TBG_MSG_ID_BIT_EID | ((uint32_t)(type) << 27) | ((uint32_t)(addr) << 6), \
+    .mask = TBG_MSG_ID_BIT_EID | (0x3L << 27) | (0x3fL << 6) })
+
+int tbg_filter_merge(tbg_filter_t *filters, int n, int max);
+
+#endif // TBG_FILTER_H
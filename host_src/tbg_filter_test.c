@@ -0,0 +1,127 @@
+/*
+ *
+ * tbg_filter_test.c
+ *
+ * This file is part of Touchbridge
+ *
+ * Copyright 2015 James L Macfarlane
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Checks tbg_filter_merge(): whatever it's given, what comes out must
+ * fit in the banks and still pass every ID that one of the filters it
+ * was given passed.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "tbg_filter.h"
+
+#define MAX_FILTERS     (80)
+#define IDS_PER_FILTER  (16)
+
+static uint32_t rand_state = 1;
+
+static uint32_t rand32(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    uint32_t hi = rand_state >> 16;
+    rand_state = rand_state * 1103515245 + 12345;
+    return hi << 16 | rand_state >> 16;
+}
+
+static int passes(tbg_filter_t *f, uint32_t id)
+{
+    return ((id ^ f->id) & f->mask) == 0;
+}
+
+/*
+ * Merge the n filters down to max and check the result, trying the
+ * filter ID's themselves and some with the don't-care bits filled in
+ * at random. Returns the number of failures.
+ */
+static int check(const char *name, tbg_filter_t *wanted, int n, int max)
+{
+    tbg_filter_t merged[MAX_FILTERS];
+    int fails = 0;
+
+    memcpy(merged, wanted, n * sizeof(tbg_filter_t));
+    int m = tbg_filter_merge(merged, n, max);
+    if (m > max || m < 1) {
+        printf("%s: merged %d filters into %d, limit %d\n", name, n, m, max);
+        fails++;
+    }
+    for (int i = 0; i < n; i++) {
+        for (int k = 0; k < IDS_PER_FILTER; k++) {
+            uint32_t id = wanted[i].id;
+            if (k) {
+                id = (id & wanted[i].mask) | (rand32() & ~wanted[i].mask);
+            }
+            int ok = 0;
+            for (int j = 0; j < m && !ok; j++) {
+                ok = passes(merged + j, id);
+            }
+            if (!ok) {
+                printf("%s: ID 0x%08X (filter %d) not passed\n", name, id, i);
+                fails++;
+            }
+        }
+    }
+    return fails;
+}
+
+int main(void)
+{
+    tbg_filter_t f[MAX_FILTERS];
+    int n, fails = 0;
+
+    // Fits as it is.
+    n = 0;
+    f[n++] = TBG_FILTER_DST_ADDR(62);
+    f[n++] = TBG_FILTER_TYPE(TBG_MSG_TYPE_IND);
+    fails += check("dst+ind", f, n, 14);
+
+    // Some covered by others.
+    n = 0;
+    f[n++] = TBG_FILTER_TYPE(TBG_MSG_TYPE_IND);
+    for (int addr = 0; addr < 20; addr++) {
+        f[n++] = TBG_FILTER_TYPE_SRC_ADDR(TBG_MSG_TYPE_IND, addr);
+    }
+    fails += check("covered", f, n, 1);
+
+    // One per node, more than there are banks.
+    n = 0;
+    f[n++] = TBG_FILTER_DST_ADDR(62);
+    for (int addr = 0; addr < 64; addr++) {
+        f[n++] = TBG_FILTER_TYPE_SRC_ADDR(TBG_MSG_TYPE_IND, addr);
+    }
+    fails += check("all nodes", f, n, 14);
+
+    // Random sets of random filters, down to a single bank.
+    for (int trial = 0; trial < 200; trial++) {
+        char name[32];
+        n = 1 + rand32() % MAX_FILTERS;
+        for (int i = 0; i < n; i++) {
+            f[i].mask = rand32() | TBG_MSG_ID_BIT_EID;
+            f[i].id = rand32() & f[i].mask;
+        }
+        snprintf(name, sizeof(name), "random %d", trial);
+        fails += check(name, f, n, 1 + rand32() % 14);
+    }
+
+    printf("tbg_filter_merge: %s\n", fails ? "FAILED" : "OK");
+    return fails != 0;
+}
@@ -19,65 +19,150 @@
  * limitations under the License.
  */
 
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "rpi_io.h"
 #include "tbg_rpi.h"
+#include "tbgrpi_spi.h"
 
-static inline void tbgrpi_bus_out(tbgrpi_t *tpi)
+/*
+ * Switch the data bus direction. Both the GPFSEL images and WRSEL
+ * follow the direction so none of this needs doing again until
+ * the direction changes.
+ */
+static inline void tbgrpi_bus_dir(tbgrpi_t *tpi, int dir)
 {
-    rpi_io_set_pins_mode(tpi->gpio, TBGRPI_PINS_DBUS, RPI_IO_MODE_OUT);
+    if (tpi->bus_dir == dir) {
+        return;
+    }
+    uint32_t *fsel;
+    if (dir == RPI_IO_MODE_OUT) {
+        fsel = tpi->fsel_out;
+        RPI_IO_SET_PIN(tpi->gpio, TBGRPI_PIN_WRSEL);
+    } else {
+        fsel = tpi->fsel_in;
+        RPI_IO_CLR_PIN(tpi->gpio, TBGRPI_PIN_WRSEL);
+    }
+    // Plain stores of the whole register, no read-modify-write.
+    for (int i = 0; i < TBGRPI_DBUS_FSEL_NUMOF; i++) {
+        RPI_IO_REG_INDEX(tpi->gpio->gpio + BCM_GPFSEL0, TBGRPI_DBUS_FSEL_FIRST + i) = fsel[i];
+    }
+    tpi->bus_dir = dir;
 }
 
-static inline void tbgrpi_bus_in(tbgrpi_t *tpi)
+/*
+ * Wait for ACK to reach level (zero or the ACK pin bit).
+ */
+static inline void tbgrpi_wait_ack(tbgrpi_t *tpi, uint32_t level)
 {
-    rpi_io_set_pins_mode(tpi->gpio, TBGRPI_PINS_DBUS, RPI_IO_MODE_IN);
+#ifdef TBGRPI_BUS_SIM
+    // No HAT on a simulated register block so play its part and
+    // answer straight away.
+    RPI_IO_READ(tpi->gpio) = (RPI_IO_READ(tpi->gpio) & ~(1 << TBGRPI_PIN_ACK)) | level;
+#endif
+    while ((RPI_IO_READ(tpi->gpio) & (1 << TBGRPI_PIN_ACK)) != level);
 }
 
 static inline void tbgrpi_bus_write(tbgrpi_t *tpi, uint8_t data)
 {
-    // Set bus direction for writing
-    tbgrpi_bus_out(tpi);
-    // Set WRSEL for writing
-    RPI_IO_SET_PIN(tpi->gpio, TBGRPI_PIN_WRSEL);
+    // Set bus direction (and WRSEL) for writing
+    tbgrpi_bus_dir(tpi, RPI_IO_MODE_OUT);
     // Put data on the bus
     RPI_IO_WRITE(tpi->gpio, (uint32_t)data << TBGRPI_PIN_D0, TBGRPI_PINS_DBUS);
     // Assert enable line
     RPI_IO_CLR_PIN(tpi->gpio, TBGRPI_PIN_EN);
     // Wait for ACK to go low (assert)
-    while (RPI_IO_READ(tpi->gpio) & (1 << TBGRPI_PIN_ACK));
+    tbgrpi_wait_ack(tpi, 0);
     // De-assert enable line
     RPI_IO_SET_PIN(tpi->gpio, TBGRPI_PIN_EN);
     // Wait for ACK to go high
-    while (!(RPI_IO_READ(tpi->gpio) & (1 << TBGRPI_PIN_ACK)));
+    tbgrpi_wait_ack(tpi, 1 << TBGRPI_PIN_ACK);
 }
 
 static inline uint8_t tbgrpi_bus_read(tbgrpi_t *tpi)
 {
     uint8_t data;
 
-    // Set bus direction for reading
-    tbgrpi_bus_in(tpi);
-    // Set WRSEL for writing
-    RPI_IO_CLR_PIN(tpi->gpio, TBGRPI_PIN_WRSEL);
+    // Set bus direction (and WRSEL) for reading
+    tbgrpi_bus_dir(tpi, RPI_IO_MODE_IN);
     // Assert enable line
     RPI_IO_CLR_PIN(tpi->gpio, TBGRPI_PIN_EN);
     // Wait for ACK to go low
-    while (RPI_IO_READ(tpi->gpio) & (1 << TBGRPI_PIN_ACK));
+    tbgrpi_wait_ack(tpi, 0);
     // Read the data
     data = (RPI_IO_READ(tpi->gpio) & TBGRPI_PINS_DBUS) >> TBGRPI_PIN_D0;
     // De-assert enable line
     RPI_IO_SET_PIN(tpi->gpio, TBGRPI_PIN_EN);
     // Wait for ACK to go high
-    while (!(RPI_IO_READ(tpi->gpio) & (1 << TBGRPI_PIN_ACK)));
+    tbgrpi_wait_ack(tpi, 1 << TBGRPI_PIN_ACK);
+
+    return data;
+}
+
+/*
+ * Bus cycles for the data phase of a burst. These use a two-phase
+ * handshake: ACK just changes to level once the HAT has the byte (or
+ * has put it on the bus), so there's no waiting for it to go back.
+ */
+static inline void tbgrpi_bus_write_2p(tbgrpi_t *tpi, uint8_t data, uint32_t level)
+{
+    tbgrpi_bus_dir(tpi, RPI_IO_MODE_OUT);
+    RPI_IO_WRITE(tpi->gpio, (uint32_t)data << TBGRPI_PIN_D0, TBGRPI_PINS_DBUS);
+    RPI_IO_CLR_PIN(tpi->gpio, TBGRPI_PIN_EN);
+    tbgrpi_wait_ack(tpi, level);
+    RPI_IO_SET_PIN(tpi->gpio, TBGRPI_PIN_EN);
+}
+
+static inline uint8_t tbgrpi_bus_read_2p(tbgrpi_t *tpi, uint32_t level)
+{
+    uint8_t data;
 
+    tbgrpi_bus_dir(tpi, RPI_IO_MODE_IN);
+    RPI_IO_CLR_PIN(tpi->gpio, TBGRPI_PIN_EN);
+    tbgrpi_wait_ack(tpi, level);
+    data = (RPI_IO_READ(tpi->gpio) & TBGRPI_PINS_DBUS) >> TBGRPI_PIN_D0;
+    RPI_IO_SET_PIN(tpi->gpio, TBGRPI_PIN_EN);
     return data;
 }
 
+/*
+ * Capture the GPFSEL registers holding the data bus with the bus set
+ * each way. Must be called after all the other pins in those registers
+ * are set up, as switching direction writes the whole registers back.
+ */
+static void tbgrpi_bus_dir_init(tbgrpi_t *tpi)
+{
+    for (int i = 0; i < TBGRPI_DBUS_FSEL_NUMOF; i++) {
+        int reg = TBGRPI_DBUS_FSEL_FIRST + i;
+        uint32_t in = RPI_IO_REG_INDEX(tpi->gpio->gpio + BCM_GPFSEL0, reg);
+        uint32_t out = in;
+        for (int pin = reg * 10; pin < reg * 10 + 10; pin++) {
+            if (TBGRPI_PINS_DBUS & (1L << pin)) {
+                int bit = (pin % 10) * 3;
+                in &= ~(7 << bit);
+                out &= ~(7 << bit);
+                in |= RPI_IO_MODE_IN << bit;
+                out |= RPI_IO_MODE_OUT << bit;
+            }
+        }
+        tpi->fsel_in[i] = in;
+        tpi->fsel_out[i] = out;
+    }
+    tpi->bus_dir = -1;
+}
+
 void tbgrpi_init_io(tbgrpi_t *tpi)
 {
+    if (tpi->spi) {
+        return;
+    }
+
     // Outputs
     rpi_io_set_pin_mode(tpi->gpio, TBGRPI_PIN_ADSEL, RPI_IO_MODE_OUT);
     rpi_io_set_pin_mode(tpi->gpio, TBGRPI_PIN_WRSEL, RPI_IO_MODE_OUT);
@@ -88,7 +173,8 @@ void tbgrpi_init_io(tbgrpi_t *tpi)
     rpi_io_set_pin_mode(tpi->gpio, TBGRPI_PIN_INT, RPI_IO_MODE_IN);
 
     // Data bus (bi-dir but we make it an input for now.)
-    tbgrpi_bus_in(tpi);
+    tbgrpi_bus_dir_init(tpi);
+    tbgrpi_bus_dir(tpi, RPI_IO_MODE_IN);
 
     // Default pin states
     RPI_IO_SET_PIN(tpi->gpio, TBGRPI_PIN_EN);   // De-assert enable line
@@ -100,23 +186,54 @@ tbgrpi_t *tbgrpi_open(void)
 {
     tbgrpi_t *tpi = malloc(sizeof(tbgrpi_t));
     tpi->gpio = rpi_io_open();
+    tpi->spi = NULL;
+    tpi->addr = -1;
+    tpi->conf = 0;
+    tpi->bus_dir = -1;
     return tpi;
 }
 
 void tbgrpi_close(tbgrpi_t *tpi)
 {
+    if (tpi->spi) {
+        tbgrpi_spi_close(tpi);
+        return;
+    }
     rpi_io_close(tpi->gpio);
     free(tpi);
 }
 
 void tbgrpi_write_config(tbgrpi_t *tpi, uint8_t data)
 {
-    RPI_IO_SET_PIN(tpi->gpio, TBGRPI_PIN_ADSEL);
-    tbgrpi_bus_write(tpi, data);
+    if (tpi->spi) {
+        tbgrpi_spi_exchange(tpi, data, NULL, 0, 0);
+    } else {
+        RPI_IO_SET_PIN(tpi->gpio, TBGRPI_PIN_ADSEL);
+        tbgrpi_bus_write(tpi, data);
+    }
+    // Remember what we wrote so we can re-select registers later
+    // without disturbing the interrupt enables.
+    tpi->addr = (data & TBGRPI_ADDR_BIT_MASK) >> TBGRPI_ADDR_BIT_SHIFT;
+    tpi->conf = data & (TBGRPI_CONF_TX_BUF_EMPTY_IE | TBGRPI_CONF_RX_DATA_AVAIL_IE);
+}
+
+/*
+ * Select register addr on the HAT, if it isn't already.
+ */
+static void tbgrpi_select(tbgrpi_t *tpi, int addr)
+{
+    if (tpi->addr != addr) {
+        tbgrpi_write_config(tpi, (addr << TBGRPI_ADDR_BIT_SHIFT) | tpi->conf);
+    }
 }
 
 void tbgrpi_write_data(tbgrpi_t *tpi, uint8_t *data, int size)
 {
+    if (tpi->spi) {
+        // One record per call.
+        tbgrpi_spi_exchange(tpi, (tpi->addr << TBGRPI_ADDR_BIT_SHIFT) | tpi->conf, data, 1, size);
+        return;
+    }
     RPI_IO_CLR_PIN(tpi->gpio, TBGRPI_PIN_ADSEL);
     for (int i = 0; i < size; i++) {
         tbgrpi_bus_write(tpi, data[i]);
@@ -125,12 +242,19 @@ void tbgrpi_write_data(tbgrpi_t *tpi, uint8_t *data, int size)
 
 uint8_t tbgrpi_read_status(tbgrpi_t *tpi)
 {
+    if (tpi->spi) {
+        return tbgrpi_spi_read_status(tpi);
+    }
     RPI_IO_SET_PIN(tpi->gpio, TBGRPI_PIN_ADSEL);
     return tbgrpi_bus_read(tpi);
 }
 
 void tbgrpi_read_data(tbgrpi_t *tpi, uint8_t *data, int size)
 {
+    if (tpi->spi) {
+        tbgrpi_spi_read_data(tpi, data, size);
+        return;
+    }
     RPI_IO_CLR_PIN(tpi->gpio, TBGRPI_PIN_ADSEL);
     for (int i = 0; i < size; i++) {
         data[i] = tbgrpi_bus_read(tpi);
@@ -140,6 +264,13 @@ void tbgrpi_read_data(tbgrpi_t *tpi, uint8_t *data, int size)
 void tbgrpi_send_msg(tbgrpi_t *tpi, tbg_msg_t *msg)
 {
     uint8_t *data = (void *)msg;
+    if (tpi->spi) {
+        // The frame carries the address so there's no need to select.
+        tpi->addr = TBGRPI_ADDR_CAN;
+        tbgrpi_spi_exchange(tpi, (tpi->addr << TBGRPI_ADDR_BIT_SHIFT) | tpi->conf, msg, 1, TBG_MSG_SIZE);
+        return;
+    }
+    tbgrpi_select(tpi, TBGRPI_ADDR_CAN);
     RPI_IO_CLR_PIN(tpi->gpio, TBGRPI_PIN_ADSEL);
     for (int i = 0; i < TBG_MSG_SIZE; i++) {
         tbgrpi_bus_write(tpi, data[i]);
@@ -149,9 +280,207 @@ void tbgrpi_send_msg(tbgrpi_t *tpi, tbg_msg_t *msg)
 void tbgrpi_recv_msg(tbgrpi_t *tpi, tbg_msg_t *msg)
 {
     uint8_t *data = (void *)msg;
+    if (tpi->spi) {
+        if (!tbgrpi_spi_recv(tpi, msg, NULL, 1)) {
+            memset(msg, 0, sizeof(*msg));
+        }
+        return;
+    }
+    tbgrpi_select(tpi, TBGRPI_ADDR_CAN);
     RPI_IO_CLR_PIN(tpi->gpio, TBGRPI_PIN_ADSEL);
     for (int i = 0; i < TBG_MSG_SIZE; i++) {
         data[i] = tbgrpi_bus_read(tpi);
     }
 }
 
+/*
+ * Data phase of a burst, len bytes long, of which the first size are
+ * to or from data. It's padded to an odd length so it always leaves
+ * ACK low, and the HAT raises it again when it's ready for the next
+ * cycle.
+ */
+static void tbgrpi_burst_data(tbgrpi_t *tpi, uint8_t *data, int len, int size, int wr)
+{
+    if (len == 0) {
+        return;
+    }
+    for (int i = 0; i < len; i++) {
+        uint32_t level = (i & 1) ? 1 << TBGRPI_PIN_ACK : 0;
+        if (wr) {
+            tbgrpi_bus_write_2p(tpi, (i < size) ? data[i] : 0, level);
+        } else {
+            uint8_t b = tbgrpi_bus_read_2p(tpi, level);
+            if (i < size) {
+                data[i] = b;
+            }
+        }
+    }
+    tbgrpi_wait_ack(tpi, 1 << TBGRPI_PIN_ACK);
+}
+
+/*
+ * Read up to TBGRPI_BURST_MSGS_MAX messages from the HAT's RX buffer
+ * in one go. msgs must have room for TBGRPI_BURST_MSGS_MAX messages.
+ * Returns the number of messages read, zero if the buffer was empty.
+ */
+int tbgrpi_recv_burst(tbgrpi_t *tpi, tbg_msg_t *msgs)
+{
+    uint8_t count;
+    int n;
+
+    if (tpi->spi) {
+        return tbgrpi_spi_recv(tpi, msgs, NULL, TBGRPI_BURST_MSGS_MAX);
+    }
+    tbgrpi_select(tpi, TBGRPI_ADDR_BURST);
+    RPI_IO_CLR_PIN(tpi->gpio, TBGRPI_PIN_ADSEL);
+    count = tbgrpi_bus_read(tpi);
+    n = (count > TBGRPI_BURST_MSGS_MAX) ? TBGRPI_BURST_MSGS_MAX : count;
+    tbgrpi_burst_data(tpi, (uint8_t *)msgs, TBGRPI_BURST_DATA_LEN(count), n * TBG_MSG_SIZE, 0);
+    return n;
+}
+
+/*
+ * Our CLOCK_MONOTONIC time in microseconds.
+ */
+uint64_t tbgrpi_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * As tbgrpi_recv_burst() but also fill in rx_us with the time each
+ * message arrived at the HAT, as CLOCK_MONOTONIC microseconds. Times
+ * are zero if unknown.
+ */
+int tbgrpi_recv_burst_ts(tbgrpi_t *tpi, tbg_msg_t *msgs, uint64_t *rx_us)
+{
+    uint8_t buf[TBGRPI_BURST_TS_DATA_MAX];
+    uint8_t count;
+    int n;
+
+    if (tpi->spi) {
+        return tbgrpi_spi_recv(tpi, msgs, rx_us, TBGRPI_BURST_MSGS_MAX);
+    }
+    tbgrpi_select(tpi, TBGRPI_ADDR_BURST_TS);
+    RPI_IO_CLR_PIN(tpi->gpio, TBGRPI_PIN_ADSEL);
+    count = tbgrpi_bus_read(tpi);
+    n = (count > TBGRPI_BURST_MSGS_MAX) ? TBGRPI_BURST_MSGS_MAX : count;
+    tbgrpi_burst_data(tpi, buf, TBGRPI_BURST_TS_DATA_LEN(count), TBGRPI_BURST_TS_DATA_LEN(n), 0);
+    uint64_t host_now = tbgrpi_now_us();
+
+    uint32_t hat_now, stamp;
+    uint8_t *rec = buf + TBGRPI_BURST_TS_NOW_SIZE;
+    memcpy(&hat_now, buf, sizeof(hat_now));
+    for (int i = 0; i < n; i++) {
+        memcpy(msgs + i, rec, TBG_MSG_SIZE);
+        memcpy(&stamp, rec + TBG_MSG_SIZE, sizeof(stamp));
+        rx_us[i] = TBGRPI_HAT_TO_HOST_US(host_now, hat_now, stamp);
+        rec += TBGRPI_BURST_TS_REC_SIZE;
+    }
+    return n;
+}
+
+/*
+ * Send n messages (at most TBGRPI_BURST_MSGS_MAX) to the HAT in one go.
+ */
+void tbgrpi_send_burst(tbgrpi_t *tpi, tbg_msg_t *msgs, int n)
+{
+    if (n > TBGRPI_BURST_MSGS_MAX) {
+        n = TBGRPI_BURST_MSGS_MAX;
+    }
+    if (tpi->spi) {
+        tpi->addr = TBGRPI_ADDR_CAN;
+        tbgrpi_spi_exchange(tpi, (tpi->addr << TBGRPI_ADDR_BIT_SHIFT) | tpi->conf, msgs, n, TBG_MSG_SIZE);
+        return;
+    }
+    tbgrpi_select(tpi, TBGRPI_ADDR_BURST);
+    RPI_IO_CLR_PIN(tpi->gpio, TBGRPI_PIN_ADSEL);
+    tbgrpi_bus_write(tpi, n);
+    tbgrpi_burst_data(tpi, (uint8_t *)msgs, TBGRPI_BURST_DATA_LEN(n), n * TBG_MSG_SIZE, 1);
+}
+
+void tbgrpi_read_stats(tbgrpi_t *tpi, tbgrpi_stats_t *stats)
+{
+    uint8_t buf[TBGRPI_STATS_SIZE];
+
+    tbgrpi_select(tpi, TBGRPI_ADDR_STATS);
+    tbgrpi_read_data(tpi, buf, sizeof(buf));
+    memcpy(&stats->rx_buf_size, buf + TBGRPI_STATS_RX_BUF_SIZE, sizeof(stats->rx_buf_size));
+    memcpy(&stats->rx_hwm, buf + TBGRPI_STATS_RX_HWM, sizeof(stats->rx_hwm));
+    memcpy(&stats->rx_overflows, buf + TBGRPI_STATS_RX_OVERFLOWS, sizeof(stats->rx_overflows));
+    memcpy(&stats->tx_drops, buf + TBGRPI_STATS_TX_DROPS, sizeof(stats->tx_drops));
+}
+
+/*
+ * Reset the HAT's high-water mark, overflow and TX drop counts, and its RX
+ * overflow status bit.
+ */
+void tbgrpi_reset_stats(tbgrpi_t *tpi)
+{
+    uint8_t buf[TBGRPI_STATS_SIZE];
+
+    memset(buf, 0, sizeof(buf));
+    tbgrpi_write_config(tpi, (TBGRPI_ADDR_STATS << TBGRPI_ADDR_BIT_SHIFT) | tpi->conf | TBGRPI_CONF_RX_OVERFLOW_RESET);
+    tbgrpi_write_data(tpi, buf, sizeof(buf));
+}
+
+/*
+ * Set up CAN filter bank on the HAT to pass messages whose ID matches
+ * id in the bits set in mask, or turn it off if active is zero. ID's
+ * are in Touchbridge format and should include TBG_MSG_ID_BIT_EID.
+ */
+void tbgrpi_set_filter(tbgrpi_t *tpi, int bank, uint32_t id, uint32_t mask, int active)
+{
+    uint8_t buf[TBGRPI_FILTER_SIZE];
+
+    memset(buf, 0, sizeof(buf));
+    buf[TBGRPI_FILTER_BANK] = bank;
+    buf[TBGRPI_FILTER_FLAGS] = active ? TBGRPI_FILTER_FLAG_ACTIVE : 0;
+    memcpy(buf + TBGRPI_FILTER_ID, &id, sizeof(id));
+    memcpy(buf + TBGRPI_FILTER_MASK, &mask, sizeof(mask));
+    tbgrpi_select(tpi, TBGRPI_ADDR_FILTER);
+    tbgrpi_write_data(tpi, buf, sizeof(buf));
+}
+
+/*
+ * Get the HAT's CAN bit rate in kbit/s.
+ */
+int tbgrpi_get_bitrate(tbgrpi_t *tpi)
+{
+    uint32_t cfg1;
+
+    tbgrpi_select(tpi, TBGRPI_ADDR_CONFIG_REG);
+    tbgrpi_read_data(tpi, (uint8_t *)&cfg1, sizeof(cfg1));
+    return (cfg1 & TBGRPI_CFG1_BITRATE_MASK) >> TBGRPI_CFG1_BITRATE_SHIFT;
+}
+
+/*
+ * Set the HAT's CAN bit rate to kbps kbit/s, which it saves for next
+ * time. This doesn't change the nodes', see TBG_CONF_GLOBAL_CAN_BITRATE.
+ */
+void tbgrpi_set_bitrate(tbgrpi_t *tpi, int kbps)
+{
+    uint32_t x[2];
+
+    x[0] = (uint32_t)kbps << TBGRPI_CFG1_BITRATE_SHIFT;
+    x[1] = TBGRPI_CFG1_BITRATE_MASK;
+    tbgrpi_select(tpi, TBGRPI_ADDR_CONFIG_REG);
+    tbgrpi_write_data(tpi, (uint8_t *)x, sizeof(x));
+}
+
+/*
+ * Make the HAT the bus time sync master, sending from Touchbridge
+ * address src_addr, or stop it.
+ */
+void tbgrpi_set_time_sync(tbgrpi_t *tpi, int enable, int src_addr)
+{
+    uint32_t x[2];
+
+    x[0] = enable ? TBGRPI_CFG1_TIME_SYNC : 0;
+    x[0] |= ((uint32_t)src_addr << TBGRPI_CFG1_SRC_ADDR_SHIFT) & TBGRPI_CFG1_SRC_ADDR_MASK;
+    x[1] = TBGRPI_CFG1_TIME_SYNC | TBGRPI_CFG1_SRC_ADDR_MASK;
+    tbgrpi_select(tpi, TBGRPI_ADDR_CONFIG_REG);
+    tbgrpi_write_data(tpi, (uint8_t *)x, sizeof(x));
+}
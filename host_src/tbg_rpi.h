@@ -39,6 +39,11 @@
 
 #define TBGRPI_PINS_DBUS        ((uint32_t)0xff << TBGRPI_PIN_D0)
 
+// The GPFSEL registers (10 pins each) the data bus pins live in.
+#define TBGRPI_DBUS_FSEL_FIRST  (TBGRPI_PIN_D0 / 10)
+#define TBGRPI_DBUS_FSEL_LAST   ((TBGRPI_PIN_D0 + 7) / 10)
+#define TBGRPI_DBUS_FSEL_NUMOF  (TBGRPI_DBUS_FSEL_LAST - TBGRPI_DBUS_FSEL_FIRST + 1)
+
 // Data read/write select line
 #define TBGRPI_BUS_WRSEL_RD     (0)
 #define TBGRPI_BUS_WRSEL_WR     (1)
@@ -52,7 +57,7 @@
 // Bit 3 Reserved
 // Bit 2 RX Buffer Overflow
 // Bit 1 RX Data Available
-// Bit 0 TX Buffer Empty
+// Bit 0 TX Buffer Empty (room for a full burst)
 //
 // When writing, if ADSEL bit is high,  addr/conf reg is:
 // Bits [7:4] Address
@@ -77,13 +82,86 @@
 #define TBGRPI_ADDR_FILT1       (1)
 #define TBGRPI_ADDR_FILT2       (2)
 #define TBGRPI_ADDR_CONFIG_REG  (3)
-#define TBGRPI_REG_NUMOF                (4) 
+#define TBGRPI_ADDR_BURST       (4)
+#define TBGRPI_ADDR_STATS       (5)
+#define TBGRPI_ADDR_FILTER      (6)
+#define TBGRPI_ADDR_BURST_TS    (7)
+#define TBGRPI_REG_NUMOF                (8)
+
+// Max number of messages in one access to the burst register, and the
+// length of its data phase, see tbgrpi_protocol.h in the firmware.
+#define TBGRPI_BURST_MSGS_MAX   (8)
+#define TBGRPI_BURST_DATA_LEN(n)        ((n) ? ((n) * TBG_MSG_SIZE) | 1 : 0)
+
+// Timestamped burst register layout, see tbgrpi_protocol.h.
+#define TBGRPI_BURST_TS_NOW_SIZE        (4)
+#define TBGRPI_BURST_TS_REC_SIZE        (TBG_MSG_SIZE + 4)
+#define TBGRPI_BURST_TS_DATA_LEN(n)     ((n) ? (TBGRPI_BURST_TS_NOW_SIZE + (n) * TBGRPI_BURST_TS_REC_SIZE) | 1 : 0)
+#define TBGRPI_BURST_TS_DATA_MAX        (TBGRPI_BURST_TS_DATA_LEN(TBGRPI_BURST_MSGS_MAX))
+
+// Convert a HAT timestamp to our CLOCK_MONOTONIC microseconds, given the
+// HAT's time hat_now at host time host_now_us. The HAT's counter wraps
+// so only the (32-bit) difference is meaningful.
+#define TBGRPI_HAT_TO_HOST_US(host_now_us, hat_now, stamp) \
+    ((host_now_us) - (uint32_t)((uint32_t)(hat_now) - (uint32_t)(stamp)))
+
+// Config register fields, see tbgrpi_protocol.h.
+#define TBGRPI_CFG1_TIME_SYNC           (0x00000004)
+#define TBGRPI_CFG1_SRC_ADDR_MASK       (0x00003f00)
+#define TBGRPI_CFG1_SRC_ADDR_SHIFT      (8)
+#define TBGRPI_CFG1_BITRATE_MASK        (0xffff0000)
+#define TBGRPI_CFG1_BITRATE_SHIFT       (16)
+
+// Stats register, see tbgrpi_protocol.h in the firmware.
+#define TBGRPI_STATS_RX_BUF_SIZE        (0)
+#define TBGRPI_STATS_RX_HWM             (2)
+#define TBGRPI_STATS_RX_OVERFLOWS       (4)
+#define TBGRPI_STATS_TX_DROPS           (8)
+#define TBGRPI_STATS_SIZE               (12)
+
+// Filter register, see tbgrpi_protocol.h in the firmware.
+#define TBGRPI_FILTER_BANKS             (14)
+#define TBGRPI_FILTER_BANK              (0)
+#define TBGRPI_FILTER_FLAGS             (1)
+#define TBGRPI_FILTER_ID                (4)
+#define TBGRPI_FILTER_MASK              (8)
+#define TBGRPI_FILTER_SIZE              (12)
+
+#define TBGRPI_FILTER_FLAG_ACTIVE       (0x01)
+
+typedef struct tbgrpi_stats_s {
+    uint16_t rx_buf_size;       // Messages the HAT can buffer
+    uint16_t rx_hwm;            // Most it has buffered since reset
+    uint32_t rx_overflows;      // Messages lost since reset
+    uint32_t tx_drops;          // Messages for the bus lost since reset
+} tbgrpi_stats_t;
+
+// SPI transport frame layout, see tbgrpi_protocol.h in the firmware.
+#define TBGRPI_SPI_ADDR                 (0)
+#define TBGRPI_SPI_COUNT                (1)
+#define TBGRPI_SPI_HDR_SIZE             (2)
+#define TBGRPI_SPI_MSGS_MAX             (8)
+#define TBGRPI_SPI_PAYLOAD_SIZE         (TBGRPI_BURST_TS_NOW_SIZE + TBGRPI_SPI_MSGS_MAX * TBGRPI_BURST_TS_REC_SIZE)
+#define TBGRPI_SPI_FRAME_SIZE           (TBGRPI_SPI_HDR_SIZE + TBGRPI_SPI_PAYLOAD_SIZE)
+#define TBGRPI_SPI_GAP_US               (50)
+
+#define TBGRPI_SPI_SPEED_HZ_DEFAULT     (8000000)
 
 typedef struct tbgrpi_s {
     struct rpi_io_s *gpio;
+    struct tbgrpi_spi_s *spi;   // SPI transport, NULL if using parallel bus
+    int addr;           // Currently selected register address, -1 if unknown
+    uint8_t conf;       // Interrupt enables last written to addr/conf reg
+    int bus_dir;        // Data bus direction, RPI_IO_MODE_IN/OUT, -1 if unknown
+    // GPFSEL register images with the data bus set to input and output,
+    // captured by tbgrpi_init_io().
+    uint32_t fsel_in[TBGRPI_DBUS_FSEL_NUMOF];
+    uint32_t fsel_out[TBGRPI_DBUS_FSEL_NUMOF];
 } tbgrpi_t;
 
 tbgrpi_t *tbgrpi_open(void);
+tbgrpi_t *tbgrpi_open_spi(const char *dev, uint32_t speed_hz);
+tbgrpi_t *tbgrpi_open_spi_sim(void);
 void tbgrpi_close(tbgrpi_t *tpi);
 void tbgrpi_init_io(tbgrpi_t *tpi);
 void tbgrpi_write_config(tbgrpi_t *tpi, uint8_t data);
@@ -92,5 +170,15 @@ uint8_t tbgrpi_read_status(tbgrpi_t *tpi);
 void tbgrpi_read_data(tbgrpi_t *tpi, uint8_t *data, int size);
 void tbgrpi_send_msg(tbgrpi_t *tpi, tbg_msg_t *msg);
 void tbgrpi_recv_msg(tbgrpi_t *tpi, tbg_msg_t *msg);
+int tbgrpi_recv_burst(tbgrpi_t *tpi, tbg_msg_t *msgs);
+int tbgrpi_recv_burst_ts(tbgrpi_t *tpi, tbg_msg_t *msgs, uint64_t *rx_us);
+uint64_t tbgrpi_now_us(void);
+void tbgrpi_send_burst(tbgrpi_t *tpi, tbg_msg_t *msgs, int n);
+void tbgrpi_read_stats(tbgrpi_t *tpi, tbgrpi_stats_t *stats);
+void tbgrpi_reset_stats(tbgrpi_t *tpi);
+void tbgrpi_set_filter(tbgrpi_t *tpi, int bank, uint32_t id, uint32_t mask, int active);
+int tbgrpi_get_bitrate(tbgrpi_t *tpi);
+void tbgrpi_set_bitrate(tbgrpi_t *tpi, int kbps);
+void tbgrpi_set_time_sync(tbgrpi_t *tpi, int enable, int src_addr);
 
 #endif // TBG_RPI_H
@@ -38,6 +38,7 @@
 #include "rpi_io.h"
 #include "tbg_rpi.h"
 #include "tbg_util.h"
+#include "tbg_filter.h"
 
 int debug_level = 0;
 
@@ -48,10 +49,21 @@ tbgrpi_t *tpi;
 GHashTable *clients;
 int peer_count;
 
+// Set if we're programming the HAT's CAN filters.
+int hw_filter;
+
+// What's in the HAT's filter banks, so we only write the ones that change.
+tbg_filter_t hat_filters[TBGRPI_FILTER_BANKS];
+int hat_filters_active[TBGRPI_FILTER_BANKS];
+int hat_filters_known;
+// Set when a client leaves, so its nodes' IND's can be dropped.
+int filters_stale;
+
 typedef struct ztbg_client_s {
     unsigned char *zmq_id;
     int zmq_id_len;
     uint16_t tbg_addr;
+    uint64_t ind_nodes;     // Nodes the client has sent requests to
 } ztbg_client_t;
 
 void dumpbuf(unsigned char *buf, int size)
@@ -98,6 +110,7 @@ void ztbg_send_all(void *zsocket, GHashTable *clients, char *payload)
                     printf("Client %s left.\n", (char *)key);
                 }
                 g_hash_table_iter_remove(&iter);
+                filters_stale = 1;
             } else {
                 printf("zmq_send: %s\n", zmq_strerror(errno));
             }
@@ -113,22 +126,144 @@ void ztbg_send_all(void *zsocket, GHashTable *clients, char *payload)
     }
 }
 
+/*
+ * Program the HAT's CAN filters so that it only passes us what our
+ * clients can want: anything addressed to us (responses, and IND's
+ * from triggers and subscriptions) and the broadcast IND's of the nodes
+ * the clients have sent requests to. A client that wants a node's
+ * broadcasts, such as input events, must have addressed it first, as
+ * din_cmd does with its config writes. The time sync FOLLOW_UP's come
+ * from the HAT itself so skip the filters. If there are more filters
+ * than the HAT has banks, some get merged, letting a bit more through.
+ */
+void update_filters(void)
+{
+    tbg_filter_t filters[1 + 64];
+    uint64_t ind_nodes = 0;
+    GHashTableIter iter;
+    gpointer key, value;
+    int n = 0;
+
+    g_hash_table_iter_init(&iter, clients);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        ztbg_client_t *cli = value;
+        ind_nodes |= cli->ind_nodes;
+    }
+
+    filters[n++] = TBG_FILTER_DST_ADDR(src_addr);
+    for (int addr = 0; addr < 64; addr++) {
+        if (ind_nodes & (1ULL << addr)) {
+            filters[n++] = TBG_FILTER_TYPE_SRC_ADDR(TBG_MSG_TYPE_IND, addr);
+        }
+    }
+    n = tbg_filter_merge(filters, n, TBGRPI_FILTER_BANKS);
+    filters_stale = 0;
+
+    // New filters first, then turn off any left over, so we don't
+    // drop anything we want while we're at it. Banks already set up
+    // that way are left alone.
+    for (int i = 0; i < TBGRPI_FILTER_BANKS; i++) {
+        int active = i < n;
+        tbg_filter_t f = active ? filters[i] : (tbg_filter_t){ 0, 0 };
+        if (hat_filters_known && hat_filters_active[i] == active &&
+                hat_filters[i].id == f.id && hat_filters[i].mask == f.mask) {
+            continue;
+        }
+        tbgrpi_set_filter(tpi, i, f.id, f.mask, active);
+        hat_filters[i] = f;
+        hat_filters_active[i] = active;
+        if (debug_level >= 2 && active) {
+            printf("HAT filter %d: id 0x%08X mask 0x%08X\n", i, f.id, f.mask);
+        }
+    }
+    hat_filters_known = 1;
+}
+
+int can_bitrate_ok(int kbps)
+{
+    static const uint16_t bitrates[] = TBG_CAN_BITRATES;
+
+    for (int i = 0; i < sizeof(bitrates) / sizeof(bitrates[0]); i++) {
+        if (bitrates[i] == kbps) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Move the whole bus to a new CAN bit rate: tell all the nodes, at the
+ * old rate, then change the HAT. Nodes which miss it (or are off) will
+ * find the new rate by auto-baud when they start up.
+ */
+void set_bus_bitrate(int kbps)
+{
+    tbg_msg_t req;
+    int old = tbgrpi_get_bitrate(tpi);
+
+    if (old == kbps) {
+        return;
+    }
+    if (debug_level >= 1) {
+        printf("Changing CAN bit rate from %d to %d kbit/s\n", old, kbps);
+    }
+
+    memset(&req, 0, sizeof(req));
+    TBG_MSG_SET_EID(&req, 1);
+    TBG_MSG_SET_TYPE(&req, TBG_MSG_TYPE_REQ);
+    TBG_MSG_SET_SRC_ADDR(&req, src_addr);
+    TBG_MSG_SET_DST_ADDR(&req, TBG_ADDR_BROADCAST);
+    TBG_MSG_SET_DST_PORT(&req, TBG_PORT_CONFIG);
+    req.data[TBG_CONF_REQ_DATA_CMD] = TBG_CONF_BIT_WRITE | TBG_CONF_GLOBAL_CAN_BITRATE;
+    req.data[TBG_CONF_CAN_BITRATE_DATA] = kbps & 0xff;
+    req.data[TBG_CONF_CAN_BITRATE_DATA + 1] = kbps >> 8;
+    req.len = TBG_CONF_CAN_BITRATE_REQ_LEN;
+    while (!(tbgrpi_read_status(tpi) & TBGRPI_STAT_TX_BUF_EMPTY));
+    tbgrpi_send_msg(tpi, &req);
+
+    // Give the nodes time to respond before we leave them behind.
+    // (They save the rate to flash later, in turn.)
+    g_usleep(100000);
+    tbgrpi_set_bitrate(tpi, kbps);
+}
+
 int do_tbg_msg_recv(void *zsocket)
 {
-    tbg_msg_t resp;
-    char resp_str[TBG_MSG_SIZE*2+1];
+    tbg_msg_t resp[TBGRPI_BURST_MSGS_MAX];
+    uint64_t rx_us[TBGRPI_BURST_MSGS_MAX];
+    char resp_str[TBG_HEX_MSG_TIME_SIZE];
+    int n;
 
     int stat = tbgrpi_read_status(tpi);
+    if (stat & TBGRPI_STAT_RX_OVERFLOW) {
+        tbgrpi_stats_t stats;
+        tbgrpi_read_stats(tpi, &stats);
+        WARNING("HAT RX overflow: %u messages lost, buffer high-water mark %u of %u, %u TX drops",
+            stats.rx_overflows, stats.rx_hwm, stats.rx_buf_size, stats.tx_drops);
+        tbgrpi_reset_stats(tpi);
+    }
     while (stat & TBGRPI_STAT_RX_DATA_AVAIL) {
-        tbgrpi_recv_msg(tpi, &resp);
-        if (debug_level >= 2) {
-            printf("TBG rx: ");
-            tbg_msg_dump(&resp);
+        // Empty the HAT's buffer a burst at a time. We still need
+        // the status read afterwards as that's what de-asserts /INT.
+        while ((n = tbgrpi_recv_burst_ts(tpi, resp, rx_us)) > 0) {
+            for (int i = 0; i < n; i++) {
+                if (debug_level >= 2) {
+                    printf("TBG rx: ");
+                    tbg_msg_dump(&resp[i]);
+                }
+                int len = tbg_msg_to_hex(&resp[i], resp_str) - 1;
+                if (rx_us[i]) {
+                    snprintf(resp_str + len, sizeof(resp_str) - len, "%c%llu",
+                        TBG_MSG_TIME_SEP, (unsigned long long)rx_us[i]);
+                }
+                ztbg_send_all(zsocket, clients, resp_str);
+            }
         }
-        tbg_msg_to_hex(&resp, resp_str);
-        ztbg_send_all(zsocket, clients, resp_str);
         stat = tbgrpi_read_status(tpi);
     }
+    if (hw_filter && filters_stale) {
+        update_filters();
+    }
     return 0;
 }
 
@@ -159,8 +294,9 @@ int do_zmq_msg_recv(void *zsocket)
     // Check if client is already in our list.
     // If not, create a new entry.
     // TODO: use this to generate sender's port address.
-    if (!g_hash_table_contains(clients, client_str)) {
-        ztbg_client_t *client = g_new(ztbg_client_t, 1);
+    ztbg_client_t *client = g_hash_table_lookup(clients, client_str);
+    if (!client) {
+        client = g_new0(ztbg_client_t, 1);
         client->zmq_id_len = zframe_size(peer);
         client->zmq_id = g_memdup(zframe_data(peer), client->zmq_id_len);
         g_hash_table_insert(clients, client_str, client);
@@ -176,6 +312,16 @@ int do_zmq_msg_recv(void *zsocket)
     tbg_msg_from_hex(&req, payload_str);
     free(payload_str);
 
+    // Pass on the IND's of any node the client talks to.
+    int dst_addr = TBG_MSG_GET_DST_ADDR(&req);
+    if (dst_addr != TBG_ADDR_BROADCAST && !(client->ind_nodes & (1ULL << dst_addr))) {
+        client->ind_nodes |= 1ULL << dst_addr;
+        filters_stale = 1;
+    }
+    if (hw_filter && filters_stale) {
+        update_filters();
+    }
+
     TBG_MSG_SET_SRC_PORT(&req, src_port++);
     TBG_MSG_SET_SRC_ADDR(&req, src_addr);
 
@@ -226,11 +372,23 @@ unsigned int do_zmq_recv_events(void *zsocket)
 char *progname;
 
 char *server_addr = "tcp://*:5555";
+char *spi_dev = NULL;
+int spi_speed = TBGRPI_SPI_SPEED_HZ_DEFAULT;
+gboolean spi_sim = FALSE;
+gboolean no_filter = FALSE;
+gboolean no_time_sync = FALSE;
+int can_bitrate = 0;
 
 static GOptionEntry cmd_line_options[] = {
     { "server",      's', 0, G_OPTION_ARG_STRING, &server_addr, "Set server address to S (e.g. tcp://*:5555)", "S" },
     { "tbg-address", 'a', 0, G_OPTION_ARG_INT,    &src_addr, "Set server's Touchbridge address to A, (range 0-63)", "A" },
     { "debug-level", 'd', 0, G_OPTION_ARG_INT,    &debug_level, "Set debug level to d", "d" },
+    { "spi",         0,   0, G_OPTION_ARG_STRING, &spi_dev, "Talk to the HAT over SPI device D (e.g. /dev/spidev0.0)", "D" },
+    { "spi-speed",   0,   0, G_OPTION_ARG_INT,    &spi_speed, "Set SPI clock to F Hz", "F" },
+    { "spi-sim",     0,   0, G_OPTION_ARG_NONE,   &spi_sim, "Use a simulated SPI HAT which loops messages back", NULL },
+    { "no-filter",   0,   0, G_OPTION_ARG_NONE,   &no_filter, "Pass all CAN traffic to clients, not just what they've asked for", NULL },
+    { "no-time-sync", 0,  0, G_OPTION_ARG_NONE,   &no_time_sync, "Don't have the HAT send time syncs to the nodes", NULL },
+    { "can-bitrate", 'b', 0, G_OPTION_ARG_INT,    &can_bitrate, "Change the CAN bus (HAT and all nodes) to K kbit/s: 125, 250, 500 or 1000", "K" },
     { NULL }
 };
 
@@ -254,7 +412,17 @@ int main(int argc, char **argv)
         src_addr = 63;
     }
 
-    tpi = tbgrpi_open();
+    if (can_bitrate && !can_bitrate_ok(can_bitrate)) {
+        ERROR("unsupported CAN bit rate: %d kbit/s\n", can_bitrate);
+    }
+
+    if (spi_sim) {
+        tpi = tbgrpi_open_spi_sim();
+    } else if (spi_dev) {
+        tpi = tbgrpi_open_spi(spi_dev, spi_speed);
+    } else {
+        tpi = tbgrpi_open();
+    }
 
     tbgrpi_init_io(tpi);
 
@@ -269,10 +437,27 @@ int main(int argc, char **argv)
     // Enable ints
     tbgrpi_write_config(tpi, TBGRPI_CONF_RX_DATA_AVAIL_IE | TBGRPI_CONF_RX_OVERFLOW_RESET );
 
+    if (can_bitrate) {
+        set_bus_bitrate(can_bitrate);
+    }
+
+    tbgrpi_set_time_sync(tpi, !no_time_sync, src_addr);
+
     clients = g_hash_table_new(g_str_hash, g_str_equal);
 
-    int intfd = rpi_io_interrupt_open(TBGRPI_PIN_INT, RPI_IO_EDGE_FALLING);
-    rpi_io_interrupt_flush(intfd);
+    // The loopback simulator sends back what we send, so has no use
+    // for filters.
+    hw_filter = !no_filter && !spi_sim;
+    if (hw_filter) {
+        update_filters();
+    }
+
+    // The simulator has no /INT line. poll() ignores negative fds.
+    int intfd = -1;
+    if (!spi_sim) {
+        intfd = rpi_io_interrupt_open(TBGRPI_PIN_INT, RPI_IO_EDGE_FALLING);
+        rpi_io_interrupt_flush(intfd);
+    }
 
     //  Socket to talk to clients
     void *context = zmq_ctx_new ();
@@ -303,6 +488,9 @@ int main(int argc, char **argv)
         SYSERROR_IF(ret < 0, "poll");
         if (items[0].revents & POLLIN) {
             do_zmq_recv_events(zsocket);
+            if (spi_sim) {
+                do_tbg_msg_recv(zsocket);
+            }
         } else if (items[1].revents & POLLPRI) {
             rpi_io_interrupt_clear(intfd);
             do_tbg_msg_recv(zsocket);
@@ -21,6 +21,8 @@
 
 #include <stdio.h>
 #include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "tbg_util.h"
 
@@ -90,4 +92,12 @@ int tbg_msg_to_hex(tbg_msg_t *msg, char *hex)
     return j;
 }
 
-
+/*
+ * Get the arrival time from a message from the server, or zero if it
+ * hasn't got one.
+ */
+uint64_t tbg_msg_time_from_hex(char *hex)
+{
+    char *sep = strchr(hex, TBG_MSG_TIME_SEP);
+    return sep ? strtoull(sep + 1, NULL, 10) : 0;
+}
@@ -21,10 +21,22 @@
 #ifndef TBG_UTIL_H
 #define TBG_UTIL_H
 
+#include <stdint.h>
+
 #include "tbg_protocol.h"
- 
+
+/*
+ * Messages from the server to clients are the message in hex,
+ * optionally followed by TBG_MSG_TIME_SEP and the time it arrived at
+ * the HAT, in decimal CLOCK_MONOTONIC microseconds on the server's
+ * host. Clients that don't want the time can ignore it.
+ */
+#define TBG_MSG_TIME_SEP        '@'
+#define TBG_HEX_MSG_TIME_SIZE   (TBG_HEX_MSG_SIZE + 21)
+
 void tbg_msg_dump(tbg_msg_t *msg);
 int tbg_msg_from_hex(tbg_msg_t *msg, char *hex);
 int tbg_msg_to_hex(tbg_msg_t *msg, char *hex);
+uint64_t tbg_msg_time_from_hex(char *hex);
 
 #endif // TBG_UTIL_H
@@ -0,0 +1,132 @@
+/*
+ *
+ * tbgrpi_bench.c
+ *
+ * This file is part of Touchbridge
+ *
+ * Copyright 2015 James L Macfarlane
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Benchmark for the Pi side of the HAT bus cycle.
+ *
+ * Runs the bus driver (tbg_rpi.c built with TBGRPI_BUS_SIM) against a
+ * block of ordinary memory standing in for the GPIO registers, so it
+ * measures the cost of the register accesses the driver makes rather
+ * than the HAT's response time. Needs no hardware.
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rpi_io.h"
+#include "tbg_rpi.h"
+
+#define SIM_BLOCK_SIZE  (4*1024)
+
+int debug_level = 0;
+char *progname;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, double t0, double t1, long bytes)
+{
+    printf("%-28s %8.1f ns/byte\n", name, (t1 - t0) / bytes);
+}
+
+int main(int argc, char **argv)
+{
+    long n = 1000000;
+    progname = argv[0];
+
+    if (argc > 1) {
+        n = atol(argv[1]);
+    }
+    if (n < TBG_MSG_SIZE) {
+        n = TBG_MSG_SIZE;
+    }
+
+    rpi_io_t io = { .gpio = calloc(1, SIM_BLOCK_SIZE) };
+    tbgrpi_t tpi = { .gpio = &io, .addr = -1, .conf = 0, .bus_dir = -1 };
+    tbgrpi_init_io(&tpi);
+
+    // Keep the HAT's idea of the selected register fixed so only
+    // data cycles get timed.
+    tbgrpi_write_config(&tpi, TBGRPI_ADDR_CAN << TBGRPI_ADDR_BIT_SHIFT);
+
+    uint8_t *buf = malloc(n);
+    memset(buf, 0x5a, n);
+    long msgs = n / TBG_MSG_SIZE;
+    double t0, t1;
+
+    t0 = now_ns();
+    tbgrpi_write_data(&tpi, buf, n);
+    t1 = now_ns();
+    report("write", t0, t1, n);
+
+    t0 = now_ns();
+    tbgrpi_read_data(&tpi, buf, n);
+    t1 = now_ns();
+    report("read", t0, t1, n);
+
+    // Alternate whole messages each way, which is what the server
+    // does under load, so the bus direction changes every 13 bytes.
+    tbg_msg_t msg;
+    memset(&msg, 0, sizeof(msg));
+    t0 = now_ns();
+    for (long i = 0; i < msgs; i += 2) {
+        tbgrpi_send_msg(&tpi, &msg);
+        tbgrpi_recv_msg(&tpi, &msg);
+    }
+    t1 = now_ns();
+    report("send/recv msg", t0, t1, msgs * TBG_MSG_SIZE);
+
+    // The same through the burst register. Leave a full burst's count
+    // on the simulated data bus, or reads would find the HAT empty and
+    // skip the data phase. Only count the messages that were moved.
+    tbg_msg_t burst[TBGRPI_BURST_MSGS_MAX];
+    memset(burst, 0, sizeof(burst));
+    RPI_IO_READ(tpi.gpio) = (uint32_t)TBGRPI_BURST_MSGS_MAX << TBGRPI_PIN_D0;
+    long bursts = msgs / (2 * TBGRPI_BURST_MSGS_MAX) + 1;
+    long moved = 0;
+    t0 = now_ns();
+    for (long i = 0; i < bursts; i++) {
+        tbgrpi_send_burst(&tpi, burst, TBGRPI_BURST_MSGS_MAX);
+        moved += TBGRPI_BURST_MSGS_MAX;
+        moved += tbgrpi_recv_burst(&tpi, burst);
+    }
+    t1 = now_ns();
+    report("send/recv burst", t0, t1, moved * TBG_MSG_SIZE);
+
+    // For comparison, what switching direction used to cost per byte.
+    t0 = now_ns();
+    for (long i = 0; i < n; i++) {
+        rpi_io_set_pins_mode(&io, TBGRPI_PINS_DBUS, (i & 1) ? RPI_IO_MODE_IN : RPI_IO_MODE_OUT);
+    }
+    t1 = now_ns();
+    report("rpi_io_set_pins_mode only", t0, t1, n);
+
+    free(buf);
+    free(io.gpio);
+    return 0;
+}
@@ -0,0 +1,268 @@
+/*
+ *
+ * tbgrpi_spi.c
+ *
+ * This file is part of Touchbridge
+ *
+ * Copyright 2015 James L Macfarlane
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * SPI transport for the HAT interface, using spidev.
+ *
+ * Every transaction exchanges one fixed-size frame each way (see
+ * tbgrpi_protocol.h in the firmware). What we get back was prepared
+ * by the HAT at the end of the previous frame, so it's labelled with
+ * the register it came from and we sort it out here: CAN messages go
+ * on rxq with their arrival times, anything else into rd_rec.
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+#include "debug.h"
+#include "tbg_rpi.h"
+#include "tbgrpi_spi.h"
+
+static int tbgrpi_spi_dev_xfer(tbgrpi_spi_t *spi, uint8_t *tx, uint8_t *rx, int len)
+{
+    struct spi_ioc_transfer tr;
+
+    memset(&tr, 0, sizeof(tr));
+    tr.tx_buf = (unsigned long)tx;
+    tr.rx_buf = (unsigned long)rx;
+    tr.len = len;
+    tr.speed_hz = spi->speed_hz;
+    tr.bits_per_word = 8;
+
+    return ioctl(spi->fd, SPI_IOC_MESSAGE(1), &tr);
+}
+
+static tbgrpi_t *tbgrpi_spi_new(void)
+{
+    tbgrpi_t *tpi = calloc(1, sizeof(tbgrpi_t));
+    tbgrpi_spi_t *spi = calloc(1, sizeof(tbgrpi_spi_t));
+    tpi->spi = spi;
+    // Every frame carries an address so there's always one selected.
+    tpi->addr = TBGRPI_ADDR_CAN;
+    tpi->bus_dir = -1;
+    spi->fd = -1;
+    spi->addr = -1;
+    spi->rd_addr = -1;
+    return tpi;
+}
+
+tbgrpi_t *tbgrpi_open_spi(const char *dev, uint32_t speed_hz)
+{
+    tbgrpi_t *tpi = tbgrpi_spi_new();
+    tbgrpi_spi_t *spi = tpi->spi;
+    uint8_t mode = SPI_MODE_0;
+    uint8_t bits = 8;
+    int ret;
+
+    spi->fd = open(dev, O_RDWR);
+    SYSERROR_IF(spi->fd < 0, "open: %s", dev);
+    ret = ioctl(spi->fd, SPI_IOC_WR_MODE, &mode);
+    SYSERROR_IF(ret < 0, "SPI_IOC_WR_MODE");
+    ret = ioctl(spi->fd, SPI_IOC_WR_BITS_PER_WORD, &bits);
+    SYSERROR_IF(ret < 0, "SPI_IOC_WR_BITS_PER_WORD");
+    ret = ioctl(spi->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz);
+    SYSERROR_IF(ret < 0, "SPI_IOC_WR_MAX_SPEED_HZ");
+
+    spi->speed_hz = speed_hz;
+    spi->xfer = tbgrpi_spi_dev_xfer;
+    return tpi;
+}
+
+/*
+ * Open a simulated HAT which loops messages we send it straight
+ * back, for trying out the SPI framing without any hardware.
+ */
+tbgrpi_t *tbgrpi_open_spi_sim(void)
+{
+    tbgrpi_t *tpi = tbgrpi_spi_new();
+    tpi->spi->sim = tbgrpi_spi_sim_new();
+    tpi->spi->xfer = tbgrpi_spi_sim_xfer;
+    return tpi;
+}
+
+void tbgrpi_spi_close(tbgrpi_t *tpi)
+{
+    if (tpi->spi->fd >= 0) {
+        close(tpi->spi->fd);
+    }
+    free(tpi->spi->sim);
+    free(tpi->spi);
+    free(tpi);
+}
+
+/*
+ * Give the HAT time to deal with the last frame before starting
+ * the next one.
+ */
+static void tbgrpi_spi_gap(tbgrpi_spi_t *spi)
+{
+    struct timespec now;
+    long elapsed_us;
+
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed_us = (now.tv_sec - spi->last.tv_sec) * 1000000L +
+            (now.tv_nsec - spi->last.tv_nsec) / 1000;
+    } while (elapsed_us >= 0 && elapsed_us < TBGRPI_SPI_GAP_US);
+}
+
+/*
+ * Send a frame to the HAT with addr_conf and count records of size
+ * bytes each from recs, and file away whatever comes back.
+ */
+void tbgrpi_spi_exchange(tbgrpi_t *tpi, uint8_t addr_conf, void *recs, int count, int size)
+{
+    tbgrpi_spi_t *spi = tpi->spi;
+    uint8_t tx[TBGRPI_SPI_FRAME_SIZE];
+    uint8_t rx[TBGRPI_SPI_FRAME_SIZE];
+
+    if (count * size > TBGRPI_SPI_PAYLOAD_SIZE) {
+        ERROR("SPI frame too big: %d records of %d bytes\n", count, size);
+    }
+    memset(tx, 0, sizeof(tx));
+    tx[TBGRPI_SPI_ADDR] = addr_conf;
+    tx[TBGRPI_SPI_COUNT] = count;
+    if (count) {
+        memcpy(tx + TBGRPI_SPI_HDR_SIZE, recs, count * size);
+    }
+
+    tbgrpi_spi_gap(spi);
+    int ret = spi->xfer(spi, tx, rx, TBGRPI_SPI_FRAME_SIZE);
+    clock_gettime(CLOCK_MONOTONIC, &spi->last);
+    uint64_t host_now = (uint64_t)spi->last.tv_sec * 1000000 + spi->last.tv_nsec / 1000;
+    SYSERROR_IF(ret < 0, "SPI transfer");
+
+    spi->addr = (addr_conf & TBGRPI_ADDR_BIT_MASK) >> TBGRPI_ADDR_BIT_SHIFT;
+    if (addr_conf & TBGRPI_CONF_RX_OVERFLOW_RESET) {
+        spi->overflow = 0;
+    }
+
+    spi->stat = rx[TBGRPI_SPI_ADDR] & ~TBGRPI_ADDR_BIT_MASK;
+    int rx_addr = (rx[TBGRPI_SPI_ADDR] & TBGRPI_ADDR_BIT_MASK) >> TBGRPI_ADDR_BIT_SHIFT;
+    int n = rx[TBGRPI_SPI_COUNT];
+    if (n == 0) {
+        return;
+    }
+    if (rx_addr == TBGRPI_ADDR_CAN || rx_addr == TBGRPI_ADDR_BURST_TS) {
+        uint8_t *rec = rx + TBGRPI_SPI_HDR_SIZE;
+        uint32_t hat_now, stamp;
+        memcpy(&hat_now, rec, sizeof(hat_now));
+        rec += TBGRPI_BURST_TS_NOW_SIZE;
+        for (int i = 0; i < n; i++) {
+            if (rec + TBGRPI_BURST_TS_REC_SIZE > rx + TBGRPI_SPI_FRAME_SIZE) {
+                break;
+            }
+            if (spi->rxq_used == TBGRPI_SPI_RXQ_SIZE) {
+                spi->overflow = 1;
+                break;
+            }
+            memcpy(spi->rxq + spi->rxq_in, rec, TBG_MSG_SIZE);
+            memcpy(&stamp, rec + TBG_MSG_SIZE, sizeof(stamp));
+            spi->rxq_us[spi->rxq_in] = TBGRPI_HAT_TO_HOST_US(host_now, hat_now, stamp);
+            spi->rxq_in = (spi->rxq_in + 1) % TBGRPI_SPI_RXQ_SIZE;
+            spi->rxq_used++;
+            rec += TBGRPI_BURST_TS_REC_SIZE;
+        }
+    } else {
+        memcpy(spi->rd_rec, rx + TBGRPI_SPI_HDR_SIZE, TBGRPI_SPI_PAYLOAD_SIZE);
+        spi->rd_addr = rx_addr;
+    }
+}
+
+static uint8_t tbgrpi_spi_addr_conf(tbgrpi_t *tpi)
+{
+    return (tpi->addr << TBGRPI_ADDR_BIT_SHIFT) | tpi->conf;
+}
+
+uint8_t tbgrpi_spi_read_status(tbgrpi_t *tpi)
+{
+    tbgrpi_spi_t *spi = tpi->spi;
+
+    tbgrpi_spi_exchange(tpi, tbgrpi_spi_addr_conf(tpi), NULL, 0, 0);
+
+    uint8_t stat = spi->stat;
+    if (spi->rxq_used) {
+        stat |= TBGRPI_STAT_RX_DATA_AVAIL;
+    }
+    if (spi->overflow) {
+        stat |= TBGRPI_STAT_RX_OVERFLOW;
+    }
+    return (spi->addr << TBGRPI_ADDR_BIT_SHIFT) | stat;
+}
+
+/*
+ * Read size bytes of the selected register. The first frame after
+ * selecting a register still brings back the old one's data, so it
+ * can take two goes.
+ */
+void tbgrpi_spi_read_data(tbgrpi_t *tpi, uint8_t *data, int size)
+{
+    tbgrpi_spi_t *spi = tpi->spi;
+
+    spi->rd_addr = -1;
+    for (int i = 0; i < 2 && spi->rd_addr != tpi->addr; i++) {
+        tbgrpi_spi_exchange(tpi, tbgrpi_spi_addr_conf(tpi), NULL, 0, 0);
+    }
+    if (size > TBGRPI_SPI_PAYLOAD_SIZE) {
+        size = TBGRPI_SPI_PAYLOAD_SIZE;
+    }
+    if (spi->rd_addr == tpi->addr) {
+        memcpy(data, spi->rd_rec, size);
+    } else {
+        memset(data, 0, size);
+    }
+}
+
+/*
+ * Get up to max messages received by the HAT, fetching more from it
+ * if we haven't got any already. If rx_us isn't NULL, put their
+ * arrival times in it. Returns the number of messages.
+ */
+int tbgrpi_spi_recv(tbgrpi_t *tpi, tbg_msg_t *msgs, uint64_t *rx_us, int max)
+{
+    tbgrpi_spi_t *spi = tpi->spi;
+    int n;
+
+    tpi->addr = TBGRPI_ADDR_CAN;
+    for (int i = 0; i < 2 && spi->rxq_used == 0; i++) {
+        int prev_addr = spi->addr;
+        tbgrpi_spi_exchange(tpi, tbgrpi_spi_addr_conf(tpi), NULL, 0, 0);
+        if (prev_addr == tpi->addr) {
+            break;
+        }
+    }
+    for (n = 0; n < max && spi->rxq_used; n++) {
+        msgs[n] = spi->rxq[spi->rxq_out];
+        if (rx_us) {
+            rx_us[n] = spi->rxq_us[spi->rxq_out];
+        }
+        spi->rxq_out = (spi->rxq_out + 1) % TBGRPI_SPI_RXQ_SIZE;
+        spi->rxq_used--;
+    }
+    return n;
+}
@@ -0,0 +1,70 @@
+/*
+ *
+ * tbgrpi_spi.h
+ *
+ * This file is part of Touchbridge
+ *
+ * Copyright 2015 James L Macfarlane
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef TBGRPI_SPI_H
+#define TBGRPI_SPI_H
+
+/*
+ * SPI transport for the HAT interface. Used by tbg_rpi.c, which
+ * passes calls here when a tbgrpi_t was opened with tbgrpi_open_spi()
+ * or tbgrpi_open_spi_sim().
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include "tbg_rpi.h"
+
+// Messages the HAT sent us that nobody has asked for yet.
+#define TBGRPI_SPI_RXQ_SIZE     (64)
+
+struct tbgrpi_spi_s;
+
+// Exchange a frame of len bytes with the HAT. Returns -1 on error.
+typedef int tbgrpi_spi_xfer_fn_t(struct tbgrpi_spi_s *spi, uint8_t *tx, uint8_t *rx, int len);
+
+typedef struct tbgrpi_spi_s {
+    tbgrpi_spi_xfer_fn_t *xfer;
+    int fd;                     // spidev file, -1 for the simulator
+    uint32_t speed_hz;
+    void *sim;                  // Loopback simulator state
+    struct timespec last;       // When the last frame ended
+    int addr;                   // Register selected by the last frame we sent
+    uint8_t stat;               // Status from the last frame we received
+    uint8_t overflow;           // Set if rxq overflowed, cleared with the HAT's
+    int rd_addr;                // Register rd_rec was read from, -1 if none
+    uint8_t rd_rec[TBGRPI_SPI_PAYLOAD_SIZE];
+    tbg_msg_t rxq[TBGRPI_SPI_RXQ_SIZE];
+    uint64_t rxq_us[TBGRPI_SPI_RXQ_SIZE];  // Arrival times
+    int rxq_in;
+    int rxq_out;
+    int rxq_used;
+} tbgrpi_spi_t;
+
+void tbgrpi_spi_close(tbgrpi_t *tpi);
+void tbgrpi_spi_exchange(tbgrpi_t *tpi, uint8_t addr_conf, void *recs, int count, int size);
+uint8_t tbgrpi_spi_read_status(tbgrpi_t *tpi);
+void tbgrpi_spi_read_data(tbgrpi_t *tpi, uint8_t *data, int size);
+int tbgrpi_spi_recv(tbgrpi_t *tpi, tbg_msg_t *msgs, uint64_t *rx_us, int max);
+
+void *tbgrpi_spi_sim_new(void);
+int tbgrpi_spi_sim_xfer(tbgrpi_spi_t *spi, uint8_t *tx, uint8_t *rx, int len);
+
+#endif // TBGRPI_SPI_H
@@ -0,0 +1,219 @@
+/*
+ *
+ * tbgrpi_spi_sim.c
+ *
+ * This file is part of Touchbridge
+ *
+ * Copyright 2015 James L Macfarlane
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Loopback simulator for the HAT end of the SPI transport.
+ *
+ * Plays the part of the HAT firmware's tbg_rpi_spi_frame_rx() and
+ * tbg_rpi_spi_frame_tx(), with CAN messages sent to it put straight
+ * into its RX buffer as if the CAN controller were in loopback mode.
+ * As in loopback they have to get through the acceptance filters, which
+ * start off passing everything. The config register keeps what's
+ * written to it, except that only the bit rates a HAT would take are.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tbg_rpi.h"
+#include "tbgrpi_spi.h"
+
+#define SIM_RX_FIFO_SIZE        (32)
+#define SIM_BITRATE_DEFAULT     (500)   // As TBG_CAN_BITRATE_DEFAULT
+
+typedef struct tbgrpi_spi_sim_s {
+    uint8_t next[TBGRPI_SPI_FRAME_SIZE];    // Frame to send at next xfer
+    uint8_t addr;
+    uint8_t conf;
+    uint8_t stat;
+    uint32_t cfg1;
+    uint32_t filt_id[TBGRPI_FILTER_BANKS];
+    uint32_t filt_mask[TBGRPI_FILTER_BANKS];
+    uint16_t filt_active;               // Bit per bank
+    tbg_msg_t fifo[SIM_RX_FIFO_SIZE];
+    uint32_t stamps[SIM_RX_FIFO_SIZE];
+    int in;
+    int out;
+    int used;
+} tbgrpi_spi_sim_t;
+
+// Stands in for the HAT's free-running microsecond counter.
+static uint32_t sim_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void *tbgrpi_spi_sim_new(void)
+{
+    tbgrpi_spi_sim_t *sim = calloc(1, sizeof(tbgrpi_spi_sim_t));
+
+    // Bank 0 catches everything, as tbg_can_setup() leaves it.
+    sim->filt_active = 1;
+    sim->cfg1 = (uint32_t)SIM_BITRATE_DEFAULT << TBGRPI_CFG1_BITRATE_SHIFT;
+    return sim;
+}
+
+static int sim_filter_pass(tbgrpi_spi_sim_t *sim, tbg_msg_t *msg)
+{
+    for (int i = 0; i < TBGRPI_FILTER_BANKS; i++) {
+        if ((sim->filt_active & (1 << i)) &&
+                ((msg->id ^ sim->filt_id[i]) & sim->filt_mask[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void sim_filter_set(tbgrpi_spi_sim_t *sim, int bank, uint32_t id, uint32_t mask, int active)
+{
+    if (bank < 0 || bank >= TBGRPI_FILTER_BANKS) {
+        return;
+    }
+    sim->filt_id[bank] = id;
+    sim->filt_mask[bank] = mask;
+    if (active) {
+        sim->filt_active |= 1 << bank;
+    } else {
+        sim->filt_active &= ~(1 << bank);
+    }
+}
+
+static void sim_cfg_write(tbgrpi_spi_sim_t *sim, uint32_t data, uint32_t mask)
+{
+    static const uint16_t bitrates[] = TBG_CAN_BITRATES;
+
+    if ((mask & TBGRPI_CFG1_BITRATE_MASK) == TBGRPI_CFG1_BITRATE_MASK) {
+        uint16_t kbps = data >> TBGRPI_CFG1_BITRATE_SHIFT;
+        int ok = 0;
+        for (int i = 0; i < (int)(sizeof(bitrates) / sizeof(bitrates[0])); i++) {
+            ok |= (kbps == bitrates[i]);
+        }
+        if (!ok) {
+            mask &= ~TBGRPI_CFG1_BITRATE_MASK;
+        }
+    } else {
+        mask &= ~TBGRPI_CFG1_BITRATE_MASK;
+    }
+    sim->cfg1 = (sim->cfg1 & ~mask) | (data & mask);
+}
+
+static void sim_frame_rx(tbgrpi_spi_sim_t *sim, uint8_t *frame)
+{
+    uint8_t addr_conf = frame[TBGRPI_SPI_ADDR];
+    uint8_t *rec = frame + TBGRPI_SPI_HDR_SIZE;
+
+    sim->addr = (addr_conf & TBGRPI_ADDR_BIT_MASK) >> TBGRPI_ADDR_BIT_SHIFT;
+    sim->conf = addr_conf & ~TBGRPI_ADDR_BIT_MASK;
+    if (addr_conf & TBGRPI_CONF_RX_OVERFLOW_RESET) {
+        sim->stat &= ~TBGRPI_STAT_RX_OVERFLOW;
+    }
+
+    for (int i = 0; i < frame[TBGRPI_SPI_COUNT]; i++) {
+        if (sim->addr == TBGRPI_ADDR_CAN) {
+            if (rec + TBG_MSG_SIZE > frame + TBGRPI_SPI_FRAME_SIZE) {
+                break;
+            }
+            tbg_msg_t msg;
+            memcpy(&msg, rec, TBG_MSG_SIZE);
+            rec += TBG_MSG_SIZE;
+            if (!sim_filter_pass(sim, &msg)) {
+                continue;
+            }
+            if (sim->used == SIM_RX_FIFO_SIZE) {
+                sim->stat |= TBGRPI_STAT_RX_OVERFLOW;
+            } else {
+                sim->fifo[sim->in] = msg;
+                sim->stamps[sim->in] = sim_time_us();
+                sim->in = (sim->in + 1) % SIM_RX_FIFO_SIZE;
+                sim->used++;
+            }
+        } else if (sim->addr == TBGRPI_ADDR_CONFIG_REG) {
+            uint32_t x[2];
+            memcpy(x, rec, sizeof(x));
+            sim_cfg_write(sim, x[0], x[1]);
+            break;
+        } else if (sim->addr == TBGRPI_ADDR_FILTER) {
+            uint32_t id, mask;
+            memcpy(&id, rec + TBGRPI_FILTER_ID, sizeof(id));
+            memcpy(&mask, rec + TBGRPI_FILTER_MASK, sizeof(mask));
+            sim_filter_set(sim, rec[TBGRPI_FILTER_BANK], id, mask,
+                    rec[TBGRPI_FILTER_FLAGS] & TBGRPI_FILTER_FLAG_ACTIVE);
+            break;
+        } else if (sim->addr == TBGRPI_ADDR_FILT1 || sim->addr == TBGRPI_ADDR_FILT2) {
+            uint32_t x[2];
+            memcpy(x, rec, sizeof(x));
+            sim_filter_set(sim, sim->addr - TBGRPI_ADDR_FILT1, x[0], x[1], 1);
+            break;
+        } else {
+            break;
+        }
+    }
+}
+
+static void sim_frame_tx(tbgrpi_spi_sim_t *sim, uint8_t *frame)
+{
+    uint8_t *rec = frame + TBGRPI_SPI_HDR_SIZE;
+    uint8_t n = 0;
+
+    memset(frame, 0, TBGRPI_SPI_FRAME_SIZE);
+    if (sim->addr == TBGRPI_ADDR_CAN || sim->addr == TBGRPI_ADDR_BURST_TS) {
+        uint32_t now = sim_time_us();
+        memcpy(rec, &now, sizeof(now));
+        rec += TBGRPI_BURST_TS_NOW_SIZE;
+        while (n < TBGRPI_SPI_MSGS_MAX && sim->used) {
+            memcpy(rec, sim->fifo + sim->out, TBG_MSG_SIZE);
+            memcpy(rec + TBG_MSG_SIZE, sim->stamps + sim->out, sizeof(uint32_t));
+            sim->out = (sim->out + 1) % SIM_RX_FIFO_SIZE;
+            sim->used--;
+            rec += TBGRPI_BURST_TS_REC_SIZE;
+            n++;
+        }
+    } else if (sim->addr == TBGRPI_ADDR_CONFIG_REG) {
+        memcpy(rec, &sim->cfg1, sizeof(sim->cfg1));
+        n = 1;
+    }
+    frame[TBGRPI_SPI_COUNT] = n;
+
+    // Messages go out as soon as they arrive so TX is always empty.
+    uint8_t stat = sim->stat | TBGRPI_STAT_TX_BUF_EMPTY;
+    if (sim->used) {
+        stat |= TBGRPI_STAT_RX_DATA_AVAIL;
+    }
+    frame[TBGRPI_SPI_ADDR] = (sim->addr << TBGRPI_ADDR_BIT_SHIFT) | stat;
+}
+
+int tbgrpi_spi_sim_xfer(tbgrpi_spi_t *spi, uint8_t *tx, uint8_t *rx, int len)
+{
+    tbgrpi_spi_sim_t *sim = spi->sim;
+
+    if (len != TBGRPI_SPI_FRAME_SIZE) {
+        return -1;
+    }
+    memcpy(rx, sim->next, len);
+    sim_frame_rx(sim, tx);
+    sim_frame_tx(sim, sim->next);
+    return len;
+}
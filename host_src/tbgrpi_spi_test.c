@@ -0,0 +1,195 @@
+/*
+ *
+ * tbgrpi_spi_test.c
+ *
+ * This file is part of Touchbridge
+ *
+ * Copyright 2015 James L Macfarlane
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Checks the SPI transport against the loopback simulator: messages,
+ * singly and in bursts, must come back as sent and in order, with
+ * sensible arrival times, and the config and filter registers must
+ * do what they say.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "tbg_rpi.h"
+#include "tbg_filter.h"
+
+static int fails;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        fails++; \
+    } \
+} while (0)
+
+static uint32_t seq;
+
+// A request to node addr, numbered so we can tell them apart.
+static void make_msg(tbg_msg_t *msg, int addr)
+{
+    memset(msg, 0, sizeof(*msg));
+    TBG_MSG_SET_EID(msg, 1);
+    TBG_MSG_SET_TYPE(msg, TBG_MSG_TYPE_REQ);
+    TBG_MSG_SET_DST_ADDR(msg, addr);
+    TBG_MSG_SET_DST_PORT(msg, 8);
+    msg->len = sizeof(seq);
+    memcpy(msg->data, &seq, sizeof(seq));
+    seq++;
+}
+
+static int same_msg(tbg_msg_t *a, tbg_msg_t *b)
+{
+    return a->id == b->id && a->len == b->len && memcmp(a->data, b->data, a->len) == 0;
+}
+
+/*
+ * Receive up to max messages, however many goes it takes. Checks
+ * their arrival times are between t0 and now.
+ */
+static int recv_all(tbgrpi_t *tpi, tbg_msg_t *msgs, int max, uint64_t t0)
+{
+    tbg_msg_t burst[TBGRPI_BURST_MSGS_MAX];
+    uint64_t rx_us[TBGRPI_BURST_MSGS_MAX];
+    int n = 0;
+
+    for (int tries = 0; tries < 2 * max + 2; tries++) {
+        int got = tbgrpi_recv_burst_ts(tpi, burst, rx_us);
+        uint64_t now = tbgrpi_now_us();
+        for (int i = 0; i < got; i++) {
+            CHECK(rx_us[i] >= t0 && rx_us[i] <= now,
+                    "arrival time %llu not in %llu..%llu",
+                    (unsigned long long)rx_us[i], (unsigned long long)t0, (unsigned long long)now);
+            if (n < max) {
+                msgs[n++] = burst[i];
+            }
+        }
+        if (!got && n) {
+            break;
+        }
+    }
+    return n;
+}
+
+static void test_single(tbgrpi_t *tpi)
+{
+    tbg_msg_t sent, got;
+
+    make_msg(&sent, 5);
+    tbgrpi_send_msg(tpi, &sent);
+    tbgrpi_recv_msg(tpi, &got);
+    CHECK(same_msg(&sent, &got), "single: message not looped back");
+}
+
+static void test_bursts(tbgrpi_t *tpi)
+{
+    tbg_msg_t sent[3 * TBGRPI_BURST_MSGS_MAX];
+    tbg_msg_t got[3 * TBGRPI_BURST_MSGS_MAX];
+    int n_sent = 0;
+
+    uint64_t t0 = tbgrpi_now_us();
+    // A full burst, a part one and another full one.
+    int sizes[] = { TBGRPI_BURST_MSGS_MAX, 3, TBGRPI_BURST_MSGS_MAX };
+    for (int b = 0; b < 3; b++) {
+        for (int i = 0; i < sizes[b]; i++) {
+            make_msg(sent + n_sent + i, 5 + i);
+        }
+        tbgrpi_send_burst(tpi, sent + n_sent, sizes[b]);
+        n_sent += sizes[b];
+    }
+
+    int n = recv_all(tpi, got, n_sent, t0);
+    CHECK(n == n_sent, "bursts: sent %d, got %d back", n_sent, n);
+    for (int i = 0; i < n && i < n_sent; i++) {
+        CHECK(same_msg(sent + i, got + i), "bursts: message %d differs", i);
+    }
+}
+
+static void test_config(tbgrpi_t *tpi)
+{
+    uint32_t cfg1;
+
+    CHECK(tbgrpi_get_bitrate(tpi) == 500, "config: bit rate %d at start", tbgrpi_get_bitrate(tpi));
+    tbgrpi_set_bitrate(tpi, 250);
+    CHECK(tbgrpi_get_bitrate(tpi) == 250, "config: bit rate %d, set 250", tbgrpi_get_bitrate(tpi));
+    tbgrpi_set_bitrate(tpi, 300);
+    CHECK(tbgrpi_get_bitrate(tpi) == 250, "config: bit rate %d, set 300", tbgrpi_get_bitrate(tpi));
+
+    // Setting other fields mustn't disturb the bit rate.
+    tbgrpi_set_time_sync(tpi, 1, 61);
+    tbgrpi_write_config(tpi, (TBGRPI_ADDR_CONFIG_REG << TBGRPI_ADDR_BIT_SHIFT) | tpi->conf);
+    tbgrpi_read_data(tpi, (uint8_t *)&cfg1, sizeof(cfg1));
+    CHECK(cfg1 & TBGRPI_CFG1_TIME_SYNC, "config: time sync not set, cfg1 0x%08X", cfg1);
+    CHECK((cfg1 & TBGRPI_CFG1_SRC_ADDR_MASK) >> TBGRPI_CFG1_SRC_ADDR_SHIFT == 61,
+            "config: source address wrong, cfg1 0x%08X", cfg1);
+    CHECK((cfg1 & TBGRPI_CFG1_BITRATE_MASK) >> TBGRPI_CFG1_BITRATE_SHIFT == 250,
+            "config: bit rate disturbed, cfg1 0x%08X", cfg1);
+    tbgrpi_set_time_sync(tpi, 0, 0);
+    tbgrpi_set_bitrate(tpi, 500);
+}
+
+static void test_filters(tbgrpi_t *tpi)
+{
+    tbg_msg_t sent[4], got[4];
+    tbg_filter_t f = TBG_FILTER_DST_ADDR(6);
+
+    // Only node 6's messages get through.
+    tbgrpi_set_filter(tpi, 0, f.id, f.mask, 1);
+    make_msg(sent + 0, 5);
+    make_msg(sent + 1, 6);
+    make_msg(sent + 2, 7);
+    make_msg(sent + 3, 6);
+    tbgrpi_send_burst(tpi, sent, 4);
+    int n = recv_all(tpi, got, 4, 0);
+    CHECK(n == 2 && same_msg(sent + 1, got + 0) && same_msg(sent + 3, got + 1),
+            "filters: %d through a one-node filter, expected 2", n);
+
+    // Nothing with them all off.
+    tbgrpi_set_filter(tpi, 0, 0, 0, 0);
+    tbgrpi_send_burst(tpi, sent, 4);
+    n = recv_all(tpi, got, 4, 0);
+    CHECK(n == 0, "filters: %d through with all banks off", n);
+
+    // Another bank catching everything lets the lot back through.
+    tbgrpi_set_filter(tpi, 13, TBG_MSG_ID_BIT_EID, 0, 1);
+    tbgrpi_send_burst(tpi, sent, 4);
+    n = recv_all(tpi, got, 4, 0);
+    CHECK(n == 4, "filters: %d through a catch-all in bank 13, expected 4", n);
+    tbgrpi_set_filter(tpi, 13, 0, 0, 0);
+    tbgrpi_set_filter(tpi, 0, 0, 0, 1);
+}
+
+int main(void)
+{
+    tbgrpi_t *tpi = tbgrpi_open_spi_sim();
+
+    test_single(tpi);
+    test_bursts(tpi);
+    test_config(tpi);
+    test_filters(tpi);
+    // And the messages still flow after all that.
+    test_bursts(tpi);
+
+    tbgrpi_close(tpi);
+    printf("tbgrpi_spi: %s\n", fails ? "FAILED" : "OK");
+    return fails != 0;
+}